@@ -92,6 +92,22 @@ struct device_tree_node
 error_t
 device_tree_parse_blob(const u8* blob, struct device_tree* tree);
 
+/// Returns the total size in bytes of the device tree blob, as recorded in its header.
+size_t
+device_tree_blob_size(const u8* blob);
+
+/// Reports every range of the memory reservation block and every `reg` range of the `/reserved-memory` children to
+/// `reserve_fn`. Doesn't allocate, so it can run before the physical memory manager is set up.
+error_t
+device_tree_scan_reserved(const u8* blob,
+                          error_t (*reserve_fn)(void* context, paddr_t base, size_t size),
+                          void* context);
+
+/// Returns the cache block size of the first hart that reports one through `riscv,cbom-block-size`, or 0 if none does.
+/// Doesn't allocate, like `device_tree_scan_reserved()`.
+size_t
+device_tree_cache_block_size(const u8* blob);
+
 struct device_tree_property*
 device_tree_get_property(struct device_tree_node* node, struct str_view name);
 
@@ -1,2 +1,15 @@
 /// Global kernel state.
-#pragma once
\ No newline at end of file
+#pragma once
+
+#include <riscv.h>
+#include <types/number.h>
+
+/// Maximum number of harts the kernel keeps per-hart state for.
+#define KERNEL_MAX_HARTS 8
+
+/// Returns the id of the calling hart. Every hart stores its id in the `tp` register as it enters the kernel.
+static inline u64
+kernel_hartid(void)
+{
+        return riscv_tp_read();
+}
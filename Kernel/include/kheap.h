@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stddef.h>
+#include <types/number.h>
+
+/// Largest size served from the size class slabs, anything larger takes whole pages.
+#define KHEAP_MAX_SMALL 2048
+
+/// Sets up the size class caches, the physical memory manager has to be initialized first.
+void
+kheap_initialize(void);
+
+/// Allocates `size` bytes of zeroed kernel memory, aligned to at least 16 bytes. Returns NULL if out of memory.
+void*
+kmalloc(size_t size);
+
+/// Frees memory returned by `kmalloc()`. The size is looked up from the page metadata, so it isn't passed in.
+void
+kfree_small(void* ptr);
+
+/// Returns the usable size of memory returned by `kmalloc()`, which is at least the size asked for.
+size_t
+ksize(const void* ptr);
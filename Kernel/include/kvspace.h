@@ -1,5 +1,7 @@
 #pragma once
 
+#include <pmm.h>
+#include <riscv.h>
 #include <stddef.h>
 #include <types/number.h>
 
@@ -9,6 +11,12 @@ struct allocation
         size_t size;
 };
 
+/// Size of the kernel virtual area `kvalloc()` maps its allocations into, which starts at the first gigapage boundary
+/// past the higher half direct mapping.
+#define KVSPACE_VMALLOC_SIZE (16UL * RISCV_SV39_GIGAPAGE_SIZE)
+/// Smallest physical range the higher half direct mapping is assumed to cover, whatever the memory map says.
+#define KVSPACE_HHDM_MIN_SIZE 0x100000000UL
+
 /// Use the higher half direct mapping to translate a physical address to a kernel virtual address.
 void*
 kernel_hhdm_phys_to_virt(u64 phys_addr);
@@ -23,15 +31,39 @@ kernel_hhdm_virt_to_phys(void* ptr);
 struct allocation
 kalloc(size_t size, size_t alignment);
 
+/// Same as `kalloc()`, with `flags` from `enum pmm_alloc_flags` passed through to the physical memory manager.
+struct allocation
+kalloc_flags(size_t size, size_t alignment, u64 flags);
+
 struct allocation
 kalloc_array(size_t count, size_t size);
 
+/// Resizes an allocation, keeping its contents up to the smaller of both sizes and zeroing the rest. The allocation
+/// grows or shrinks in place when it can, and is only moved when the frames after it are taken.
 struct allocation
 krealloc(struct allocation old, size_t new_size, size_t alignment);
 
+/// Resizes an allocation to an array of `count` elements of `size` bytes, returning an empty allocation if that size
+/// overflows.
 struct allocation
 krealloc_array(struct allocation old, size_t count, size_t size);
 
 /// Returns a pointer to a previously allocated region of memory to the physical memory manager.
 void
 kfree(struct allocation region);
+
+/// Sets up the `kvalloc()` area in the kernel page table `root`. The top level entries of the whole area are filled in
+/// up front, so that page tables copying the kernel's top level entries see every later `kvalloc()` mapping.
+void
+kvspace_vmalloc_initialize(struct riscv_sv39_pt* root);
+
+/// Allocates `size` bytes of zeroed memory that is contiguous in the kernel's virtual address space but not
+/// necessarily in physical memory, so that large buffers can still be allocated when physical memory is fragmented.
+/// The memory is mapped with megapages where 2MiB aligned frames happen to be free, and with pages everywhere else.
+/// Returns an empty allocation if out of memory or virtual address space.
+struct allocation
+kvalloc(size_t size);
+
+/// Unmaps an allocation returned by `kvalloc()` and gives its frames back to the physical memory manager.
+void
+kvfree(struct allocation region);
@@ -5,6 +5,17 @@
 #include <types/error.h>
 #include <types/number.h>
 
+/// Maximum number of memory map entries kept, entries past that are dropped.
+#define PLATFORM_MEMMAP_MAX_ENTRIES 128
+
+/// A memory map entry copied out of the Limine response, `type` is one of the `LIMINE_MEMMAP_*` values.
+struct platform_memmap_entry
+{
+        u64 base;
+        u64 length;
+        u64 type;
+};
+
 extern struct platform_info
 {
         /// Framebuffers
@@ -21,7 +32,19 @@ extern struct platform_info
         /// RISCV BSP Hart ID
         struct limine_riscv_bsp_hartid_response* bsp_hartid_response;
         u64 bsp_hartid;
+
+        /// The Limine responses live in bootloader reclaimable memory, so everything that's still needed once that
+        /// memory is reclaimed is copied out of them. The responses above are cleared by `platform_info_copy_out()`.
+        struct platform_memmap_entry memmap[PLATFORM_MEMMAP_MAX_ENTRIES];
+        size_t memmap_count;
+        /// Device tree blob, in kernel memory once `platform_info_copy_out()` has run.
+        const u8* dtb;
 } pinfo;
 
 void
-populate_platform_info(void);
\ No newline at end of file
+populate_platform_info(void);
+
+/// Copies the device tree blob out of bootloader memory and drops the references to the Limine responses. Must be
+/// called once the physical memory manager is up, and before bootloader reclaimable memory is reclaimed.
+error_t
+platform_info_copy_out(void);
\ No newline at end of file
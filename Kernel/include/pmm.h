@@ -8,26 +8,134 @@ enum pmm_policy
         PMM_POLICY_BEST_FIT,
         PMM_POLICY_WORST_FIT,
         PMM_POLICY_NEXT_FIT,
+        /// Binary buddy allocator, every allocation is naturally aligned to its power-of-two size and freed blocks are
+        /// coalesced with their buddies.
+        PMM_POLICY_BUDDY,
+};
+
+enum pmm_alloc_flags
+{
+        /// The returned memory is zeroed.
+        PMM_ALLOC_DEFAULT = 0x0,
+        /// The returned memory is left as is, for callers that overwrite all of it straight away.
+        PMM_ALLOC_NOZERO = 0x1,
+        /// Fail straight away rather than draining caches, compacting or running reclaim, for opportunistic requests
+        /// that have a cheaper fallback.
+        PMM_ALLOC_NORETRY = 0x2,
+};
+
+/// Called after the compactor moved a movable frame from `from` to `to`. The contents and the page metadata are
+/// already copied over, the callback updates whatever still refers to the old frame. Returning an error leaves the
+/// frame where it was.
+typedef error_t (*pmm_migrate_fn)(void* context, paddr_t from, paddr_t to);
+
+/// Called when an allocation can't be met, releases whatever memory the subsystem caches and can spare. Returns the
+/// number of bytes given back to the physical memory manager.
+typedef size_t (*pmm_reclaim_fn)(void* context);
+
+/// Counters of a hart's frame magazine, the per-hart cache of free frames in front of the global allocator.
+struct pmm_magazine_stats
+{
+        /// Single frame allocations served straight from the magazine.
+        u64 hits;
+        /// Single frame allocations that found the magazine empty.
+        u64 misses;
+        /// Batches of frames pulled from the global allocator into the magazine.
+        u64 refills;
+        /// Batches of frames pushed from the magazine back to the global allocator.
+        u64 drains;
+};
+
+/// Allocation size classes are page orders, class `n` counts requests of up to `1 << n` pages and the last class
+/// everything larger. Free run histograms use the same orders, rounded down.
+#define PMM_STATS_SIZE_CLASSES 20
+/// Latency bucket `n` counts allocations that took `[2^n, 2^(n+1))` cycles, the last bucket everything slower.
+#define PMM_STATS_LATENCY_BUCKETS 32
+
+/// Snapshot of the free memory of a single region.
+struct pmm_region_stats
+{
+        paddr_t region_base;
+        size_t region_size;
+        size_t free_bytes;
+        /// Free frames held in the region's frame bitmap. They count towards `free_bytes` but are never part of a
+        /// contiguous run.
+        size_t cached_frames;
+        /// Largest run of contiguous free memory in the policy backend, in bytes.
+        size_t largest_free_run;
+        /// Free runs of the policy backend by size class.
+        u64 free_runs[PMM_STATS_SIZE_CLASSES];
+};
+
+/// Counters of `pmm_alloc_flags()` and everything built on it, summed over all harts.
+struct pmm_alloc_stats
+{
+        u64 allocations[PMM_STATS_SIZE_CLASSES];
+        u64 failures[PMM_STATS_SIZE_CLASSES];
+        u64 latency[PMM_STATS_LATENCY_BUCKETS];
+};
+
+enum pmm_page_flags
+{
+        /// The page starts an allocation that hasn't been freed yet.
+        PMM_PAGE_ALLOCATED = 0x1,
+        /// The allocation came from `pmm_alloc_movable()`, so the compactor may move it.
+        PMM_PAGE_MOVABLE = 0x2,
+};
+
+/// Metadata kept for every page managed by the physical memory manager, found with `pmm_page_of()`. Only the first
+/// page of an allocation describes it, the metadata of the pages after it stays zeroed.
+struct pmm_page
+{
+        /// References to the allocation, it's handed out with one and freed by `pmm_page_put()` dropping the last.
+        u32 refcount;
+        /// Combination of `enum pmm_page_flags`.
+        u16 flags;
+        /// The allocation spans at most `1 << order` pages.
+        u8 order;
+        u8 reserved;
+        /// Exact number of pages in the allocation.
+        u32 pages;
+        /// Whoever holds the allocation (a page cache, an address space, ...), which may chain the pages it holds
+        /// through `owner_next`.
+        void* owner;
+        struct pmm_page* owner_next;
 };
 
 void
 pmm_initialize(enum pmm_policy pol);
 
-/// Adds a new contiguous memory region to the physical memory manager.
+/// Adds a new contiguous memory region to the physical memory manager. Ranges previously passed to
+/// `pmm_reserve_region()` are carved out, so the region may end up split into several.
 error_t
 pmm_add_region(u64 region_base, size_t region_size);
 
-/// Allocates a region from the physical memory manager with the requested size and alignment.
+/// Marks a physical range (firmware, device tree reservations, ...) that must never be handed out. Reservations only
+/// apply to regions added afterwards, reserving memory that is already managed fails.
+error_t
+pmm_reserve_region(paddr_t reserved_base, size_t reserved_size);
+
+/// Allocates a zeroed region from the physical memory manager with the requested size and alignment.
 error_t
 pmm_alloc_aligned(size_t size, size_t alignment, paddr_t* region);
 
+/// Allocates a region from the physical memory manager with the requested size and alignment, the `flags` are a
+/// combination of `enum pmm_alloc_flags`.
+error_t
+pmm_alloc_flags(size_t size, size_t alignment, u64 flags, paddr_t* region);
+
+/// Allocates `count` single frames, not necessarily contiguous, into `frames`. Cheaper than allocating them one at a
+/// time, the per-hart caches and frame bitmaps are emptied in one go. Either all frames are allocated or none.
+error_t
+pmm_alloc_pages_bulk(size_t count, u64 flags, paddr_t* frames);
+
 /// Allocates a region from the physical memory manager with the requested size and alignment, if
 /// there's an error, it will return NULL instead.
 paddr_t
 pmm_alloc_aligned_noerr(size_t size, size_t alignment);
 
-/// Allocates a region from the physical memory manager with the requsted size and PAGE_SIZE
-/// alignment.
+/// Allocates a zeroed region from the physical memory manager with the requsted size and PAGE_SIZE alignment, same as
+/// `pmm_alloc_flags()` with `PMM_ALLOC_DEFAULT`. Single frames come from the pre-zeroed pool when it has any.
 error_t
 pmm_alloc(size_t size, paddr_t* region);
 
@@ -36,9 +144,92 @@ pmm_alloc(size_t size, paddr_t* region);
 paddr_t
 pmm_alloc_noerr(size_t size);
 
-/// Frees a previously allocated region back to the physical memory manager.
+/// Frees a previously allocated region of `size` bytes back to the physical memory manager. The size is rounded up to
+/// the page size, the same way it was when the region was allocated.
 error_t
-pmm_free(paddr_t region);
+pmm_free(paddr_t region, size_t size);
+
+/// Grows the allocation at `region` from `old_size` to `new_size` bytes without moving it, by taking the frames right
+/// after it. Fails with `EC_PMM_OUT_OF_MEMORY` when any of them isn't free, leaving the allocation as it was, and with
+/// `EC_PMM_INVALID_FREE` when `old_size` isn't the size the allocation was made with.
+error_t
+pmm_grow_in_place(paddr_t region, size_t old_size, size_t new_size);
+
+/// Shrinks the allocation at `region` from `old_size` to `new_size` bytes, giving the frames past the new end back.
+/// Fails with `EC_PMM_INVALID_FREE` when `old_size` isn't the size the allocation was made with.
+error_t
+pmm_shrink_in_place(paddr_t region, size_t old_size, size_t new_size);
+
+/// Zeroes one frame ahead of time for the calling hart's pool of pre-zeroed frames, which serves zeroed single frame
+/// allocations. Meant to be called from the idle loop, returns false once there is nothing left to do.
+bool
+pmm_idle_zero(void);
+
+/// Allocates a single frame that may later be moved elsewhere to reassemble free megapages, `migrate_fn` is called
+/// whenever that happens. The frame is freed with `pmm_free()` like any other.
+error_t
+pmm_alloc_movable(u64 flags, pmm_migrate_fn migrate_fn, void* context, paddr_t* frame);
+
+/// Migrates movable frames until `megapages` more megablocks (naturally aligned 2 MiB runs) are entirely free, or no
+/// more of them can be freed. Returns the number of megablocks freed up. Megapage aligned allocations that don't fit
+/// run it on their own.
+size_t
+pmm_compact(size_t megapages);
+
+/// Returns the number of entirely free megablocks, each of which can back a single megapage mapping.
+size_t
+pmm_free_megapages(void);
+
+/// Returns the metadata of the page at `frame`, or NULL if the physical memory manager doesn't manage it.
+struct pmm_page*
+pmm_page_of(paddr_t frame);
+
+/// Takes another reference to the allocation starting at `frame`.
+error_t
+pmm_page_get(paddr_t frame);
+
+/// Drops a reference to the allocation starting at `frame`, freeing it when that was the last one. `pmm_free()`
+/// frees an allocation regardless of its references.
+error_t
+pmm_page_put(paddr_t frame);
+
+/// Returns the memory taken by the metadata of all regions, which isn't part of `pmm_total_memory()`.
+size_t
+pmm_metadata_memory(void);
+
+/// Returns the part of `pmm_metadata_memory()` taken by the page metadata.
+size_t
+pmm_page_metadata_memory(void);
+
+/// Copies the magazine counters of the given hart into `stats`.
+error_t
+pmm_magazine_stats(u64 hartid, struct pmm_magazine_stats* stats);
+
+/// Registers a hook that is run when memory runs out, before an allocation fails for good.
+error_t
+pmm_register_reclaim(pmm_reclaim_fn reclaim_fn, void* context);
+
+/// Returns the number of regions managed by the physical memory manager.
+size_t
+pmm_region_count(void);
+
+/// Fills `stats` with a snapshot of region `index`, regions are ordered by base address. Walks all free memory of the
+/// region, so it's meant for diagnostics only.
+error_t
+pmm_region_stats(size_t index, struct pmm_region_stats* stats);
+
+/// Copies the allocation counters and latency histogram into `stats`.
+error_t
+pmm_alloc_stats(struct pmm_alloc_stats* stats);
+
+/// Returns the largest run of contiguous free memory over all regions, the largest allocation that can succeed
+/// without draining caches or compacting.
+size_t
+pmm_largest_free_run(void);
+
+/// Prints the region snapshots, allocation counters and latency histogram to the console.
+void
+pmm_print_stats(void);
 
 /// Returns the total amount of free memory managed by the physical memory manager.
 size_t pmm_free_memory(void);
@@ -10,6 +10,9 @@
 
 #define RISCV_SV39_PT_ENTRY_COUNT 512
 
+/// Size of the range a page table entry at the given level (2 for the root) covers.
+#define RISCV_SV39_LEVEL_SIZE(level) ((u64)RISCV_SV39_PAGE_SIZE << (9 * (level)))
+
 enum riscv_sv39_pt_flags
 {
         RISCV_SV39_PTFLAG_VALID = 0x1,
@@ -20,8 +23,14 @@ enum riscv_sv39_pt_flags
         RISCV_SV39_PTFLAG_GLOBAL = 0x20,
         RISCV_SV39_PTFLAG_ACCESSED = 0x40,
         RISCV_SV39_PTFLAG_DIRTY = 0x80,
+        /// First of the two bits reserved for software, set on a leaf whose frame is shared copy-on-write, see
+        /// `riscv_sv39_share_range()`.
+        RISCV_SV39_PTFLAG_COW = 0x100,
 };
 
+/// The flags and the two bits reserved for software, below the physical page number of a pte.
+#define RISCV_SV39_PTE_FLAGS_MASK 0x3FF
+
 ///  Creates a page table entry from the given physical address and flags.
 static inline u64
 riscv_sv39_create_pte(paddr_t pa, u64 flags)
@@ -92,11 +101,155 @@ riscv_sv39_map_gigapage(struct riscv_sv39_pt* root, vaddr_t va, paddr_t pa, u64
 error_t
 riscv_sv39_unmap_small_page(struct riscv_sv39_pt* root, vaddr_t va, paddr_t* pa);
 
+/// Unmaps a mega page from the given page table. If any level of the page table doesn't exist, then an error is
+/// returned.
+error_t
+riscv_sv39_unmap_megapage(struct riscv_sv39_pt* root, vaddr_t va, paddr_t* pa);
+
+/// Addresses a TLB flush batch holds before it flushes the whole address space instead.
+#define RISCV_TLB_BATCH_SIZE 16
+/// ASID of a flush batch for global mappings, which are flushed from every address space.
+#define RISCV_TLB_GLOBAL ((u64)-1)
+
+/// Collects the translations that go stale while a page table is changed, so that they're flushed with as few fences as
+/// possible once all changes are done. A batch starts out zeroed with `asid` set to the address space of the page
+/// table, or to `RISCV_TLB_GLOBAL` for the kernel's global mappings.
+struct riscv_tlb_batch
+{
+        u64 asid;
+        vaddr_t addrs[RISCV_TLB_BATCH_SIZE];
+        size_t count;
+        /// More addresses were added than fit, so the whole address space is flushed.
+        bool full;
+};
+
+/// Adds the leaf mapping `va` to the batch, a single address covers a mega or giga page.
+void
+riscv_tlb_batch_add(struct riscv_tlb_batch* batch, vaddr_t va);
+
+/// Flushes the translations collected in the batch from this hart's TLB, and empties the batch.
+void
+riscv_tlb_batch_flush(struct riscv_tlb_batch* batch);
+
+/// Maps `len` bytes of physical memory starting at `pa` at `va`, walking the page table once for the whole range. Each
+/// part of the range is mapped with the largest leaf its alignment allows, so a 1GiB aligned window takes a single
+/// entry. Missing tables are created, and tables emptied by earlier unmaps make way for larger leaves. If any part of
+/// the range is already mapped, then nothing is mapped and an error is returned. The new leaves are added to `tlb`, or
+/// flushed as global mappings right away if `tlb` is NULL.
+error_t
+riscv_sv39_map_range(struct riscv_sv39_pt* root,
+                     vaddr_t va,
+                     paddr_t pa,
+                     size_t len,
+                     u64 flags,
+                     struct riscv_tlb_batch* tlb);
+
+/// Called for every leaf `riscv_sv39_unmap_range()` removes, with the addresses and the size of the leaf.
+typedef void (*riscv_sv39_unmap_fn)(void* context, vaddr_t va, paddr_t pa, size_t size);
+
+/// Unmaps `[va, va + len)`, walking the page table once for the whole range. Unmapped parts of the range are skipped.
+/// Mega and giga pages that only partly overlap the range are split into smaller leaves first. `unmapped` (which may be
+/// NULL) is called for every removed leaf. The tables themselves stay. The removed leaves are added to `tlb`, or
+/// flushed as global mappings right away if `tlb` is NULL.
+error_t
+riscv_sv39_unmap_range(struct riscv_sv39_pt* root,
+                       vaddr_t va,
+                       size_t len,
+                       riscv_sv39_unmap_fn unmapped,
+                       void* context,
+                       struct riscv_tlb_batch* tlb);
+
+/// Called for every leaf `riscv_sv39_share_range()` shares, with the addresses and the size of the leaf.
+typedef void (*riscv_sv39_share_fn)(void* context, vaddr_t va, paddr_t pa, size_t size);
+
+/// Maps the leaves of `src` in `[va, va + len)` at the same addresses in `dst`, so that both page tables point to the
+/// same memory. Writable leaves lose their write permission in both and are marked `RISCV_SV39_PTFLAG_COW` instead, so
+/// that the first store to them faults and the writer can take a private copy. Mega and giga pages that only partly
+/// overlap the range are split first. `shared` (which may be NULL) is called for every leaf once it's mapped in `dst`.
+/// If part of the range is mapped in `dst` already, then an error is returned and the leaves shared so far are kept.
+/// The leaves of `src` that lost their write permission are added to `tlb`, nothing cached for `dst` is flushed.
+error_t
+riscv_sv39_share_range(struct riscv_sv39_pt* src,
+                       struct riscv_sv39_pt* dst,
+                       vaddr_t va,
+                       size_t len,
+                       riscv_sv39_share_fn shared,
+                       void* context,
+                       struct riscv_tlb_batch* tlb);
+
+/// Sets the global bit on every leaf of the kernel half of `root`. Global translations are shared by all address spaces
+/// in the TLB, so they stay cached across address space switches. The TLB isn't flushed.
+void
+riscv_sv39_mark_global(struct riscv_sv39_pt* root);
+
+/// Copies every page table level of `root` into freshly allocated pages, the leaf entries are kept as they are.
+error_t
+riscv_sv39_copy(struct riscv_sv39_pt* root, struct riscv_sv39_pt** copy);
+
 /// Converts a virtual address to a physical address using the given page table. If no mapping exists, then 0 is
 /// returned.
 paddr_t
 riscv_sv39_virt_to_phys(struct riscv_sv39_pt* root, vaddr_t va);
 
+/// Returns the leaf entry mapping `va` and its level (0 for a small page) in `level`, or NULL if `va` isn't mapped.
+u64*
+riscv_sv39_find_leaf(struct riscv_sv39_pt* root, vaddr_t va, size_t* level);
+
+// ===================================================================================================
+// General Purpose Register Functions
+// ===================================================================================================
+
+/// Writes the given value to the `tp` register.
+static inline void
+riscv_tp_write(u64 value)
+{
+        __asm__ volatile("mv tp, %0" ::"r"(value));
+}
+
+/// Reads the value of the `tp` register.
+static inline u64
+riscv_tp_read(void)
+{
+        u64 value;
+        __asm__ volatile("mv %0, tp" : "=r"(value));
+        return value;
+}
+
+/// Stalls the hart until an interrupt might need servicing.
+static inline void
+riscv_wfi(void)
+{
+        __asm__ volatile("wfi");
+}
+
+/// Flushes every address translation cached by this hart.
+static inline void
+riscv_sfence_vma(void)
+{
+        __asm__ volatile("sfence.vma zero, zero" ::: "memory");
+}
+
+/// Flushes the translations of `va` cached by this hart, in every address space and including global ones.
+static inline void
+riscv_sfence_vma_addr(vaddr_t va)
+{
+        __asm__ volatile("sfence.vma %0, zero" ::"r"(va) : "memory");
+}
+
+/// Flushes the non-global translations of the address space `asid` cached by this hart.
+static inline void
+riscv_sfence_vma_asid(u64 asid)
+{
+        __asm__ volatile("sfence.vma zero, %0" ::"r"(asid) : "memory");
+}
+
+/// Flushes the non-global translation of `va` in the address space `asid` cached by this hart.
+static inline void
+riscv_sfence_vma_addr_asid(vaddr_t va, u64 asid)
+{
+        __asm__ volatile("sfence.vma %0, %1" ::"r"(va), "r"(asid) : "memory");
+}
+
 // ===================================================================================================
 // Machine-level CSR Functions
 // ===================================================================================================
@@ -110,6 +263,15 @@ riscv_time(void)
         return value;
 }
 
+/// Reads the number of cycles executed by the hart from the `cycle` CSR register.
+static inline u64
+riscv_cycle(void)
+{
+        u64 value;
+        __asm__ volatile("csrr %0, cycle" : "=r"(value));
+        return value;
+}
+
 /// Writes the given value to the `mstatus` CSR register.
 static inline void
 riscv_mstatus_write(u64 value)
@@ -271,6 +433,13 @@ riscv_pmpcfg0_read(void)
 // Supervisor-level CSR Functions
 // ===================================================================================================
 
+/// Privilege mode the hart trapped from in `sstatus`, set for supervisor mode.
+#define RISCV_SSTATUS_SPP (1UL << 8)
+/// Supervisor mode may load and store user pages in `sstatus`.
+#define RISCV_SSTATUS_SUM (1UL << 18)
+/// Loads from executable pages are allowed even if the pages aren't readable in `sstatus`.
+#define RISCV_SSTATUS_MXR (1UL << 19)
+
 /// Writes the given value to the `sstatus` CSR register.
 static inline void
 riscv_sstatus_write(u64 value)
@@ -431,6 +600,12 @@ riscv_senvcfg_read(void)
         return value;
 }
 
+/// Physical page number of the root page table in `satp`.
+#define RISCV_SATP_PPN_MASK ((1UL << 44) - 1)
+/// Address space identifier in `satp`, harts may implement fewer than all 16 bits.
+#define RISCV_SATP_ASID_SHIFT 44
+#define RISCV_SATP_ASID_MASK (0xFFFFUL << RISCV_SATP_ASID_SHIFT)
+
 /// Writes the given value to the `satp` CSR register.
 static inline void
 riscv_satp_write(u64 value)
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <riscv.h>
 #include <types/error.h>
 #include <types/number.h>
 
@@ -7,22 +8,61 @@ struct bump_alloc_region
 {
         u8* offset;
         u8* end;
-        struct bump_alloc_region* next;
+        /// Next region in the bin of the space the region has left, and whatever points to the region in that bin.
+        /// `bin_link` is NULL while the region is in no bin, because it's current or has too little space left.
+        struct bump_alloc_region* bin_next;
+        struct bump_alloc_region** bin_link;
 };
 
+/// Written into a region each time it becomes the current one, so that `bump_reset_to()` knows which regions to
+/// rewind and how far.
+struct bump_activation
+{
+        struct bump_alloc_region* region;
+        /// Offset of the region before the activation was written into it.
+        u8* offset;
+        struct bump_activation* previous;
+};
+
+/// Number of size bins, bin `n` holds regions with between 2^n and 2^(n+1) bytes of space left.
+#define BUMP_BIN_COUNT 48
+
+/// Size of the regions an auto refilling allocator takes from the physical memory manager, unless an allocation needs
+/// a larger one.
+#define BUMP_REFILL_SIZE (4 * RISCV_SV39_PAGE_SIZE)
+
 struct bump_alloc
 {
-        /// Linked list of regions, sorted by the amount of space left over in each region. This sorting is only
-        /// triggered when an allocation fails to fit in the first region.
-        ///
-        /// New regions are pushed straight to the front of the list.
+        /// Region allocations are served from, and the activations of every region in the order they happened, latest
+        /// first.
         struct bump_alloc_region* current;
-        struct bump_alloc_region* used_list;
+        struct bump_activation* activations;
+        /// All other regions with room left, binned by the space they have left whether they were used before or not.
+        /// Bit `n` of `bin_mask` is set when `bins[n]` is non-empty. When an allocation doesn't fit in `current`, the
+        /// smallest bin that is certain to fit it is found from the mask.
+        struct bump_alloc_region* bins[BUMP_BIN_COUNT];
+        u64 bin_mask;
+        /// Take a new region from the physical memory manager when no region fits an allocation.
+        bool auto_refill;
+};
+
+/// Checkpoint of a bump allocator, everything allocated after it was taken is released by `bump_reset_to()`.
+struct bump_mark
+{
+        struct bump_alloc_region* region;
+        u8* offset;
 };
 
 void
 bump_initialize(struct bump_alloc* bump);
 
+/// Initializes an allocator that takes regions of `BUMP_REFILL_SIZE` bytes (or larger, for large allocations) from
+/// the physical memory manager whenever it runs out.
+void
+bump_autorefill_initialize(struct bump_alloc* bump);
+
+/// Hands a buffer of at least a page to the allocator. `bump_destroy()` returns it to the physical memory manager, so
+/// it has to come from there.
 void
 bump_grow(struct bump_alloc* bump, void* buffer, size_t buffer_size);
 
@@ -32,5 +72,15 @@ bump_allocate(struct bump_alloc* bump, size_t size);
 void*
 bump_allocate_aligned(struct bump_alloc* bump, size_t size, size_t alignment);
 
+/// Takes a checkpoint of the allocator, checkpoints can be nested.
+struct bump_mark
+bump_mark(struct bump_alloc* bump);
+
+/// Releases everything allocated since `mark` was taken, along with any checkpoint taken after it. The regions stay
+/// with the allocator to be used again, regions added after the mark included.
+void
+bump_reset_to(struct bump_alloc* bump, struct bump_mark mark);
+
+/// Returns every region to the physical memory manager, leaving the allocator empty.
 error_t
 bump_destroy(struct bump_alloc* bump);
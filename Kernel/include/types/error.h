@@ -16,6 +16,12 @@ enum ErrorCode
         EC_PMM_REGION_ALREADY_MANAGED,
         EC_PMM_BAD_ALIGNMENT,
         EC_PMM_OUT_OF_MEMORY,
+        EC_PMM_INVALID_FREE,
+        EC_PMM_INVALID_HART,
+        EC_PMM_RESERVED_LIST_FULL,
+        EC_PMM_PAGE_NOT_ALLOCATED,
+        EC_PMM_INVALID_REGION,
+        EC_PMM_RECLAIM_LIST_FULL,
 
         // Riscv Paging Errors
         EC_RISCV_SV39_UNALIGNED_ADDR,
@@ -23,6 +29,13 @@ enum ErrorCode
         EC_RISCV_SV39_MAPPING_EXISTS,
         EC_RISCV_SV39_NO_MAPPING,
 
+        // Virtual Memory Manager Errors
+        EC_VMM_BAD_RANGE,
+        EC_VMM_AREA_OVERLAP,
+        EC_VMM_NO_SPACE,
+        EC_VMM_NO_AREA,
+        EC_VMM_PROTECTION_FAULT,
+
         // Virtio Errors
         EC_VIRTIO_INVALID_MAGIC,
         EC_VIRTIO_UNSUPPORTED_VERSION,
@@ -35,6 +48,7 @@ enum ErrorCode
         EC_DT_BLOB_REWRITE_FAILED,
         EC_DT_ADDRESS_CELLS_TOO_LARGE,
         EC_DT_SIZE_CELLS_TOO_LARGE,
+        EC_DT_BLOB_INVALID_TOKEN,
 
         // Driver Errors
         EC_DEVICE_NO_DEVICES,
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <kernel.h>
 #include <stdalign.h>
 #include <types/error.h>
 #include <types/number.h>
@@ -9,38 +10,154 @@ struct slab_block
         struct slab_block* next_block;
 };
 
+/// Header at the start of every slab, a `slab_size` aligned run of memory cut into blocks.
 struct slab_region
 {
+        /// Blocks freed back to this slab, handed out before the untouched blocks between `current_offset` and
+        /// `region_end`.
+        struct slab_block* block_list;
         u8* current_offset;
         u8* region_end;
+        /// Allocated blocks, and all blocks of the slab.
+        u32 in_use;
+        u32 capacity;
+        /// The arena allocated the slab itself, so `slab_shrink()` may give it back.
+        bool owned;
         struct slab_region* previous_region;
         struct slab_region* next_region;
 };
 
+/// Cache line size assumed until `slab_set_cache_line_size()` is called.
+#define SLAB_DEFAULT_CACHE_LINE 64
+
+/// Objects held by a magazine, sized so that a magazine fills two cache lines.
+#define SLAB_MAGAZINE_SIZE 14
+/// Full magazines the depot holds on to before it returns one to the slabs.
+#define SLAB_DEPOT_LIMIT 4
+
+/// A stack of free objects taken out of the slabs, which is exchanged between a hart and the depot as a whole.
+struct slab_magazine
+{
+        u64 count;
+        void* objects[SLAB_MAGAZINE_SIZE];
+        struct slab_magazine* next;
+};
+
+/// A hart's pair of magazines. Allocations pop from `loaded` and frees push onto it, `previous` is swapped in when
+/// `loaded` runs empty or full, so that a hart going back and forth at the edge of a magazine doesn't go to the depot
+/// every time.
+struct slab_hart_magazines
+{
+        struct slab_magazine* loaded;
+        struct slab_magazine* previous;
+};
+
+/// Puts a freshly carved object into its constructed state, and takes it out of that state before its slab is
+/// released.
+typedef void (*slab_ctor_fn)(void* obj);
+typedef void (*slab_dtor_fn)(void* obj);
+
 struct slab_alloc
 {
+        /// Size of the objects as asked for, and of the blocks holding them once the layout options are applied.
+        u64 object_size;
         u64 block_size;
+        /// Alignment of every block, `SLAB_BLOCK_ALIGN()` of the block size or a cache line for cache aligned arenas.
+        u64 block_align;
+        /// Blocks are rounded up to and aligned on a cache line, see `slab_set_cache_aligned()`.
+        bool cache_aligned;
+        /// Offset of the first block of the next slab past the slab header, in cache lines. Each new slab starts its
+        /// blocks one line further in, wrapping around once the leftover space at the end of a slab runs out, so that
+        /// the first blocks of different slabs don't all compete for the same cache sets.
+        u64 next_color;
         u64 free_blocks;
         u64 total_blocks;
-        /// slab operations maintain an invariant where previous_regions of current_region
-        /// are fully allocated out whereas regions with free slots left are added as a next_region.
-        struct slab_region* current_region;
-        struct slab_block* block_list;
+        /// Size and alignment of every slab, a power of two multiple of the page size. A block's slab is found by
+        /// aligning its address down.
+        u64 slab_size;
+        /// Slabs with both allocated and free blocks, slabs without free blocks and slabs without allocated blocks.
+        /// Allocations are served from partial slabs first, so that empty ones stay empty and can be shrunk.
+        struct slab_region* partial;
+        struct slab_region* full;
+        struct slab_region* empty;
         bool auto_refill;
+        /// Objects are zeroed on every allocation unless `slab_set_nozero()` or `slab_set_constructor()` was called.
+        bool zero;
+        /// Object constructor and destructor, see `slab_set_constructor()`.
+        slab_ctor_fn ctor;
+        slab_dtor_fn dtor;
+        /// Offset of the free list link inside a free block. Arenas with a constructor keep the link in a word past the
+        /// end of the object, so that freeing an object doesn't clobber its constructed state.
+        u64 link_offset;
+        /// Per-hart magazines in front of the slabs, only used once `slab_enable_magazines()` was called. Allocating
+        /// and freeing through them touches nothing but the calling hart's magazines, the depot and the slabs are only
+        /// visited a whole magazine at a time.
+        bool magazines;
+        struct slab_hart_magazines harts[KERNEL_MAX_HARTS];
+        /// The depot, full magazines waiting for any hart to load them and empty ones waiting to be filled.
+        struct slab_magazine* depot_full;
+        struct slab_magazine* depot_empty;
+        u64 depot_full_count;
+        /// Next arena in the list `slab_reclaim()` shrinks, auto refilling arenas join it when initialized.
+        struct slab_alloc* next_arena;
 };
 
 #define SLAB_BLOCK_BASE_SIZE sizeof(struct slab_block)
 #define SLAB_BLOCK_SIZE(objsize) ((objsize) > SLAB_BLOCK_BASE_SIZE ? (objsize) : SLAB_BLOCK_BASE_SIZE)
+/// Blocks are aligned to the largest power of two dividing their size, but never beyond a cache line. Block sizes
+/// needn't be powers of two, so they can't be used as an alignment themselves.
+#define SLAB_MAX_ALIGN 64
+#define SLAB_BLOCK_ALIGN(objsize)                                                                                      \
+        ((SLAB_BLOCK_SIZE(objsize) & -(size_t)SLAB_BLOCK_SIZE(objsize)) < SLAB_MAX_ALIGN                               \
+           ? (SLAB_BLOCK_SIZE(objsize) & -(size_t)SLAB_BLOCK_SIZE(objsize))                                            \
+           : SLAB_MAX_ALIGN)
+/// Size of a single slab holding `count` objects, buffers passed to `slab_grow()` must still be a multiple of the
+/// slab size.
 #define SLAB_REGION_SIZE(objsize, count)                                                                               \
-        (ALIGN_UP(sizeof(struct slab_region), SLAB_BLOCK_SIZE(objsize)) + SLAB_BLOCK_SIZE(objsize) * (count))
+        (ALIGN_UP(sizeof(struct slab_region), SLAB_BLOCK_ALIGN(objsize)) + SLAB_BLOCK_SIZE(objsize) * (count))
 #define SLAB_REGION_ALIGN (alignof(*(struct slab_region*)(0)))
 
+/// Sets the cache line size used for slab coloring and cache aligned arenas, a power of two. Must be called before any
+/// arena is initialized, the line size is usually the `riscv,cbom-block-size` of the device tree.
+void
+slab_set_cache_line_size(size_t line_size);
+
+/// Initializes an arena that only grows through `slab_grow()`.
 void
 slab_init(struct slab_alloc* arena, size_t objsize);
 
+/// Initializes an arena that allocates a page from the physical memory manager whenever it runs out of blocks.
 void
 slab_autorefill_init(struct slab_alloc* arena, size_t objsize);
 
+/// Same as `slab_autorefill_init()`, but the arena allocates slabs of `slab_size` bytes, a power of two multiple of
+/// the page size. Larger slabs waste less memory at their end when the objects are large.
+void
+slab_autorefill_init_sized(struct slab_alloc* arena, size_t objsize, size_t slab_size);
+
+/// Puts per-hart magazines in front of the arena's slabs, for arenas of hot objects that are allocated and freed from
+/// many harts.
+void
+slab_enable_magazines(struct slab_alloc* arena);
+
+/// Stops the arena from zeroing objects on allocation, for objects whose every field is set by the caller anyway.
+void
+slab_set_nozero(struct slab_alloc* arena);
+
+/// Rounds the arena's blocks up to a whole number of cache lines and aligns them on one, so that no two objects share a
+/// line. Meant for objects written from several harts. Must be called before the arena holds any slabs.
+void
+slab_set_cache_aligned(struct slab_alloc* arena);
+
+/// Turns the arena into an object cache. `ctor` runs once on every object the first time it is carved from a slab, and
+/// `dtor` (which may be NULL) runs on every constructed object of a slab before the slab is released. Objects are
+/// neither zeroed nor reconstructed in between, so they must be freed in their constructed state. Must be called
+/// before the arena holds any slabs.
+void
+slab_set_constructor(struct slab_alloc* arena, slab_ctor_fn ctor, slab_dtor_fn dtor);
+
+/// Hands a buffer to the arena, which must be aligned to and a multiple of the arena's slab size. Buffers given this
+/// way are never released by `slab_shrink()`.
 void
 slab_grow(struct slab_alloc* arena, void* buffer, size_t buffer_size);
 
@@ -48,4 +165,29 @@ void*
 slab_allocate(struct slab_alloc* arena);
 
 error_t
-slab_free(struct slab_alloc* arena, void* obj);
\ No newline at end of file
+slab_free(struct slab_alloc* arena, void* obj);
+
+/// Allocates up to `count` objects into `objs`, and returns how many were allocated. Fewer than `count` are only
+/// returned when memory runs out. Slabs are moved between the slab lists once per batch rather than once per object.
+size_t
+slab_allocate_bulk(struct slab_alloc* arena, size_t count, void** objs);
+
+/// Frees `count` objects of the arena at once. Runs of objects from the same slab are cheapest to free.
+error_t
+slab_free_bulk(struct slab_alloc* arena, size_t count, void** objs);
+
+/// Returns the empty slabs the arena allocated itself to the physical memory manager, returns the number of bytes
+/// released. The objects in the depot and in the calling hart's magazines go back to the slabs first, the magazines of
+/// other harts are left alone.
+size_t
+slab_shrink(struct slab_alloc* arena);
+
+/// Times colored against uncolored slabs and cache aligned against packed blocks with the `cycle` counter, and prints
+/// the cycle counts. Runs at boot when the kernel is configured with `-DSLAB_BENCHMARK=ON`.
+void
+slab_benchmark(void);
+
+/// Shrinks every auto refilling arena. It's registered with the physical memory manager as a reclaim hook, so it runs
+/// on its own whenever an allocation can't be met.
+size_t
+slab_reclaim(void* context);
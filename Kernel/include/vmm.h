@@ -1,16 +1,150 @@
 // Virtual Memory Manager, creates and manages the address space for a processs
 #pragma once
 
+#include <riscv.h>
 #include <types/error.h>
+#include <types/number.h>
 
-struct vspace
-{};
+/// User space is the lower half of the Sv39 address space. The first page is never mapped, so that null pointer
+/// accesses always fault.
+#define VMM_USER_START RISCV_SV39_PAGE_SIZE
+#define VMM_USER_END 0x4000000000UL
 
+enum vm_prot
+{
+        VM_PROT_READ = 0x1,
+        VM_PROT_WRITE = 0x2,
+        VM_PROT_EXECUTE = 0x4,
+        /// The area is accessible from user mode.
+        VM_PROT_USER = 0x8,
+};
+
+enum vm_backing
+{
+        /// Zeroed frames owned by the area, which are freed when the area is unmapped. Frames shared with a clone of
+        /// the address space are freed once the last address space unmaps them.
+        VM_BACKING_ANONYMOUS,
+        /// A fixed physical range such as a device window, which the area doesn't own.
+        VM_BACKING_PHYSICAL,
+};
+
+enum vm_area_flags
+{
+        /// Anonymous areas only take up virtual address space until they're touched, each page gets a zeroed frame on
+        /// its first access.
+        VM_AREA_DEFAULT = 0x0,
+        /// Frames are allocated and mapped when the area is created rather than when it's first touched.
+        VM_AREA_POPULATE = 0x1,
+};
+
+/// The kind of access that caused a page fault.
+enum vm_fault_access
+{
+        VM_FAULT_READ,
+        VM_FAULT_WRITE,
+        VM_FAULT_EXECUTE,
+};
+
+/// A page aligned range `[start, end)` of an address space with the same protection and backing.
+struct vm_area
+{
+        vaddr_t start;
+        vaddr_t end;
+        /// `enum vm_prot` and `enum vm_area_flags` values.
+        u64 prot;
+        u64 flags;
+        enum vm_backing backing;
+        /// Physical address `start` is mapped to, for `VM_BACKING_PHYSICAL` areas.
+        paddr_t phys;
+        /// Children in the AVL tree of the address space, ordered by address, and the height of the subtree below.
+        struct vm_area* left;
+        struct vm_area* right;
+        u64 height;
+        /// Neighbouring areas in address order, so that range operations can move from one area to the next without
+        /// going back to the tree.
+        struct vm_area* prev;
+        struct vm_area* next;
+};
+
+/// A user address space, a root page table along with the areas mapped into it. The areas are kept in an AVL tree, so
+/// that finding the area of a faulting address takes O(log n) however many areas there are.
+struct address_space
+{
+        struct riscv_sv39_pt* root;
+        struct vm_area* tree;
+        /// Lowest area, the head of the address ordered list of areas.
+        struct vm_area* first;
+        size_t area_count;
+        /// ASID the address space runs with and the ASID generation it was handed out in, see
+        /// `address_space_activate()`.
+        u64 asid;
+        u64 asid_generation;
+};
+
+/// Sets up the allocator of area descriptors and finds out how many ASIDs the hart implements, the physical memory
+/// manager has to be initialized first.
+void
+vmm_initialize(void);
+
+/// Initializes an empty address space. The kernel half of its root page table shares the top level entries of
+/// `kernel_root`, so kernel mappings below those entries (such as the `kvalloc()` area) show up in every address space.
+error_t
+address_space_initialize(struct address_space* as, struct riscv_sv39_pt* kernel_root);
+
+/// Unmaps every area, and frees the user half page tables and the root page table. The address space must not be
+/// active.
+void
+address_space_destroy(struct address_space* as);
+
+/// Switches the calling hart to the address space. Address spaces are told apart in the TLB by their ASID, so neither
+/// their translations nor the global kernel ones are flushed on a switch. ASIDs are handed out in generations: once
+/// they run out, the TLB is flushed and every address space gets a new ASID the next time it's activated.
 void
-vspace_initialize(struct vspace* vspace);
+address_space_activate(struct address_space* as);
+
+/// Returns the area holding `vaddr`, or NULL if it isn't mapped.
+struct vm_area*
+address_space_find(struct address_space* as, vaddr_t vaddr);
+
+/// Returns the lowest area overlapping `[start, end)`, or NULL if the range is unmapped. Later areas of the range
+/// follow through `next`.
+struct vm_area*
+address_space_find_range(struct address_space* as, vaddr_t start, vaddr_t end);
+
+/// Maps an anonymous area of `size` bytes at `vaddr`, which must not overlap an existing area. Unless `flags` has
+/// `VM_AREA_POPULATE`, no memory is allocated before the area's pages are touched.
+error_t
+address_space_allocate_fixed(struct address_space* as, vaddr_t vaddr, size_t size, u64 prot, u64 flags);
+
+/// Maps an anonymous area of `size` bytes at the lowest free address aligned to `alignment`, which is returned in
+/// `vaddr`.
+error_t
+address_space_allocate(struct address_space* as, vaddr_t* vaddr, size_t size, size_t alignment, u64 prot, u64 flags);
+
+/// Maps `size` bytes of physical memory starting at `paddr` at `vaddr`, which must not overlap an existing area.
+error_t
+address_space_map_physical(struct address_space* as, vaddr_t vaddr, paddr_t paddr, size_t size, u64 prot);
+
+/// Unmaps `[vaddr, vaddr + size)`, splitting the areas that only partly overlap it. Frames of anonymous areas are
+/// freed.
+error_t
+address_space_unmap(struct address_space* as, vaddr_t vaddr, size_t size);
+
+/// Makes `child` a copy of `parent` without copying any memory. Anonymous pages are shared copy-on-write, each shared
+/// frame gains a reference and loses its write permission in both address spaces. The first store to a shared page
+/// faults, and `address_space_handle_fault()` gives the writer its own copy. Physical areas are mapped into the child
+/// as they are. The parent keeps running with its ASID, its leaves that lost their write permission are flushed.
+error_t
+address_space_clone(struct address_space* parent, struct address_space* child);
 
+/// Resolves a page fault at `vaddr` in the address space. A page of an anonymous area that was never touched gets a
+/// zeroed frame, taken from the pre-zeroed pool when there is one. A store to a page shared copy-on-write gets a
+/// private copy of the page, unless no other address space shares it anymore. `sstatus` is the value at the time of
+/// the fault, the access is checked against the privilege mode it was made from and the SUM and MXR bits. Returns an
+/// error if the address isn't part of any area, or if neither the area nor the page mapped there allow the access.
 error_t
-vspace_allocate_fixed(struct vspace* vspace, vaddr_t vaddr, size_t size, u64 flags);
+address_space_handle_fault(struct address_space* as, vaddr_t vaddr, enum vm_fault_access access, u64 sstatus);
 
+/// Resolves a page fault in the address space active on the calling hart, see `address_space_handle_fault()`.
 error_t
-vspace_allocate(struct vspace* vspace, vaddr_t* vaddr, size_t size, size_t alignment, u64 flags);
\ No newline at end of file
+vmm_handle_fault(vaddr_t vaddr, enum vm_fault_access access, u64 sstatus);
@@ -0,0 +1,22 @@
+# Kernel entry point
+
+.set KERNEL_BOOT_STACK_SIZE, 0x10000
+
+.option norvc
+.section .text
+.global kernel_asm_entry
+.align 2
+kernel_asm_entry:
+        # Limine hands over control on a stack that lives in bootloader reclaimable memory. Switch to a stack in the
+        # kernel image first, so that memory can be given to the PMM later on.
+        la      sp, kernel_boot_stack_top
+        call    kernel_c_entry
+1:
+        wfi
+        j       1b
+
+.section .bss
+.align 12
+kernel_boot_stack:
+        .skip KERNEL_BOOT_STACK_SIZE
+kernel_boot_stack_top:
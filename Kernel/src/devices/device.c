@@ -80,6 +80,28 @@ devices_recursive_initialize(struct device_tree* tree, struct device_tree_node*
         }
 }
 
+/// Grows `hart_plic_map` until it has an entry for `hartid`. The map is doubled each time, in place when the frames
+/// after it are free.
+void
+devices_plic_map_reserve(u32 hartid)
+{
+        if (hartid < map_capacity) {
+                return;
+        }
+        size_t capacity = map_capacity;
+        while (capacity <= hartid) {
+                capacity *= 2;
+        }
+        struct allocation alloc = { hart_plic_map, map_alloc_size };
+        alloc = krealloc_array(alloc, capacity, sizeof(struct plic_driver*));
+        if (alloc.buffer == NULL) {
+                PANIC(SV("Failed to grow the hart to PLIC map to {D} entries."), capacity);
+        }
+        hart_plic_map = alloc.buffer;
+        map_alloc_size = alloc.size;
+        map_capacity = capacity;
+}
+
 void
 devices_init(struct device_tree* tree, u32 bsp_hartid)
 {
@@ -91,7 +113,6 @@ devices_init(struct device_tree* tree, u32 bsp_hartid)
         map_alloc_size = RISCV_SV39_PAGE_SIZE;
         map_capacity = map_alloc_size / sizeof(struct plic_driver*);
         hart_plic_map = alloc.buffer;
-        memzero(hart_plic_map, map_alloc_size);
 
         /// To initialize the device drivers, we must have a working plic driver for this hart.
         struct device_tree_node* plic_node = dt_node_from_compatible(tree, SV("riscv,plic0"));
@@ -112,6 +133,7 @@ devices_init(struct device_tree* tree, u32 bsp_hartid)
         plic_driver_node->next = drivers;
         drivers = plic_driver_node;
         driver_count++;
+        devices_plic_map_reserve(bsp_hartid);
         hart_plic_map[bsp_hartid] = &plic_driver_node->driver.d.plic;
 
         /// We can now safely initialize all other devices by walking the device tree.
@@ -90,9 +90,20 @@ device_tree_parse_node(struct device_tree* tree, struct device_tree_node** curre
         return offset + ALIGN_UP(new_node->name.size + 1, sizeof(u32));
 }
 
+/// Properties are allocated this many at a time while parsing, a blob has hundreds of them.
+#define PROPERTY_BATCH_SIZE 32
+
+/// Properties allocated ahead by `device_tree_first_pass_property()`, whatever is left after parsing is freed.
+struct property_batch
+{
+        struct device_tree_property* properties[PROPERTY_BATCH_SIZE];
+        size_t count;
+};
+
 size_t
 device_tree_first_pass_property(struct device_tree* tree,
                                 struct device_tree_node* current,
+                                struct property_batch* batch,
                                 const u8* structs,
                                 const char* strings,
                                 size_t offset)
@@ -102,7 +113,12 @@ device_tree_first_pass_property(struct device_tree* tree,
         u32 name_offset = READ_BIG_ENDIAN_U32(structs + offset);
         offset += sizeof(u32);
 
-        struct device_tree_property* new_prop = (struct device_tree_property*)slab_allocate(&tree->property_arena);
+        if (batch->count == 0) {
+                batch->count =
+                  slab_allocate_bulk(&tree->property_arena, PROPERTY_BATCH_SIZE, (void**)batch->properties);
+                ASSERT(batch->count > 0);
+        }
+        struct device_tree_property* new_prop = batch->properties[--batch->count];
         new_prop->name = sv_from_null_term((const char*)strings + name_offset);
         new_prop->type = DT_PROPERTY_RAW;
         new_prop->next_prop = current->properties;
@@ -242,6 +258,257 @@ device_tree_second_pass_properties(struct device_tree* tree, struct device_tree_
         return err;
 }
 
+size_t
+device_tree_blob_size(const u8* blob)
+{
+        const struct blob_header* hdr = (const struct blob_header*)blob;
+        return ENDIANNESS_FLIP_U32(hdr->total_size);
+}
+
+/// Reads a big endian value spanning `cells` <u32> cells, keeping the low 64 bits.
+u64
+device_tree_read_cells(const u8* data, u32 cells)
+{
+        u64 value = 0;
+        for (u32 i = 0; i < cells; i++) {
+                value = (value << 32) | READ_BIG_ENDIAN_U32(data + i * sizeof(u32));
+        }
+        return value;
+}
+
+/// Reports every (address, size) pair of a `reg` property to `reserve_fn`.
+error_t
+device_tree_report_reg(struct view reg,
+                       u32 address_cells,
+                       u32 size_cells,
+                       error_t (*reserve_fn)(void* context, paddr_t base, size_t size),
+                       void* context)
+{
+        size_t pair_size = sizeof(u32) * (address_cells + size_cells);
+        if (pair_size == 0) {
+                return EC_SUCCESS;
+        }
+        for (size_t j = 0; j + pair_size <= reg.size; j += pair_size) {
+                paddr_t base = device_tree_read_cells(reg.data + j, address_cells);
+                size_t size = device_tree_read_cells(reg.data + j + sizeof(u32) * address_cells, size_cells);
+                error_t err = reserve_fn(context, base, size);
+                if (error_is_err(err)) {
+                        return err;
+                }
+        }
+        return EC_SUCCESS;
+}
+
+/// A token of the structure block as handed out by `device_tree_walk_structs()`. Node starts carry the node name,
+/// properties their name and value. The root node and its properties are at depth 1.
+struct device_tree_token
+{
+        enum structure_token type;
+        size_t depth;
+        struct str_view name;
+        struct view value;
+};
+
+/// Walks the structure block of `blob` and calls `token_fn` for every node start, node end and property, stopping at
+/// the first error it returns. Doesn't allocate, so it can run before the physical memory manager is set up.
+error_t
+device_tree_walk_structs(const u8* blob,
+                         error_t (*token_fn)(void* context, const struct device_tree_token* token),
+                         void* context)
+{
+        struct blob_header* hdr = (struct blob_header*)blob;
+        if (DEVICE_TREE_BLOB_MAGIC != ENDIANNESS_FLIP_U32(hdr->magic)) {
+                return EC_DT_BLOB_INVALID_MAGIC;
+        }
+
+        const u8* structs = blob + ENDIANNESS_FLIP_U32(hdr->offset_structs);
+        const char* strings = (const char*)blob + ENDIANNESS_FLIP_U32(hdr->offset_strings);
+        size_t offset = 0;
+        size_t depth = 0;
+        for (;;) {
+                struct device_tree_token token = { 0 };
+                token.type = READ_BIG_ENDIAN_U32(structs + offset);
+                offset += sizeof(u32);
+
+                switch (token.type) {
+                        case STRUCTURE_TOKEN_NODE_START:
+                                token.name = sv_from_null_term((const char*)(structs + offset));
+                                offset += ALIGN_UP(token.name.size + 1, sizeof(u32));
+                                token.depth = ++depth;
+                                break;
+                        case STRUCTURE_TOKEN_NODE_END:
+                                token.depth = depth--;
+                                break;
+                        case STRUCTURE_TOKEN_PROPERTY: {
+                                u32 property_length = READ_BIG_ENDIAN_U32(structs + offset);
+                                u32 name_offset = READ_BIG_ENDIAN_U32(structs + offset + sizeof(u32));
+                                token.name = sv_from_null_term(strings + name_offset);
+                                token.value = (struct view){ structs + offset + 2 * sizeof(u32), property_length };
+                                token.depth = depth;
+                                offset += 2 * sizeof(u32) + ALIGN_UP(property_length, sizeof(u32));
+                                break;
+                        }
+                        case STRUCTURE_TOKEN_NOP:
+                                continue;
+                        case STRUCTURE_TOKEN_END:
+                                return EC_SUCCESS;
+                        default:
+                                return EC_DT_BLOB_INVALID_TOKEN;
+                }
+
+                error_t err = token_fn(context, &token);
+                if (error_is_err(err)) {
+                        return err;
+                }
+        }
+}
+
+/// State of `device_tree_scan_reserved()` while it walks the structure block. The root and `/reserved-memory` are at
+/// depth 1 and 2, the reserved ranges themselves at depth 3.
+struct device_tree_reserved_scan
+{
+        error_t (*reserve_fn)(void* context, paddr_t base, size_t size);
+        void* context;
+        u32 root_address_cells;
+        u32 root_size_cells;
+        u32 address_cells;
+        u32 size_cells;
+        bool in_reserved_memory;
+        bool child_enabled;
+        struct view child_reg;
+};
+
+/// Structure block callback of `device_tree_scan_reserved()`, reports the `reg` of every enabled `/reserved-memory`
+/// child once its node ends.
+error_t
+device_tree_reserved_token(void* context, const struct device_tree_token* token)
+{
+        struct device_tree_reserved_scan* scan = context;
+        switch (token->type) {
+                case STRUCTURE_TOKEN_NODE_START:
+                        if (token->depth == 2 && sv_compare(token->name, SV("reserved-memory")) == 0) {
+                                scan->in_reserved_memory = true;
+                                scan->address_cells = scan->root_address_cells;
+                                scan->size_cells = scan->root_size_cells;
+                        } else if (token->depth == 3 && scan->in_reserved_memory) {
+                                scan->child_enabled = true;
+                                scan->child_reg = (struct view){ NULL, 0 };
+                        }
+                        return EC_SUCCESS;
+                case STRUCTURE_TOKEN_NODE_END: {
+                        // Children without a `reg` are dynamically placed by the OS and reserve nothing yet.
+                        error_t err = EC_SUCCESS;
+                        if (token->depth == 3 && scan->in_reserved_memory && scan->child_enabled &&
+                            scan->child_reg.data != NULL) {
+                                err = device_tree_report_reg(scan->child_reg,
+                                                             scan->address_cells,
+                                                             scan->size_cells,
+                                                             scan->reserve_fn,
+                                                             scan->context);
+                        }
+                        if (token->depth == 2) {
+                                scan->in_reserved_memory = false;
+                        }
+                        return err;
+                }
+                default:
+                        break;
+        }
+
+        const u8* data = token->value.data;
+        bool IS_ADDRESS_CELLS = sv_compare(token->name, SV("#address-cells")) == 0;
+        bool IS_SIZE_CELLS = sv_compare(token->name, SV("#size-cells")) == 0;
+        bool IN_CHILD = token->depth == 3 && scan->in_reserved_memory;
+        if (token->depth == 1 && IS_ADDRESS_CELLS) {
+                scan->root_address_cells = READ_BIG_ENDIAN_U32(data);
+        } else if (token->depth == 1 && IS_SIZE_CELLS) {
+                scan->root_size_cells = READ_BIG_ENDIAN_U32(data);
+        } else if (token->depth == 2 && scan->in_reserved_memory && IS_ADDRESS_CELLS) {
+                scan->address_cells = READ_BIG_ENDIAN_U32(data);
+        } else if (token->depth == 2 && scan->in_reserved_memory && IS_SIZE_CELLS) {
+                scan->size_cells = READ_BIG_ENDIAN_U32(data);
+        } else if (IN_CHILD && sv_compare(token->name, SV("reg")) == 0) {
+                scan->child_reg = token->value;
+        } else if (IN_CHILD && sv_compare(token->name, SV("status")) == 0) {
+                struct str_view status = sv_from_null_term(data);
+                scan->child_enabled = sv_compare(status, SV("okay")) == 0 || sv_compare(status, SV("ok")) == 0;
+        }
+        if (scan->address_cells > 3 || scan->root_address_cells > 3) {
+                return EC_DT_ADDRESS_CELLS_TOO_LARGE;
+        }
+        if (scan->size_cells > 2 || scan->root_size_cells > 2) {
+                return EC_DT_SIZE_CELLS_TOO_LARGE;
+        }
+        return EC_SUCCESS;
+}
+
+error_t
+device_tree_scan_reserved(const u8* blob,
+                          error_t (*reserve_fn)(void* context, paddr_t base, size_t size),
+                          void* context)
+{
+        struct blob_header* hdr = (struct blob_header*)blob;
+        if (DEVICE_TREE_BLOB_MAGIC != ENDIANNESS_FLIP_U32(hdr->magic)) {
+                return EC_DT_BLOB_INVALID_MAGIC;
+        }
+
+        // The memory reservation block is a list of big endian (address, size) pairs ended by an all-zero entry.
+        const u64* buffer_rsvmap = (const u64*)(blob + ENDIANNESS_FLIP_U32(hdr->offset_rsvmap));
+        for (; buffer_rsvmap[0] != 0 || buffer_rsvmap[1] != 0; buffer_rsvmap += 2) {
+                error_t err =
+                  reserve_fn(context, ENDIANNESS_FLIP_U64(buffer_rsvmap[0]), ENDIANNESS_FLIP_U64(buffer_rsvmap[1]));
+                if (error_is_err(err)) {
+                        return err;
+                }
+        }
+
+        struct device_tree_reserved_scan scan = {
+                .reserve_fn = reserve_fn,
+                .context = context,
+                .root_address_cells = DEFAULT_ADDRESS_CELLS,
+                .root_size_cells = DEFAULT_SIZE_CELLS,
+                .address_cells = DEFAULT_ADDRESS_CELLS,
+                .size_cells = DEFAULT_SIZE_CELLS,
+                .in_reserved_memory = false,
+                .child_enabled = true,
+                .child_reg = { NULL, 0 },
+        };
+        return device_tree_walk_structs(blob, &device_tree_reserved_token, &scan);
+}
+
+/// Structure block callback of `device_tree_cache_block_size()`, keeps the first `riscv,cbom-block-size` it sees.
+error_t
+device_tree_cache_block_token(void* context, const struct device_tree_token* token)
+{
+        size_t* block_size = context;
+        if (*block_size == 0 && token->type == STRUCTURE_TOKEN_PROPERTY && token->value.size == sizeof(u32) &&
+            sv_compare(token->name, SV("riscv,cbom-block-size")) == 0) {
+                *block_size = READ_BIG_ENDIAN_U32(token->value.data);
+        }
+        return EC_SUCCESS;
+}
+
+size_t
+device_tree_cache_block_size(const u8* blob)
+{
+        size_t block_size = 0;
+        error_t err = device_tree_walk_structs(blob, &device_tree_cache_block_token, &block_size);
+        return error_is_ok(err) ? block_size : 0;
+}
+
+/// Records a reserved range in the parsed tree's `reserved_memory` list.
+error_t
+device_tree_record_reserved(void* context, paddr_t base, size_t size)
+{
+        struct device_tree* tree = context;
+        struct device_tree_reserved* rr = (struct device_tree_reserved*)slab_allocate(&tree->reserved_arena);
+        rr->region_base = base;
+        rr->region_size = size;
+        rr->next_region = tree->reserved_memory;
+        tree->reserved_memory = rr;
+        return EC_SUCCESS;
+}
+
 error_t
 device_tree_parse_blob(const u8* blob, struct device_tree* tree)
 {
@@ -252,20 +519,15 @@ device_tree_parse_blob(const u8* blob, struct device_tree* tree)
 
         slab_autorefill_init(&tree->node_arena, sizeof(struct device_tree_node));
         slab_autorefill_init(&tree->property_arena, sizeof(struct device_tree_property));
+        slab_set_nozero(&tree->property_arena);
         slab_autorefill_init(&tree->reserved_arena, sizeof(struct device_tree_reserved));
         slab_autorefill_init(&tree->phandlemap_arena, sizeof(struct device_tree_phandle_map));
-        bump_initialize(&tree->bump);
-        struct allocation bump_mem = kalloc(2 * RISCV_SV39_PAGE_SIZE, RISCV_SV39_PAGE_SIZE);
-        bump_grow(&tree->bump, bump_mem.buffer, bump_mem.size);
+        bump_autorefill_initialize(&tree->bump);
 
-        u64* buffer_rsvmap = (u64*)(blob + ENDIANNESS_FLIP_U32(hdr->offset_rsvmap));
         tree->reserved_memory = NULL;
-        while (buffer_rsvmap[0] != 0 && buffer_rsvmap[1] != 0) {
-                struct device_tree_reserved* rr = (struct device_tree_reserved*)slab_allocate(&tree->reserved_arena);
-                rr->region_base = ENDIANNESS_FLIP_U64(buffer_rsvmap[0]);
-                rr->region_size = ENDIANNESS_FLIP_U64(buffer_rsvmap[1]);
-                rr->next_region = tree->reserved_memory;
-                tree->reserved_memory = rr;
+        error_t err = device_tree_scan_reserved(blob, &device_tree_record_reserved, tree);
+        if (error_is_err(err)) {
+                return err;
         }
 
         const u8* structs = blob + ENDIANNESS_FLIP_U32(hdr->offset_structs);
@@ -274,6 +536,7 @@ device_tree_parse_blob(const u8* blob, struct device_tree* tree)
         size_t offset = 0;
         size_t depth = 0;
         struct device_tree_node* current = NULL;
+        struct property_batch batch = { .count = 0 };
         bool PARSING_STRUCTS = true;
         tree->root_node = NULL;
         while (PARSING_STRUCTS) {
@@ -295,7 +558,8 @@ device_tree_parse_blob(const u8* blob, struct device_tree* tree)
                                 depth--;
                                 break;
                         case STRUCTURE_TOKEN_PROPERTY:
-                                offset = device_tree_first_pass_property(tree, current, structs, strings, offset);
+                                offset =
+                                  device_tree_first_pass_property(tree, current, &batch, structs, strings, offset);
                                 break;
                         case STRUCTURE_TOKEN_NOP:
                                 break;
@@ -313,6 +577,10 @@ device_tree_parse_blob(const u8* blob, struct device_tree* tree)
                                 break;
                 }
         }
+        err = slab_free_bulk(&tree->property_arena, batch.count, (void**)batch.properties);
+        if (error_is_err(err)) {
+                return err;
+        }
 
         if (tree->root_node == NULL) {
                 return EC_DT_BLOB_EMPTY_TREE;
@@ -320,7 +588,7 @@ device_tree_parse_blob(const u8* blob, struct device_tree* tree)
 
         tree->root_node->address_cells = DEFAULT_ADDRESS_CELLS;
         tree->root_node->size_cells = DEFAULT_SIZE_CELLS;
-        error_t err = device_tree_second_pass_properties(tree, tree->root_node);
+        err = device_tree_second_pass_properties(tree, tree->root_node);
         if (error_is_err(err)) {
                 return error_push(err, EC_DT_BLOB_REWRITE_FAILED);
         }
@@ -21,7 +21,6 @@ plic_driver_init(struct plic_driver* driver, void* base, u32 hartid)
         driver->ctxt_interrupt_enable = (u32*)(base + PLIC_INTERRUPT_ENABLE + CONTEXT(hartid) * 0x80);
         driver->ctxt_interrupt_priority = (u32*)(base + PLIC_PRIORITY);
         driver->driver_map = kalloc(sizeof(struct driver*) * 1024, RISCV_SV39_PAGE_SIZE).buffer;
-        memzero(driver->driver_map, sizeof(struct driver*) * 1024);
         *driver->ctxt_threshold = 0;
 }
 
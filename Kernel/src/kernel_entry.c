@@ -2,6 +2,7 @@
 #include <devices/device.h>
 #include <devices/device_tree/blob.h>
 #include <fmt/print.h>
+#include <kheap.h>
 #include <kvspace.h>
 #include <limine/platform_info.h>
 #include <pmm.h>
@@ -10,12 +11,54 @@
 #include <types/bump_alloc.h>
 #include <types/error.h>
 #include <types/number.h>
+#include <types/slab.h>
 #include <uart.h>
+#include <vmm.h>
 
 struct device_tree dt = { 0 };
 struct trap_frame kernel_trap_frame = { 0 };
 struct riscv_sv39_pt* kernel_page_table = NULL;
 
+/// Moves the page tables out of bootloader reclaimable memory, then hands that memory to the physical memory manager.
+/// The boot stack, the memory map and the device tree blob were already moved out of it by then.
+void
+kernel_reclaim_bootloader_memory(void)
+{
+        struct riscv_sv39_pt* page_table = NULL;
+        error_t err = riscv_sv39_copy(kernel_page_table, &page_table);
+        if (error_is_err(err)) {
+                PANIC(error_string(err));
+        }
+        // The kernel half is the same in every address space, so its translations are made global and survive address
+        // space switches in the TLB.
+        riscv_sv39_mark_global(page_table);
+        paddr_t page_table_pa = kernel_hhdm_virt_to_phys(page_table);
+        riscv_satp_write((riscv_satp_read() & ~RISCV_SATP_PPN_MASK) | (page_table_pa >> 12));
+        riscv_sfence_vma();
+        kernel_page_table = page_table;
+        kernel_trap_frame.satp = riscv_satp_read();
+
+        size_t total_before = pmm_total_memory();
+        for (size_t i = 0; i < pinfo.memmap_count; i++) {
+                if (pinfo.memmap[i].type != LIMINE_MEMMAP_BOOTLOADER_RECLAIMABLE) {
+                        continue;
+                }
+                err = pmm_add_region(pinfo.memmap[i].base, pinfo.memmap[i].length);
+                if (error_is_err(err) && err != EC_PMM_REGION_TOO_SMALL) {
+                        PANIC(error_string(err));
+                }
+        }
+        kprintln(SV("Reclaimed {X} bytes of bootloader memory."), pmm_total_memory() - total_before);
+}
+
+/// Keeps the physical memory manager away from the ranges the device tree reserves.
+error_t
+kernel_reserve_dt_region(void* context, paddr_t base, size_t size)
+{
+        (void)context;
+        return pmm_reserve_region(base, size);
+}
+
 // Assembly trap handler entry point
 extern void
 kernel_asm_trap_handler(void);
@@ -25,6 +68,7 @@ kernel_c_entry()
 {
         error_t err = EC_SUCCESS;
         populate_platform_info();
+        riscv_tp_write(pinfo.bsp_hartid);
 
         uart_initialize(kernel_hhdm_phys_to_virt(0x10000000));
         kprint_initialize(&uart_put_char);
@@ -33,20 +77,41 @@ kernel_c_entry()
         paddr_t kernel_pt_paddr = riscv_satp_read() << 12;
         kernel_page_table = kernel_hhdm_phys_to_virt(kernel_pt_paddr);
 
-        pmm_initialize(PMM_POLICY_FIRST_FIT);
-        for (size_t i = 0; i < pinfo.memmap_response->entry_count; i++) {
-                struct limine_memmap_entry* entries = *pinfo.memmap_response->entries;
-                if (entries[i].type == LIMINE_MEMMAP_USABLE) {
-                        err = pmm_add_region(entries[i].base, entries[i].length);
+        // Slab layout depends on the cache line size, so it has to be known before the first arena is set up. The
+        // firmware's value is only trusted if it can serve as a block alignment, anything else keeps the default.
+        size_t cache_line = device_tree_cache_block_size(pinfo.dtb);
+        bool VALID_LINE = cache_line >= sizeof(u64) && cache_line <= RISCV_SV39_PAGE_SIZE &&
+                          (cache_line & (cache_line - 1)) == 0;
+        slab_set_cache_line_size(VALID_LINE ? cache_line : SLAB_DEFAULT_CACHE_LINE);
+        pmm_initialize(PMM_POLICY_BUDDY);
+        err = device_tree_scan_reserved(pinfo.dtb, &kernel_reserve_dt_region, NULL);
+        if (error_is_err(err)) {
+                PANIC(error_string(err));
+        }
+        for (size_t i = 0; i < pinfo.memmap_count; i++) {
+                if (pinfo.memmap[i].type == LIMINE_MEMMAP_USABLE) {
+                        err = pmm_add_region(pinfo.memmap[i].base, pinfo.memmap[i].length);
                         if (error_is_err(err)) {
                                 PANIC(error_string(err));
                         }
                 }
         }
         kprintln(SV("PMM initialized with {X} bytes of free memory."), pmm_free_memory());
+        kprintln(SV("PMM metadata takes {X} bytes, {X} of them page metadata."),
+                 pmm_metadata_memory(),
+                 pmm_page_metadata_memory());
+        kheap_initialize();
+#ifdef ENABLE_SLAB_BENCHMARK
+        slab_benchmark();
+#endif
+        vmm_initialize();
+        err = platform_info_copy_out();
+        if (error_is_err(err)) {
+                PANIC(error_string(err));
+        }
 
         // Parse the device tree blob structure.
-        err = device_tree_parse_blob(pinfo.dtb_response->dtb_ptr, &dt);
+        err = device_tree_parse_blob(pinfo.dtb, &dt);
         if (error_is_err(err)) {
                 PANIC(error_string(err));
         }
@@ -57,7 +122,8 @@ kernel_c_entry()
         kprintln(SV("Device driver initialization complete."));
 
         // Initialize the interrupt system.
-        struct allocation tf_stack_alloc = kalloc(4 * RISCV_SV39_PAGE_SIZE, RISCV_SV39_PAGE_SIZE);
+        struct allocation tf_stack_alloc =
+          kalloc_flags(4 * RISCV_SV39_PAGE_SIZE, RISCV_SV39_PAGE_SIZE, PMM_ALLOC_NOZERO);
         kernel_trap_frame.trap_stack = (u8*)tf_stack_alloc.buffer + tf_stack_alloc.size;
         kernel_trap_frame.stack_allocation = tf_stack_alloc;
         kernel_trap_frame.satp = riscv_satp_read();
@@ -72,6 +138,15 @@ kernel_c_entry()
         riscv_sstatus_write(riscv_sstatus_read() | (1UL << 1));
         kprintln(SV("Core local interrupt system initialized."));
 
+        kernel_reclaim_bootloader_memory();
+        // Set up once the final kernel page table is in place, it's where the kvalloc() area is mapped.
+        kvspace_vmalloc_initialize(kernel_page_table);
+
+        // The idle loop zeroes frames ahead of time while there's nothing else to do.
         kprintln(SV("Entering wait loop."));
-        for (;;);
+        for (;;) {
+                if (!pmm_idle_zero()) {
+                        riscv_wfi();
+                }
+        }
 }
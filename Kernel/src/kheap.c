@@ -0,0 +1,108 @@
+#include <assert.h>
+#include <kheap.h>
+#include <kvspace.h>
+#include <pmm.h>
+#include <riscv.h>
+#include <types/error.h>
+#include <types/slab.h>
+
+/// Object sizes of the size classes, powers of two with an intermediate step between each pair.
+static const size_t kheap_class_sizes[] = { 16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048 };
+
+#define KHEAP_CLASS_COUNT (sizeof(kheap_class_sizes) / sizeof(kheap_class_sizes[0]))
+
+/// Objects a slab of a size class holds at the least, slabs of the larger classes span several pages to keep the
+/// leftover at the end of a slab small.
+#define KHEAP_SLAB_OBJECTS 8
+
+/// Every page of a slab has its arena as the owner in its page metadata, which is how `kfree_small()` finds the size
+/// class of an object. Allocations too large for any size class are owned by `kheap_large` instead, which is never
+/// allocated from.
+struct slab_alloc kheap_caches[KHEAP_CLASS_COUNT] = { 0 };
+u8 kheap_large = 0;
+
+void
+kheap_initialize(void)
+{
+        for (size_t i = 0; i < KHEAP_CLASS_COUNT; i++) {
+                size_t slab_size = RISCV_SV39_PAGE_SIZE;
+                while (slab_size < KHEAP_SLAB_OBJECTS * kheap_class_sizes[i]) {
+                        slab_size *= 2;
+                }
+                slab_autorefill_init_sized(&kheap_caches[i], kheap_class_sizes[i], slab_size);
+                slab_enable_magazines(&kheap_caches[i]);
+        }
+}
+
+/// Returns the smallest size class that fits `size` bytes, `size` must not exceed `KHEAP_MAX_SMALL`.
+struct slab_alloc*
+kheap_cache_for(size_t size)
+{
+        size_t class = 0;
+        while (kheap_class_sizes[class] < size) {
+                class++;
+        }
+        return &kheap_caches[class];
+}
+
+/// Returns the page metadata of the page holding `ptr`, panicking if it doesn't belong to the heap.
+struct pmm_page*
+kheap_page_of(const void* ptr)
+{
+        paddr_t frame = ALIGN_DOWN(kernel_hhdm_virt_to_phys((void*)ptr), RISCV_SV39_PAGE_SIZE);
+        struct pmm_page* page = pmm_page_of(frame);
+        bool IS_LARGE = page != NULL && page->owner == &kheap_large;
+        bool IS_CACHED = page != NULL && page->owner >= (void*)kheap_caches &&
+                         page->owner < (void*)(kheap_caches + KHEAP_CLASS_COUNT);
+        if (!IS_LARGE && !IS_CACHED) {
+                PANIC(SV("kheap: {X} was not allocated by kmalloc."), (size_t)ptr);
+        }
+        return page;
+}
+
+void*
+kmalloc(size_t size)
+{
+        if (size > KHEAP_MAX_SMALL) {
+                paddr_t pa = 0;
+                error_t err = pmm_alloc_flags(size, RISCV_SV39_PAGE_SIZE, PMM_ALLOC_DEFAULT, &pa);
+                if (error_is_err(err)) {
+                        return NULL;
+                }
+                pmm_page_of(pa)->owner = &kheap_large;
+                return kernel_hhdm_phys_to_virt(pa);
+        }
+
+        return slab_allocate(kheap_cache_for(size));
+}
+
+void
+kfree_small(void* ptr)
+{
+        if (ptr == NULL) {
+                return;
+        }
+        struct pmm_page* page = kheap_page_of(ptr);
+        if (page->owner == &kheap_large) {
+                error_t err = pmm_free(kernel_hhdm_virt_to_phys(ptr), (size_t)page->pages * RISCV_SV39_PAGE_SIZE);
+                if (error_is_err(err)) {
+                        PANIC(SV("kheap: Failed to free {X}: {V}"), (size_t)ptr, SVP(error_string(err)));
+                }
+                return;
+        }
+        error_t err = slab_free(page->owner, ptr);
+        ASSERT(error_is_ok(err));
+}
+
+size_t
+ksize(const void* ptr)
+{
+        if (ptr == NULL) {
+                return 0;
+        }
+        struct pmm_page* page = kheap_page_of(ptr);
+        if (page->owner == &kheap_large) {
+                return (size_t)page->pages * RISCV_SV39_PAGE_SIZE;
+        }
+        return ((struct slab_alloc*)page->owner)->block_size;
+}
@@ -3,7 +3,10 @@
 #include <limine/platform_info.h>
 #include <memory.h>
 #include <pmm.h>
+#include <riscv.h>
+#include <stdint.h>
 #include <types/error.h>
+#include <types/slab.h>
 
 void*
 kernel_hhdm_phys_to_virt(u64 phys_addr)
@@ -19,11 +22,18 @@ kernel_hhdm_virt_to_phys(void* ptr)
 
 struct allocation
 kalloc(size_t size, size_t alignment)
+{
+        return kalloc_flags(size, alignment, PMM_ALLOC_DEFAULT);
+}
+
+struct allocation
+kalloc_flags(size_t size, size_t alignment, u64 flags)
 {
         paddr_t pa = 0;
-        error_t err = pmm_alloc_aligned(size, alignment, &pa);
+        error_t err = pmm_alloc_flags(size, alignment, flags, &pa);
         // pa = pmm_alloc_aligned_noerr(size, alignment);
         if (error_is_err(err)) {
+                pmm_print_stats();
                 PANIC(SV("kernel_alloc: {V}"), SVP(error_string(err)));
         }
         return (struct allocation){ kernel_hhdm_phys_to_virt(pa), size };
@@ -46,22 +56,308 @@ krealloc(struct allocation old, size_t new_size, size_t alignment)
                 return (struct allocation){ .buffer = NULL, .size = 0 };
         }
 
-        struct allocation new_alloc = kalloc(new_size, alignment);
+        // The allocation is resized where it is whenever it's suitably aligned: shrinking gives the tail frames back,
+        // growing takes the frames right after it if they're free. Either way, everything past the kept contents is
+        // zeroed, the same as when the allocation is moved.
+        paddr_t pa = kernel_hhdm_virt_to_phys(old.buffer);
+        size_t new_aligned = ALIGN_UP(new_size, RISCV_SV39_PAGE_SIZE);
+        if (IS_ALIGNED(pa, alignment)) {
+                error_t err = new_size < old.size ? pmm_shrink_in_place(pa, old.size, new_size)
+                                                  : pmm_grow_in_place(pa, old.size, new_size);
+                if (error_is_ok(err)) {
+                        size_t kept = old.size < new_size ? old.size : new_size;
+                        memzero((u8*)old.buffer + kept, new_aligned - kept);
+                        return (struct allocation){ .buffer = old.buffer, .size = new_size };
+                }
+        }
+
+        struct allocation new_alloc = kalloc_flags(new_size, alignment, PMM_ALLOC_NOZERO);
         if (new_alloc.buffer == NULL) {
                 return (struct allocation){ .buffer = NULL, .size = 0 };
         }
         size_t copy_size = old.size < new_size ? old.size : new_size;
         memcopy(new_alloc.buffer, old.buffer, copy_size);
+        memzero((u8*)new_alloc.buffer + copy_size, new_aligned - copy_size);
         kfree(old);
         return new_alloc;
 }
 
+struct allocation
+krealloc_array(struct allocation old, size_t count, size_t size)
+{
+        if (size != 0 && count > SIZE_MAX / size) {
+                return (struct allocation){ .buffer = NULL, .size = 0 };
+        }
+        return krealloc(old, count * size, RISCV_SV39_PAGE_SIZE);
+}
+
 void
 kfree(struct allocation region)
 {
+        if (region.buffer == NULL) {
+                return;
+        }
         paddr_t pa = kernel_hhdm_virt_to_phys(region.buffer);
-        error_t err = pmm_free(pa);
+        error_t err = pmm_free(pa, region.size);
+        if (error_is_err(err)) {
+                PANIC(SV("kernel_free: Failed to free memory: {V}"), SVP(error_string(err)));
+        }
+}
+/// A free range of the `kvalloc()` area. Free ranges are kept sorted by address, so that a freed range can be merged
+/// with its neighbours.
+struct kvspace_range
+{
+        vaddr_t base;
+        size_t size;
+        struct kvspace_range* next;
+};
+
+/// Frames mapped into the `kvalloc()` area are allocated this many at a time when no megapage is available.
+#define KVSPACE_FRAME_BATCH 16
+
+/// Mappings of the `kvalloc()` area, which are only ever touched by the kernel and are the same in every address
+/// space.
+#define KVSPACE_VMALLOC_FLAGS                                                                                          \
+        (RISCV_SV39_PTFLAG_READ | RISCV_SV39_PTFLAG_WRITE | RISCV_SV39_PTFLAG_ACCESSED | RISCV_SV39_PTFLAG_DIRTY |     \
+         RISCV_SV39_PTFLAG_GLOBAL)
+
+struct riscv_sv39_pt* kvspace_vmalloc_root = NULL;
+vaddr_t kvspace_vmalloc_start = 0;
+struct kvspace_range* kvspace_vmalloc_free = NULL;
+struct slab_alloc kvspace_range_arena = { 0 };
+
+void
+kvspace_vmalloc_initialize(struct riscv_sv39_pt* root)
+{
+        // The direct mapping covers every memory map entry, and at least the first 4GiB.
+        paddr_t hhdm_end = KVSPACE_HHDM_MIN_SIZE;
+        for (size_t i = 0; i < pinfo.memmap_count; i++) {
+                paddr_t end = pinfo.memmap[i].base + pinfo.memmap[i].length;
+                hhdm_end = end > hhdm_end ? end : hhdm_end;
+        }
+        vaddr_t start = ALIGN_UP(pinfo.hhdm_offset + hhdm_end, RISCV_SV39_GIGAPAGE_SIZE);
+        size_t first = (start >> 30) & 0x1FF;
+        size_t last = first + KVSPACE_VMALLOC_SIZE / RISCV_SV39_GIGAPAGE_SIZE;
+        if (start < pinfo.hhdm_offset || last > RISCV_SV39_PT_ENTRY_COUNT) {
+                PANIC(SV("kvspace: No room for the vmalloc area past the direct mapping."));
+        }
+        for (size_t i = first; i < last; i++) {
+                if (riscv_sv39_pte_valid(root->entries[i])) {
+                        PANIC(SV("kvspace: The vmalloc area at {X} overlaps an existing mapping."), start);
+                }
+        }
+        for (size_t i = first; i < last; i++) {
+                paddr_t table = 0;
+                error_t err = pmm_alloc(RISCV_SV39_PAGE_SIZE, &table);
+                if (error_is_err(err)) {
+                        PANIC(SV("kvspace: Failed to allocate the vmalloc area: {V}"), SVP(error_string(err)));
+                }
+                root->entries[i] = riscv_sv39_create_pte(table, RISCV_SV39_PTFLAG_VALID);
+        }
+
+        slab_autorefill_init(&kvspace_range_arena, sizeof(struct kvspace_range));
+        kvspace_vmalloc_free = slab_allocate(&kvspace_range_arena);
+        ASSERT(kvspace_vmalloc_free != NULL);
+        *kvspace_vmalloc_free = (struct kvspace_range){ .base = start, .size = KVSPACE_VMALLOC_SIZE, .next = NULL };
+        kvspace_vmalloc_start = start;
+        kvspace_vmalloc_root = root;
+}
+
+/// Takes `size` bytes of the `kvalloc()` area aligned to `alignment` from the first free range they fit in, returns 0
+/// if there's no such range.
+vaddr_t
+kvspace_range_take(size_t size, size_t alignment)
+{
+        for (struct kvspace_range** link = &kvspace_vmalloc_free; *link != NULL; link = &(*link)->next) {
+                struct kvspace_range* range = *link;
+                vaddr_t base = ALIGN_UP(range->base, alignment);
+                vaddr_t end = range->base + range->size;
+                if (base >= end || end - base < size) {
+                        continue;
+                }
+
+                // What's left before the aligned base stays in this range, what's left after the taken part goes into
+                // a range of its own.
+                if (base + size < end) {
+                        struct kvspace_range* tail = slab_allocate(&kvspace_range_arena);
+                        if (tail == NULL) {
+                                return 0;
+                        }
+                        tail->base = base + size;
+                        tail->size = end - tail->base;
+                        tail->next = range->next;
+                        range->next = tail;
+                }
+                if (base == range->base) {
+                        *link = range->next;
+                        error_t err = slab_free(&kvspace_range_arena, range);
+                        ASSERT(error_is_ok(err));
+                } else {
+                        range->size = base - range->base;
+                }
+                return base;
+        }
+        return 0;
+}
+
+/// Gives a range taken by `kvspace_range_take()` back, merging it with the free ranges right before and after it.
+void
+kvspace_range_give(vaddr_t base, size_t size)
+{
+        struct kvspace_range* prev = NULL;
+        struct kvspace_range* next = kvspace_vmalloc_free;
+        while (next != NULL && next->base < base) {
+                prev = next;
+                next = next->next;
+        }
+
+        bool MERGES_PREV = prev != NULL && prev->base + prev->size == base;
+        bool MERGES_NEXT = next != NULL && base + size == next->base;
+        if (MERGES_PREV && MERGES_NEXT) {
+                prev->size += size + next->size;
+                prev->next = next->next;
+                error_t err = slab_free(&kvspace_range_arena, next);
+                ASSERT(error_is_ok(err));
+        } else if (MERGES_PREV) {
+                prev->size += size;
+        } else if (MERGES_NEXT) {
+                next->base = base;
+                next->size += size;
+        } else {
+                struct kvspace_range* range = slab_allocate(&kvspace_range_arena);
+                if (range == NULL) {
+                        PANIC(SV("kvspace: Out of memory while freeing {X}."), base);
+                }
+                *range = (struct kvspace_range){ .base = base, .size = size, .next = next };
+                if (prev == NULL) {
+                        kvspace_vmalloc_free = range;
+                } else {
+                        prev->next = range;
+                }
+        }
+}
+
+/// Gives the frames behind a leaf of the `kvalloc()` area back once it's unmapped.
+void
+kvspace_vmalloc_release(void* context, vaddr_t va, paddr_t pa, size_t size)
+{
+        (void)context;
+        error_t err = pmm_free(pa, size);
         if (error_is_err(err)) {
-                PANIC(SV("kernel_free: Failed to free memory: {X}"), error_string(err));
+                PANIC(SV("kvspace: Failed to free the frames behind {X}: {V}"), va, SVP(error_string(err)));
         }
-}
\ No newline at end of file
+}
+
+/// Unmaps `size` bytes of the `kvalloc()` area starting at `base` and frees the frames behind them. Pages that aren't
+/// mapped are skipped, so that a partially mapped range can be undone. The page tables stay, they're reused by later
+/// allocations.
+void
+kvspace_vmalloc_unmap(vaddr_t base, size_t size, struct riscv_tlb_batch* tlb)
+{
+        error_t err = riscv_sv39_unmap_range(kvspace_vmalloc_root, base, size, &kvspace_vmalloc_release, NULL, tlb);
+        if (error_is_err(err)) {
+                PANIC(SV("kvspace: Failed to unmap {X}: {V}"), base, SVP(error_string(err)));
+        }
+}
+
+/// Backs `size` bytes of the `kvalloc()` area starting at `base` with zeroed frames. On failure, whatever was mapped so
+/// far is left for the caller to undo.
+error_t
+kvspace_vmalloc_map(vaddr_t base, size_t size, struct riscv_tlb_batch* tlb)
+{
+        vaddr_t va = base;
+        vaddr_t end = base + size;
+        while (va < end) {
+                // Megapages are only tried where one fits, and without letting the physical memory manager drain caches
+                // or compact for them, falling back to pages is cheaper than either.
+                if (IS_ALIGNED(va, RISCV_SV39_MEGAPAGE_SIZE) && end - va >= RISCV_SV39_MEGAPAGE_SIZE) {
+                        paddr_t pa = 0;
+                        error_t err =
+                          pmm_alloc_flags(RISCV_SV39_MEGAPAGE_SIZE, RISCV_SV39_MEGAPAGE_SIZE, PMM_ALLOC_NORETRY, &pa);
+                        // A page table left behind by an earlier allocation is reclaimed by the range mapping, should
+                        // the megapage not fit anyway it is given back and pages are mapped instead.
+                        if (error_is_ok(err)) {
+                                err = riscv_sv39_map_range(kvspace_vmalloc_root,
+                                                           va,
+                                                           pa,
+                                                           RISCV_SV39_MEGAPAGE_SIZE,
+                                                           KVSPACE_VMALLOC_FLAGS,
+                                                           tlb);
+                                if (error_is_ok(err)) {
+                                        va += RISCV_SV39_MEGAPAGE_SIZE;
+                                        continue;
+                                }
+                                error_t free_err = pmm_free(pa, RISCV_SV39_MEGAPAGE_SIZE);
+                                ASSERT(error_is_ok(free_err));
+                        }
+                }
+
+                // Otherwise pages are mapped up to the next megapage boundary, where a megapage is tried again.
+                vaddr_t run_end = ALIGN_UP(va + 1, RISCV_SV39_MEGAPAGE_SIZE);
+                run_end = run_end < end ? run_end : end;
+                size_t count = (run_end - va) / RISCV_SV39_PAGE_SIZE;
+                count = count < KVSPACE_FRAME_BATCH ? count : KVSPACE_FRAME_BATCH;
+                paddr_t frames[KVSPACE_FRAME_BATCH];
+                error_t err = pmm_alloc_pages_bulk(count, PMM_ALLOC_DEFAULT, frames);
+                if (error_is_err(err)) {
+                        return err;
+                }
+                for (size_t i = 0; i < count; i++, va += RISCV_SV39_PAGE_SIZE) {
+                        err = riscv_sv39_map_small_page(kvspace_vmalloc_root, va, frames[i], KVSPACE_VMALLOC_FLAGS);
+                        if (error_is_err(err)) {
+                                for (; i < count; i++) {
+                                        error_t free_err = pmm_free(frames[i], RISCV_SV39_PAGE_SIZE);
+                                        ASSERT(error_is_ok(free_err));
+                                }
+                                return err;
+                        }
+                        riscv_tlb_batch_add(tlb, va);
+                }
+        }
+        return EC_SUCCESS;
+}
+
+struct allocation
+kvalloc(size_t size)
+{
+        if (kvspace_vmalloc_root == NULL || size == 0 || size > KVSPACE_VMALLOC_SIZE) {
+                return (struct allocation){ .buffer = NULL, .size = 0 };
+        }
+
+        // Every allocation is followed by an unmapped guard page, and allocations of a megapage or more are megapage
+        // aligned so that they can be mapped with megapages.
+        size_t mapped = ALIGN_UP(size, RISCV_SV39_PAGE_SIZE);
+        size_t alignment = mapped >= RISCV_SV39_MEGAPAGE_SIZE ? RISCV_SV39_MEGAPAGE_SIZE : RISCV_SV39_PAGE_SIZE;
+        vaddr_t base = kvspace_range_take(mapped + RISCV_SV39_PAGE_SIZE, alignment);
+        if (base == 0) {
+                return (struct allocation){ .buffer = NULL, .size = 0 };
+        }
+        struct riscv_tlb_batch tlb = { .asid = RISCV_TLB_GLOBAL };
+        error_t err = kvspace_vmalloc_map(base, mapped, &tlb);
+        if (error_is_err(err)) {
+                kvspace_vmalloc_unmap(base, mapped, &tlb);
+                riscv_tlb_batch_flush(&tlb);
+                kvspace_range_give(base, mapped + RISCV_SV39_PAGE_SIZE);
+                return (struct allocation){ .buffer = NULL, .size = 0 };
+        }
+        riscv_tlb_batch_flush(&tlb);
+        return (struct allocation){ .buffer = (void*)base, .size = size };
+}
+
+void
+kvfree(struct allocation region)
+{
+        if (region.buffer == NULL) {
+                return;
+        }
+        vaddr_t base = (vaddr_t)region.buffer;
+        bool IN_AREA = base >= kvspace_vmalloc_start && base < kvspace_vmalloc_start + KVSPACE_VMALLOC_SIZE;
+        if (!IN_AREA || !IS_ALIGNED(base, RISCV_SV39_PAGE_SIZE)) {
+                PANIC(SV("kvspace: {X} was not allocated by kvalloc."), base);
+        }
+        size_t mapped = ALIGN_UP(region.size, RISCV_SV39_PAGE_SIZE);
+        struct riscv_tlb_batch tlb = { .asid = RISCV_TLB_GLOBAL };
+        kvspace_vmalloc_unmap(base, mapped, &tlb);
+        riscv_tlb_batch_flush(&tlb);
+        kvspace_range_give(base, mapped + RISCV_SV39_PAGE_SIZE);
+}
@@ -1,5 +1,9 @@
+#include <devices/device_tree/blob.h>
+#include <kvspace.h>
 #include <limine/limine.h>
 #include <limine/platform_info.h>
+#include <memory.h>
+#include <riscv.h>
 #include <types/error.h>
 
 #define LIMINE_REQ __attribute__((used, section(".limine_requests")))
@@ -64,4 +68,33 @@ populate_platform_info(void)
         pinfo.hhdm_offset = pinfo.hhdm_response->offset;
         pinfo.bsp_hartid_response = bsp_hartid_req.response;
         pinfo.bsp_hartid = pinfo.bsp_hartid_response->bsp_hartid;
+
+        // The memory map is needed before the physical memory manager is up, so it's copied into the kernel image.
+        pinfo.memmap_count = 0;
+        for (size_t i = 0; i < pinfo.memmap_response->entry_count && i < PLATFORM_MEMMAP_MAX_ENTRIES; i++) {
+                struct limine_memmap_entry* entry = pinfo.memmap_response->entries[i];
+                pinfo.memmap[i] = (struct platform_memmap_entry){ entry->base, entry->length, entry->type };
+                pinfo.memmap_count++;
+        }
+        pinfo.dtb = pinfo.dtb_response->dtb_ptr;
+}
+
+error_t
+platform_info_copy_out(void)
+{
+        size_t dtb_size = device_tree_blob_size(pinfo.dtb);
+        struct allocation dtb_copy = kalloc_flags(dtb_size, RISCV_SV39_PAGE_SIZE, PMM_ALLOC_NOZERO);
+        if (dtb_copy.buffer == NULL) {
+                return EC_PMM_OUT_OF_MEMORY;
+        }
+        memcopy(dtb_copy.buffer, pinfo.dtb, dtb_size);
+        pinfo.dtb = dtb_copy.buffer;
+
+        pinfo.framebuffer_response = NULL;
+        pinfo.paging_mode_response = NULL;
+        pinfo.memmap_response = NULL;
+        pinfo.dtb_response = NULL;
+        pinfo.hhdm_response = NULL;
+        pinfo.bsp_hartid_response = NULL;
+        return EC_SUCCESS;
 }
\ No newline at end of file
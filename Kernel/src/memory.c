@@ -5,7 +5,15 @@ void
 memzero(void* ptr, size_t count)
 {
         u8* u8_ptr = ptr;
-        for (size_t i = 0; i < count; i++) {
+        size_t i = 0;
+        for (; i < count && !IS_ALIGNED(u8_ptr + i, sizeof(u64)); i++) {
+                u8_ptr[i] = 0;
+        }
+        // Clear whole double words at a time once aligned, page sized buffers are zeroed all the time.
+        for (; i + sizeof(u64) <= count; i += sizeof(u64)) {
+                *(u64*)(u8_ptr + i) = 0;
+        }
+        for (; i < count; i++) {
                 u8_ptr[i] = 0;
         }
 }
@@ -1,5 +1,6 @@
 #include "fmt/print.h"
 #include <assert.h>
+#include <kernel.h>
 #include <kvspace.h>
 #include <memory.h>
 #include <pmm.h>
@@ -13,7 +14,51 @@ struct pmm_memory_block
 {
         u64 block_base;
         size_t block_size;
+        /// Neighbours in the region's address sorted free list.
         struct pmm_memory_block* next;
+        struct pmm_memory_block* prev;
+        /// Neighbours in the region's size bin.
+        struct pmm_memory_block* bin_next;
+        struct pmm_memory_block* bin_prev;
+};
+
+/// Number of size segregated bins kept by the list policies, the last bin collects every block of 2^(n-1) pages
+/// or more.
+#define PMM_BIN_COUNT 40
+
+/// Largest block order handed out by the buddy policy, order 18 blocks are 1 GiB.
+#define PMM_BUDDY_MAX_ORDER 18
+/// Set in a page's buddy tag when that page is the head of a free block, the low bits hold the block order.
+#define PMM_BUDDY_TAG_FREE 0x80
+
+/// Free buddy blocks are linked through their own (otherwise unused) memory.
+struct pmm_buddy_node
+{
+        struct pmm_buddy_node* next;
+        struct pmm_buddy_node* prev;
+};
+
+/// Pages in one megablock, a naturally aligned 2 MiB run of physical memory that could back a megapage mapping.
+#define MEGABLOCK_PAGES (RISCV_SV39_MEGAPAGE_SIZE / RISCV_SV39_PAGE_SIZE)
+
+/// A frame handed out by `pmm_alloc_movable()`, which the physical memory manager may move elsewhere to reassemble free
+/// megablocks.
+struct pmm_movable_page
+{
+        paddr_t frame;
+        pmm_migrate_fn migrate_fn;
+        void* context;
+        struct pmm_movable_page* next;
+};
+
+/// Bookkeeping kept for every megablock a region touches.
+struct pmm_megablock
+{
+        /// Pages of the megablock that are free in the policy backend.
+        u16 free_pages;
+        /// Allocated pages of the megablock that can be migrated, linked through `movable`.
+        u16 movable_pages;
+        struct pmm_movable_page* movable;
 };
 
 struct pmm_memory_region
@@ -21,71 +66,1802 @@ struct pmm_memory_region
         u64 region_base;
         size_t region_size;
         size_t free_bytes;
+        /// Address sorted list of free blocks, used by the list based policies.
         struct pmm_memory_block* free_blocks;
+        /// The same free blocks, segregated by size and sorted within each bin. Bit `n` of `bin_mask` is set when
+        /// `bins[n]` is non-empty.
+        struct pmm_memory_block* bins[PMM_BIN_COUNT];
+        struct pmm_memory_block* bin_tails[PMM_BIN_COUNT];
+        u64 bin_mask;
+        /// Block the next-fit policy resumes searching from.
+        struct pmm_memory_block* next_fit;
+        /// One tag per page in the region, used by the buddy policy.
+        u8* buddy_tags;
+        struct pmm_buddy_node* buddy_free[PMM_BUDDY_MAX_ORDER + 1];
+        /// Free single frames cached in front of the policy backend. Bit `n` of word `w` stands for the frame at
+        /// `frame_origin + (64 * w + n) * PAGE_SIZE`, and bit `w` of the summary is set while word `w` is non-zero.
+        u64* frame_bitmap;
+        u64* frame_summary;
+        paddr_t frame_origin;
+        size_t frame_words;
+        size_t frame_count;
+        /// Summary word the next bitmap search starts from.
+        size_t frame_hint;
+        /// Megablock `n` starts at `mega_origin + n * MEGAPAGE_SIZE`, the first and last ones may only partly overlap
+        /// the region.
+        struct pmm_megablock* megablocks;
+        paddr_t mega_origin;
+        size_t mega_count;
+        /// Broken megablock the next frame word refill looks at first, and the same for movable frame words.
+        size_t mega_hint;
+        size_t movable_hint;
+        /// Frame word that movable frames are handed out from, bit `n` stands for the free frame at
+        /// `movable_word + n * PAGE_SIZE`. Movable frames are kept apart from the rest, so that whole megablocks hold
+        /// nothing but movable frames and can be emptied by the compactor.
+        paddr_t movable_word;
+        u64 movable_bits;
+        /// Metadata of the page at `region_base + n * PAGE_SIZE`.
+        struct pmm_page* pages;
+};
+
+_Static_assert(sizeof(struct pmm_page) <= 64, "struct pmm_page must fit in a cache line");
+
+/// The metadata of a region (page metadata, frame bitmap and buddy tags) lives in the first pages of the memory given
+/// to `pmm_add_region()`, which are not part of `region_base`/`region_size`. So does the region descriptor itself, the
+/// region table only holds pointers. It starts out in the kernel image and moves to pages taken from the managed memory
+/// whenever it has to grow.
+#define REGION_INITIAL_COUNT 32
+
+/// Frames covered by one frame bitmap word. Bitmap refills take whole, naturally aligned words from the backend.
+#define FRAME_WORD_PAGES 64
+#define FRAME_WORD_SPAN (FRAME_WORD_PAGES * RISCV_SV39_PAGE_SIZE)
+/// Upper bound on the frames a region caches in its bitmap, beyond which freed frames bypass the bitmap.
+#define FRAME_RETAIN_COUNT 128
+
+enum pmm_policy policy = PMM_POLICY_FIRST_FIT;
+size_t total_bytes = 0;
+size_t free_bytes = 0;
+size_t region_count = 0;
+/// Memory carved out of regions for their metadata, and the part of it holding page metadata.
+size_t metadata_bytes = 0;
+size_t page_metadata_bytes = 0;
+/// Region the next-fit policy resumes searching from.
+size_t next_fit_region = 0;
+/// Regions sorted by base address, so that an address can be looked up with a binary search.
+struct pmm_memory_region* initial_regions[REGION_INITIAL_COUNT] = { 0 };
+struct pmm_memory_region** regions = initial_regions;
+size_t region_capacity = REGION_INITIAL_COUNT;
+struct slab_alloc block_arena = { 0 };
+
+/// Frames a magazine holds, and how many frames move between a magazine and the global allocator at once.
+#define MAGAZINE_SIZE 32
+#define MAGAZINE_BATCH 16
+
+/// Per-hart cache of free frames. The frames in a magazine have already been taken out of the global allocator, so the
+/// common single frame allocation and free only touch the calling hart's magazine.
+struct pmm_magazine
+{
+        size_t count;
+        paddr_t frames[MAGAZINE_SIZE];
+        struct pmm_magazine_stats stats;
+        /// Set by other harts that want this hart's magazine and zero pool emptied. Only the hart itself touches its
+        /// caches, so it drains them the next time it allocates or frees a frame.
+        bool drain_requested;
+};
+
+struct pmm_magazine magazines[KERNEL_MAX_HARTS] = { 0 };
+
+/// Number of pre-zeroed frames each hart's idle loop keeps in stock.
+#define ZERO_POOL_SIZE 64
+
+/// Per-hart stock of frames that were zeroed ahead of time by `pmm_idle_zero()`. Like magazine frames, they have
+/// already been taken out of the global allocator.
+struct pmm_zero_pool
+{
+        size_t count;
+        paddr_t frames[ZERO_POOL_SIZE];
+};
+
+struct pmm_zero_pool zero_pools[KERNEL_MAX_HARTS] = { 0 };
+
+/// Allocation counters are kept per hart and only summed up when asked for.
+struct pmm_alloc_stats alloc_stats[KERNEL_MAX_HARTS] = { 0 };
+
+/// Maximum number of disjoint reserved ranges, firmware rarely reports more than a handful.
+#define RESERVED_COUNT 64
+
+/// A physical range that must never be handed out, rounded out to whole pages.
+struct pmm_reserved_range
+{
+        paddr_t reserved_base;
+        size_t reserved_size;
+};
+
+/// Reserved ranges sorted by base address, overlapping and adjacent ranges are merged.
+struct pmm_reserved_range reserved_ranges[RESERVED_COUNT] = { 0 };
+size_t reserved_count = 0;
+
+/// Maximum number of reclaim hooks. Subsystems register a single hook each, not one per cache.
+#define RECLAIM_HOOK_COUNT 8
+
+struct pmm_reclaim_hook
+{
+        pmm_reclaim_fn reclaim_fn;
+        void* context;
 };
 
-#define REGION_COUNT 32
+struct pmm_reclaim_hook reclaim_hooks[RECLAIM_HOOK_COUNT] = { 0 };
+size_t reclaim_hook_count = 0;
+/// Set while the reclaim hooks run, so that whatever they allocate doesn't reclaim again.
+bool reclaiming = false;
+
+/// Broken megablocks a frame word refill looks through before it settles for breaking up a free one.
+#define MEGA_SCAN_LIMIT 16
+
+struct slab_alloc movable_arena = { 0 };
+/// Megablock being emptied by the compactor, which frame word refills must stay away from.
+struct pmm_megablock* compacting = NULL;
+
+/// Initial slab buffer, slabs are page sized and page aligned.
+#define INITIAL_BUF_SIZE (2 * RISCV_SV39_PAGE_SIZE)
+alignas(RISCV_SV39_PAGE_SIZE) u8 initial_buf[INITIAL_BUF_SIZE] = {};
+
+/// The block arena is refilled with a fresh page whenever it drops below this many free blocks. A single list
+/// operation needs at most one new block, so this leaves plenty of headroom.
+#define BLOCK_ARENA_LOW_WATER 16
+
+void
+pmm_initialize(enum pmm_policy pol)
+{
+        policy = pol;
+        slab_init(&block_arena, sizeof(struct pmm_memory_block));
+        slab_set_nozero(&block_arena);
+        slab_grow(&block_arena, initial_buf, INITIAL_BUF_SIZE);
+        slab_autorefill_init(&movable_arena, sizeof(struct pmm_movable_page));
+}
+
+// ===================================================================================================
+// Megablocks
+// ===================================================================================================
+
+struct pmm_megablock*
+pmm_mega_of(struct pmm_memory_region* region, paddr_t addr)
+{
+        return &region->megablocks[(addr - region->mega_origin) / RISCV_SV39_MEGAPAGE_SIZE];
+}
+
+/// Updates the free page counts of the megablocks under a page aligned range that left (`TAKEN`) or went back to the
+/// policy backend.
+void
+pmm_mega_account(struct pmm_memory_region* region, paddr_t base, size_t size, bool TAKEN)
+{
+        paddr_t end = base + ALIGN_UP(size, RISCV_SV39_PAGE_SIZE);
+        while (base < end) {
+                paddr_t mega_end = ALIGN_DOWN(base, RISCV_SV39_MEGAPAGE_SIZE) + RISCV_SV39_MEGAPAGE_SIZE;
+                paddr_t piece_end = mega_end < end ? mega_end : end;
+                u16 pages = (piece_end - base) / RISCV_SV39_PAGE_SIZE;
+                struct pmm_megablock* mega = pmm_mega_of(region, base);
+                mega->free_pages = TAKEN ? mega->free_pages - pages : mega->free_pages + pages;
+                base = piece_end;
+        }
+}
+
+/// Returns true if the megablock holds pages that are neither free, movable nor spare in the movable frame word, so
+/// the compactor can not empty it.
+bool
+pmm_mega_pinned(struct pmm_memory_region* region, struct pmm_megablock* mega)
+{
+        size_t spare = 0;
+        if (region->movable_bits != 0 && pmm_mega_of(region, region->movable_word) == mega) {
+                spare = __builtin_popcountl(region->movable_bits);
+        }
+        return mega->free_pages + mega->movable_pages + spare < MEGABLOCK_PAGES;
+}
+
+/// Returns true if megablock `index` lies entirely inside the region, so it could ever become a free megapage.
+bool
+pmm_mega_whole(struct pmm_memory_region* region, size_t index)
+{
+        paddr_t mega_base = region->mega_origin + index * RISCV_SV39_MEGAPAGE_SIZE;
+        return mega_base >= region->region_base &&
+               mega_base + RISCV_SV39_MEGAPAGE_SIZE <= region->region_base + region->region_size;
+}
+
+// ===================================================================================================
+// Frame Bitmap
+// ===================================================================================================
+
+void
+pmm_frame_set_word(struct pmm_memory_region* region, size_t word, u64 bits)
+{
+        region->frame_bitmap[word] = bits;
+        if (bits != 0) {
+                region->frame_summary[word / 64] |= 1UL << (word % 64);
+        } else {
+                region->frame_summary[word / 64] &= ~(1UL << (word % 64));
+        }
+}
+
+/// Takes a cached frame out of the bitmap, the region must have `frame_count > 0`.
+paddr_t
+pmm_frame_take(struct pmm_memory_region* region)
+{
+        size_t summary_words = ALIGN_UP(region->frame_words, 64) / 64;
+        for (size_t n = 0; n < summary_words; n++) {
+                size_t summary = (region->frame_hint + n) % summary_words;
+                if (region->frame_summary[summary] == 0) {
+                        continue;
+                }
+
+                size_t word = summary * 64 + __builtin_ctzl(region->frame_summary[summary]);
+                size_t bit = __builtin_ctzl(region->frame_bitmap[word]);
+                pmm_frame_set_word(region, word, region->frame_bitmap[word] & ~(1UL << bit));
+                region->frame_count--;
+                region->frame_hint = summary;
+                return region->frame_origin + (word * FRAME_WORD_PAGES + bit) * RISCV_SV39_PAGE_SIZE;
+        }
+        PANIC(SV("pmm: frame bitmap of region {X} is empty but claims {D} frames."),
+              region->region_base,
+              region->frame_count);
+}
+
+// ===================================================================================================
+// Buddy Policy
+// ===================================================================================================
+
+/// Returns the smallest order whose block holds `size` bytes.
+size_t
+pmm_buddy_order(size_t size)
+{
+        size_t pages = ALIGN_UP(size, RISCV_SV39_PAGE_SIZE) / RISCV_SV39_PAGE_SIZE;
+        if (pages <= 1) {
+                return 0;
+        }
+        return 64 - __builtin_clzl(pages - 1);
+}
+
+size_t
+pmm_buddy_tag_index(struct pmm_memory_region* region, paddr_t block)
+{
+        return (block - region->region_base) / RISCV_SV39_PAGE_SIZE;
+}
+
+void
+pmm_buddy_push(struct pmm_memory_region* region, paddr_t block, size_t order)
+{
+        struct pmm_buddy_node* node = kernel_hhdm_phys_to_virt(block);
+        node->prev = NULL;
+        node->next = region->buddy_free[order];
+        if (node->next != NULL) {
+                node->next->prev = node;
+        }
+        region->buddy_free[order] = node;
+        region->buddy_tags[pmm_buddy_tag_index(region, block)] = PMM_BUDDY_TAG_FREE | order;
+}
+
+void
+pmm_buddy_remove(struct pmm_memory_region* region, paddr_t block, size_t order)
+{
+        struct pmm_buddy_node* node = kernel_hhdm_phys_to_virt(block);
+        if (node->prev != NULL) {
+                node->prev->next = node->next;
+        } else {
+                region->buddy_free[order] = node->next;
+        }
+        if (node->next != NULL) {
+                node->next->prev = node->prev;
+        }
+        region->buddy_tags[pmm_buddy_tag_index(region, block)] = 0;
+}
+
+/// Returns true if `block` is the head of a free block of exactly `order` inside the region.
+bool
+pmm_buddy_is_free(struct pmm_memory_region* region, paddr_t block, size_t order)
+{
+        if (block < region->region_base || block >= region->region_base + region->region_size) {
+                return false;
+        }
+        return region->buddy_tags[pmm_buddy_tag_index(region, block)] == (PMM_BUDDY_TAG_FREE | order);
+}
+
+/// Returns a single naturally aligned block to the free lists, coalescing it with its buddy for as long as possible.
+void
+pmm_buddy_free_block(struct pmm_memory_region* region, paddr_t block, size_t order)
+{
+        while (order < PMM_BUDDY_MAX_ORDER) {
+                paddr_t buddy = block ^ ((paddr_t)RISCV_SV39_PAGE_SIZE << order);
+                if (!pmm_buddy_is_free(region, buddy, order)) {
+                        break;
+                }
+                pmm_buddy_remove(region, buddy, order);
+                block = block < buddy ? block : buddy;
+                order++;
+        }
+        pmm_buddy_push(region, block, order);
+}
+
+/// Returns an arbitrary page aligned range to the free lists by splitting it into the largest naturally aligned blocks
+/// that fit.
+void
+pmm_buddy_free_range(struct pmm_memory_region* region, paddr_t base, size_t size)
+{
+        while (size > 0) {
+                size_t pfn = base / RISCV_SV39_PAGE_SIZE;
+                size_t order = pfn == 0 ? PMM_BUDDY_MAX_ORDER : (size_t)__builtin_ctzl(pfn);
+                if (order > PMM_BUDDY_MAX_ORDER) {
+                        order = PMM_BUDDY_MAX_ORDER;
+                }
+                while (((size_t)RISCV_SV39_PAGE_SIZE << order) > size) {
+                        order--;
+                }
+                pmm_buddy_free_block(region, base, order);
+                base += (size_t)RISCV_SV39_PAGE_SIZE << order;
+                size -= (size_t)RISCV_SV39_PAGE_SIZE << order;
+        }
+}
+
+void
+pmm_buddy_add_region(struct pmm_memory_region* region)
+{
+        for (size_t order = 0; order <= PMM_BUDDY_MAX_ORDER; order++) {
+                region->buddy_free[order] = NULL;
+        }
+        region->free_blocks = NULL;
+        region->next_fit = NULL;
+        region->bin_mask = 0;
+        pmm_buddy_free_range(region, region->region_base, region->region_size);
+}
+
+error_t
+pmm_buddy_alloc(struct pmm_memory_region* region, size_t size, size_t alignment, paddr_t* out)
+{
+        size_t order = pmm_buddy_order(size);
+        size_t align_order = pmm_buddy_order(alignment);
+        if (align_order > order) {
+                order = align_order;
+        }
+        if (order > PMM_BUDDY_MAX_ORDER) {
+                return EC_PMM_OUT_OF_MEMORY;
+        }
+
+        size_t found = order;
+        while (found <= PMM_BUDDY_MAX_ORDER && region->buddy_free[found] == NULL) {
+                found++;
+        }
+        if (found > PMM_BUDDY_MAX_ORDER) {
+                return EC_PMM_OUT_OF_MEMORY;
+        }
+
+        paddr_t block = kernel_hhdm_virt_to_phys(region->buddy_free[found]);
+        pmm_buddy_remove(region, block, found);
+        while (found > order) {
+                found--;
+                pmm_buddy_push(region, block + ((paddr_t)RISCV_SV39_PAGE_SIZE << found), found);
+        }
+
+        // Only the pages that were actually asked for are handed out, the tail of the block goes straight back to the
+        // free lists so that `pmm_free()` can release exactly `size` bytes later on.
+        size_t block_size = (size_t)RISCV_SV39_PAGE_SIZE << order;
+        if (block_size > size) {
+                pmm_buddy_free_range(region, block + size, block_size - size);
+        }
+        *out = block;
+        return EC_SUCCESS;
+}
+
+error_t
+pmm_buddy_free(struct pmm_memory_region* region, paddr_t base, size_t size)
+{
+        if (region->buddy_tags[pmm_buddy_tag_index(region, base)] & PMM_BUDDY_TAG_FREE) {
+                return EC_PMM_INVALID_FREE;
+        }
+        pmm_buddy_free_range(region, base, size);
+        return EC_SUCCESS;
+}
+
+// ===================================================================================================
+// List Policies
+// ===================================================================================================
+
+/// Returns the size bin a block of `size` bytes is filed under, bin `n` holds blocks of [2^n, 2^(n+1)) pages.
+size_t
+pmm_list_bin(size_t size)
+{
+        size_t bin = 63 - __builtin_clzl(size / RISCV_SV39_PAGE_SIZE);
+        return bin < PMM_BIN_COUNT ? bin : PMM_BIN_COUNT - 1;
+}
+
+/// Files the block into its size bin, bins are kept sorted by ascending block size.
+void
+pmm_list_bin_insert(struct pmm_memory_region* region, struct pmm_memory_block* block)
+{
+        size_t bin = pmm_list_bin(block->block_size);
+        struct pmm_memory_block* prev = NULL;
+        struct pmm_memory_block* curr = region->bins[bin];
+        while (curr != NULL && curr->block_size < block->block_size) {
+                prev = curr;
+                curr = curr->bin_next;
+        }
+
+        block->bin_prev = prev;
+        block->bin_next = curr;
+        if (prev == NULL) {
+                region->bins[bin] = block;
+        } else {
+                prev->bin_next = block;
+        }
+        if (curr == NULL) {
+                region->bin_tails[bin] = block;
+        } else {
+                curr->bin_prev = block;
+        }
+        region->bin_mask |= 1UL << bin;
+}
+
+void
+pmm_list_bin_remove(struct pmm_memory_region* region, struct pmm_memory_block* block)
+{
+        size_t bin = pmm_list_bin(block->block_size);
+        if (block->bin_prev == NULL) {
+                region->bins[bin] = block->bin_next;
+        } else {
+                block->bin_prev->bin_next = block->bin_next;
+        }
+        if (block->bin_next == NULL) {
+                region->bin_tails[bin] = block->bin_prev;
+        } else {
+                block->bin_next->bin_prev = block->bin_prev;
+        }
+        if (region->bins[bin] == NULL) {
+                region->bin_mask &= ~(1UL << bin);
+        }
+}
+
+/// Links a new block into the address sorted list between `prev` and `next`, and into its size bin.
+struct pmm_memory_block*
+pmm_list_insert(struct pmm_memory_region* region,
+                struct pmm_memory_block* prev,
+                struct pmm_memory_block* next,
+                paddr_t base,
+                size_t size)
+{
+        struct pmm_memory_block* block = slab_allocate(&block_arena);
+        ASSERT(block != NULL);
+        block->block_base = base;
+        block->block_size = size;
+        block->prev = prev;
+        block->next = next;
+        if (prev == NULL) {
+                region->free_blocks = block;
+        } else {
+                prev->next = block;
+        }
+        if (next != NULL) {
+                next->prev = block;
+        }
+        pmm_list_bin_insert(region, block);
+        return block;
+}
+
+/// Unlinks a block from both the address sorted list and its size bin, and returns it to the block arena.
+void
+pmm_list_delete(struct pmm_memory_region* region, struct pmm_memory_block* block)
+{
+        pmm_list_bin_remove(region, block);
+        if (block->prev == NULL) {
+                region->free_blocks = block->next;
+        } else {
+                block->prev->next = block->next;
+        }
+        if (block->next != NULL) {
+                block->next->prev = block->prev;
+        }
+        if (region->next_fit == block) {
+                region->next_fit = block->next;
+        }
+        error_t err = slab_free(&block_arena, block);
+        ASSERT(error_is_ok(err));
+}
+
+/// Returns true if `size` bytes aligned to `alignment` fit in the block, and the base they would be placed at.
+bool
+pmm_list_block_fits(struct pmm_memory_block* block, size_t size, size_t alignment, paddr_t* aligned_base)
+{
+        *aligned_base = ALIGN_UP(block->block_base, alignment);
+        return *aligned_base + size <= block->block_base + block->block_size;
+}
+
+/// Takes `size` bytes at `aligned_base` out of the block, keeping whatever is left over on either side free.
+void
+pmm_list_carve(struct pmm_memory_region* region, struct pmm_memory_block* block, paddr_t aligned_base, size_t size)
+{
+        size_t block_base = block->block_base;
+        size_t block_end = block->block_base + block->block_size;
+        bool EXISTS_PRECEEDING = block_base != aligned_base;
+        bool EXISTS_POSTCEEDING = block_end > aligned_base + size;
+        if (!EXISTS_PRECEEDING && !EXISTS_POSTCEEDING) {
+                region->next_fit = block->next;
+                pmm_list_delete(region, block);
+                return;
+        }
+
+        pmm_list_bin_remove(region, block);
+        if (EXISTS_PRECEEDING && EXISTS_POSTCEEDING) {
+                block->block_size = aligned_base - block_base;
+                pmm_list_bin_insert(region, block);
+                region->next_fit =
+                  pmm_list_insert(region, block, block->next, aligned_base + size, block_end - (aligned_base + size));
+        } else if (EXISTS_PRECEEDING) {
+                block->block_size = aligned_base - block_base;
+                pmm_list_bin_insert(region, block);
+                region->next_fit = block->next;
+        } else {
+                block->block_base = aligned_base + size;
+                block->block_size = block_end - (aligned_base + size);
+                pmm_list_bin_insert(region, block);
+                region->next_fit = block;
+        }
+}
+
+/// Walks the address sorted list from `start` (inclusive) up to `end` (exclusive) for the first block that fits.
+struct pmm_memory_block*
+pmm_list_find_linear(struct pmm_memory_block* start,
+                     struct pmm_memory_block* end,
+                     size_t size,
+                     size_t alignment,
+                     paddr_t* aligned_base)
+{
+        for (struct pmm_memory_block* curr = start; curr != end; curr = curr->next) {
+                if (pmm_list_block_fits(curr, size, alignment, aligned_base)) {
+                        return curr;
+                }
+        }
+        return NULL;
+}
+
+/// Finds the smallest fitting block. Bins below the request's bin only hold blocks that are too small, and every bin
+/// is sorted, so the first fitting block found walking upwards from there is the best fit.
+struct pmm_memory_block*
+pmm_list_find_best(struct pmm_memory_region* region, size_t size, size_t alignment, paddr_t* aligned_base)
+{
+        u64 mask = region->bin_mask & ~((1UL << pmm_list_bin(size)) - 1);
+        while (mask != 0) {
+                size_t bin = __builtin_ctzl(mask);
+                for (struct pmm_memory_block* curr = region->bins[bin]; curr != NULL; curr = curr->bin_next) {
+                        if (pmm_list_block_fits(curr, size, alignment, aligned_base)) {
+                                return curr;
+                        }
+                }
+                mask &= mask - 1;
+        }
+        return NULL;
+}
+
+/// Finds the largest fitting block, walking the bins downwards from the largest non-empty one.
+struct pmm_memory_block*
+pmm_list_find_worst(struct pmm_memory_region* region, size_t size, size_t alignment, paddr_t* aligned_base)
+{
+        u64 mask = region->bin_mask & ~((1UL << pmm_list_bin(size)) - 1);
+        while (mask != 0) {
+                size_t bin = 63 - __builtin_clzl(mask);
+                for (struct pmm_memory_block* curr = region->bin_tails[bin]; curr != NULL; curr = curr->bin_prev) {
+                        if (curr->block_size < size) {
+                                return NULL;
+                        }
+                        if (pmm_list_block_fits(curr, size, alignment, aligned_base)) {
+                                return curr;
+                        }
+                }
+                mask &= ~(1UL << bin);
+        }
+        return NULL;
+}
+
+/// Finds a fitting block in the region according to the active list policy.
+struct pmm_memory_block*
+pmm_list_find(struct pmm_memory_region* region, size_t size, size_t alignment, paddr_t* aligned_base)
+{
+        switch (policy) {
+                case PMM_POLICY_FIRST_FIT:
+                        return pmm_list_find_linear(region->free_blocks, NULL, size, alignment, aligned_base);
+                case PMM_POLICY_BEST_FIT:
+                        return pmm_list_find_best(region, size, alignment, aligned_base);
+                case PMM_POLICY_WORST_FIT:
+                        return pmm_list_find_worst(region, size, alignment, aligned_base);
+                case PMM_POLICY_NEXT_FIT: {
+                        // A cursor past the last block wraps around to the head of the list.
+                        struct pmm_memory_block* start = region->next_fit != NULL ? region->next_fit
+                                                                                  : region->free_blocks;
+                        struct pmm_memory_block* found =
+                          pmm_list_find_linear(start, NULL, size, alignment, aligned_base);
+                        if (found == NULL && start != region->free_blocks) {
+                                found = pmm_list_find_linear(region->free_blocks, start, size, alignment, aligned_base);
+                        }
+                        return found;
+                }
+                default:
+                        __builtin_unreachable();
+        }
+}
+
+/// Allocates from whichever region the active list policy prefers. First-fit and next-fit take the first block they
+/// find, best-fit and worst-fit compare the candidates of every region. Returns the region the allocation came from.
+struct pmm_memory_region*
+pmm_list_alloc(size_t size, size_t alignment, paddr_t* out)
+{
+        struct pmm_memory_region* chosen = NULL;
+        struct pmm_memory_block* chosen_block = NULL;
+        paddr_t chosen_base = 0;
+        size_t start = policy == PMM_POLICY_NEXT_FIT ? next_fit_region : 0;
+        size_t chosen_index = 0;
+        for (size_t n = 0; n < region_count; n++) {
+                struct pmm_memory_region* region = regions[(start + n) % region_count];
+                if (region->free_bytes < size) {
+                        continue;
+                }
+
+                paddr_t aligned_base = 0;
+                struct pmm_memory_block* block = pmm_list_find(region, size, alignment, &aligned_base);
+                if (block == NULL) {
+                        continue;
+                }
+
+                bool IS_BETTER = chosen == NULL ||
+                                 (policy == PMM_POLICY_BEST_FIT && block->block_size < chosen_block->block_size) ||
+                                 (policy == PMM_POLICY_WORST_FIT && block->block_size > chosen_block->block_size);
+                if (IS_BETTER) {
+                        chosen = region;
+                        chosen_index = (start + n) % region_count;
+                        chosen_block = block;
+                        chosen_base = aligned_base;
+                }
+                if (policy == PMM_POLICY_FIRST_FIT || policy == PMM_POLICY_NEXT_FIT) {
+                        break;
+                }
+        }
+
+        if (chosen == NULL) {
+                return NULL;
+        }
+        pmm_list_carve(chosen, chosen_block, chosen_base, size);
+        next_fit_region = chosen_index;
+        *out = chosen_base;
+        return chosen;
+}
+
+void
+pmm_list_add_region(struct pmm_memory_region* region)
+{
+        region->free_blocks = NULL;
+        region->bin_mask = 0;
+        for (size_t bin = 0; bin < PMM_BIN_COUNT; bin++) {
+                region->bins[bin] = NULL;
+                region->bin_tails[bin] = NULL;
+        }
+        region->next_fit = pmm_list_insert(region, NULL, NULL, region->region_base, region->region_size);
+}
+
+/// Inserts the range back into the address sorted free list, merging it with the neighbouring blocks it touches.
+error_t
+pmm_list_free(struct pmm_memory_region* region, paddr_t base, size_t size)
+{
+        struct pmm_memory_block* prev = NULL;
+        struct pmm_memory_block* curr = region->free_blocks;
+        while (curr != NULL && curr->block_base < base) {
+                prev = curr;
+                curr = curr->next;
+        }
+
+        bool OVERLAPS_PREV = prev != NULL && prev->block_base + prev->block_size > base;
+        bool OVERLAPS_NEXT = curr != NULL && base + size > curr->block_base;
+        if (OVERLAPS_PREV || OVERLAPS_NEXT) {
+                return EC_PMM_INVALID_FREE;
+        }
+
+        bool MERGES_PREV = prev != NULL && prev->block_base + prev->block_size == base;
+        bool MERGES_NEXT = curr != NULL && base + size == curr->block_base;
+        if (MERGES_PREV && MERGES_NEXT) {
+                pmm_list_bin_remove(region, prev);
+                prev->block_size += size + curr->block_size;
+                pmm_list_bin_insert(region, prev);
+                if (region->next_fit == curr) {
+                        region->next_fit = prev;
+                }
+                pmm_list_delete(region, curr);
+        } else if (MERGES_PREV) {
+                pmm_list_bin_remove(region, prev);
+                prev->block_size += size;
+                pmm_list_bin_insert(region, prev);
+        } else if (MERGES_NEXT) {
+                pmm_list_bin_remove(region, curr);
+                curr->block_base = base;
+                curr->block_size += size;
+                pmm_list_bin_insert(region, curr);
+        } else {
+                pmm_list_insert(region, prev, curr, base, size);
+        }
+        return EC_SUCCESS;
+}
+
+// ===================================================================================================
+// Policy Backend
+// ===================================================================================================
+
+/// Tops up the block arena from the PMM itself. A frame already cached in a frame bitmap is preferred, it sits in a
+/// megablock that is pinned anyway. Otherwise carving a page from the start of a block never splits it in two, so
+/// taking the page can not recurse back into the arena. Blocks in a megablock that already holds unmovable pages come
+/// first, then blocks in a megablock without movable frames, so the arena pages don't pin every megablock the
+/// compactor could empty.
+void
+pmm_list_refill_arena(void)
+{
+        if (block_arena.free_blocks >= BLOCK_ARENA_LOW_WATER) {
+                return;
+        }
+        for (size_t i = 0; i < region_count; i++) {
+                if (regions[i]->frame_count > 0) {
+                        paddr_t page = pmm_frame_take(regions[i]);
+                        regions[i]->free_bytes -= RISCV_SV39_PAGE_SIZE;
+                        free_bytes -= RISCV_SV39_PAGE_SIZE;
+                        slab_grow(&block_arena, kernel_hhdm_phys_to_virt(page), RISCV_SV39_PAGE_SIZE);
+                        return;
+                }
+        }
+        for (size_t i = 0; i < region_count; i++) {
+                struct pmm_memory_block* head = regions[i]->free_blocks;
+                if (head == NULL) {
+                        continue;
+                }
+                struct pmm_memory_block* unmoved = NULL;
+                for (struct pmm_memory_block* curr = regions[i]->free_blocks; curr != NULL; curr = curr->next) {
+                        struct pmm_megablock* mega = pmm_mega_of(regions[i], curr->block_base);
+                        if (pmm_mega_pinned(regions[i], mega)) {
+                                head = curr;
+                                unmoved = NULL;
+                                break;
+                        }
+                        if (unmoved == NULL && mega->movable_pages == 0) {
+                                unmoved = curr;
+                        }
+                }
+                if (unmoved != NULL) {
+                        head = unmoved;
+                }
+                paddr_t page = head->block_base;
+                pmm_list_carve(regions[i], head, page, RISCV_SV39_PAGE_SIZE);
+                pmm_mega_account(regions[i], page, RISCV_SV39_PAGE_SIZE, true);
+                regions[i]->free_bytes -= RISCV_SV39_PAGE_SIZE;
+                free_bytes -= RISCV_SV39_PAGE_SIZE;
+                slab_grow(&block_arena, kernel_hhdm_phys_to_virt(page), RISCV_SV39_PAGE_SIZE);
+                return;
+        }
+}
+
+/// Allocates from the region's policy backend, bypassing the frame bitmap.
+error_t
+pmm_backend_alloc(struct pmm_memory_region* region, size_t size, size_t alignment, paddr_t* out)
+{
+        if (policy == PMM_POLICY_BUDDY) {
+                error_t err = pmm_buddy_alloc(region, size, alignment, out);
+                if (error_is_ok(err)) {
+                        pmm_mega_account(region, *out, size, true);
+                }
+                return err;
+        }
+
+        pmm_list_refill_arena();
+        paddr_t aligned_base = 0;
+        struct pmm_memory_block* block = pmm_list_find(region, size, alignment, &aligned_base);
+        if (block == NULL) {
+                return EC_PMM_OUT_OF_MEMORY;
+        }
+        pmm_list_carve(region, block, aligned_base, size);
+        pmm_mega_account(region, aligned_base, size, true);
+        *out = aligned_base;
+        return EC_SUCCESS;
+}
+
+/// Takes the exact range `[base, base + size)` out of the policy backend, failing if any of it isn't free.
+error_t
+pmm_backend_claim(struct pmm_memory_region* region, paddr_t base, size_t size)
+{
+        if (policy == PMM_POLICY_BUDDY) {
+                // Buddy blocks are naturally aligned, so the free block holding `base` starts at `base` rounded down to
+                // its own size.
+                for (size_t order = 0; order <= PMM_BUDDY_MAX_ORDER; order++) {
+                        size_t block_size = (size_t)RISCV_SV39_PAGE_SIZE << order;
+                        paddr_t block = ALIGN_DOWN(base, block_size);
+                        if (block < region->region_base) {
+                                break;
+                        }
+                        if (!pmm_buddy_is_free(region, block, order)) {
+                                continue;
+                        }
+                        if (block + block_size < base + size) {
+                                return EC_PMM_OUT_OF_MEMORY;
+                        }
+                        pmm_buddy_remove(region, block, order);
+                        pmm_buddy_free_range(region, block, base - block);
+                        pmm_buddy_free_range(region, base + size, block + block_size - (base + size));
+                        pmm_mega_account(region, base, size, true);
+                        return EC_SUCCESS;
+                }
+                return EC_PMM_OUT_OF_MEMORY;
+        }
+
+        pmm_list_refill_arena();
+        for (struct pmm_memory_block* curr = region->free_blocks; curr != NULL && curr->block_base <= base;
+             curr = curr->next) {
+                if (curr->block_base + curr->block_size >= base + size) {
+                        pmm_list_carve(region, curr, base, size);
+                        pmm_mega_account(region, base, size, true);
+                        return EC_SUCCESS;
+                }
+        }
+        return EC_PMM_OUT_OF_MEMORY;
+}
+
+/// Returns a range straight to the region's policy backend.
+error_t
+pmm_backend_free(struct pmm_memory_region* region, paddr_t base, size_t size)
+{
+        error_t err = EC_SUCCESS;
+        if (policy == PMM_POLICY_BUDDY) {
+                err = pmm_buddy_free(region, base, size);
+        } else {
+                pmm_list_refill_arena();
+                err = pmm_list_free(region, base, size);
+        }
+        if (error_is_ok(err)) {
+                pmm_mega_account(region, base, size, false);
+        }
+        return err;
+}
+
+/// Returns the end of the free backend block holding `addr`, or 0 if `addr` isn't free in the backend.
+paddr_t
+pmm_backend_free_end(struct pmm_memory_region* region, paddr_t addr)
+{
+        if (policy == PMM_POLICY_BUDDY) {
+                for (size_t order = 0; order <= PMM_BUDDY_MAX_ORDER; order++) {
+                        size_t block_size = (size_t)RISCV_SV39_PAGE_SIZE << order;
+                        paddr_t block = ALIGN_DOWN(addr, block_size);
+                        if (block < region->region_base) {
+                                break;
+                        }
+                        if (pmm_buddy_is_free(region, block, order)) {
+                                return block + block_size;
+                        }
+                }
+                return 0;
+        }
+
+        for (struct pmm_memory_block* curr = region->free_blocks; curr != NULL && curr->block_base <= addr;
+             curr = curr->next) {
+                if (addr < curr->block_base + curr->block_size) {
+                        return curr->block_base + curr->block_size;
+                }
+        }
+        return 0;
+}
+
+/// Same as `pmm_backend_claim()`, but the range may span several free blocks. Nothing is taken if any of it isn't
+/// free.
+error_t
+pmm_backend_claim_span(struct pmm_memory_region* region, paddr_t base, size_t size)
+{
+        paddr_t end = base + size;
+        paddr_t cursor = base;
+        while (cursor < end) {
+                paddr_t block_end = pmm_backend_free_end(region, cursor);
+                if (block_end == 0) {
+                        if (cursor > base) {
+                                error_t err = pmm_backend_free(region, base, cursor - base);
+                                ASSERT(error_is_ok(err));
+                        }
+                        return EC_PMM_OUT_OF_MEMORY;
+                }
+                paddr_t claim_end = block_end < end ? block_end : end;
+                error_t err = pmm_backend_claim(region, cursor, claim_end - cursor);
+                ASSERT(error_is_ok(err));
+                cursor = claim_end;
+        }
+        return EC_SUCCESS;
+}
+
+/// Allocates a contiguous range from the policy backends of all regions.
+struct pmm_memory_region*
+pmm_backend_alloc_any(size_t size, size_t alignment, paddr_t* out)
+{
+        if (policy != PMM_POLICY_BUDDY) {
+                pmm_list_refill_arena();
+                struct pmm_memory_region* region = pmm_list_alloc(size, alignment, out);
+                if (region != NULL) {
+                        pmm_mega_account(region, *out, size, true);
+                }
+                return region;
+        }
+        for (size_t i = 0; i < region_count; i++) {
+                if (regions[i]->free_bytes >= size && error_is_ok(pmm_buddy_alloc(regions[i], size, alignment, out))) {
+                        pmm_mega_account(regions[i], *out, size, true);
+                        return regions[i];
+                }
+        }
+        return NULL;
+}
+
+// ===================================================================================================
+// Frame Allocation
+// ===================================================================================================
+
+/// Claims a free frame word from a megablock that's already broken up, so that single frames leave whole free
+/// megablocks alone while broken ones still have room. Movable frame words only come from megablocks that already hold
+/// movable frames, and other frame words only from megablocks that don't.
+bool
+pmm_frame_claim_broken(struct pmm_memory_region* region, bool MOVABLE, paddr_t* out)
+{
+        size_t* hint = MOVABLE ? &region->movable_hint : &region->mega_hint;
+        size_t scanned = 0;
+        for (size_t n = 0; n < region->mega_count && scanned < MEGA_SCAN_LIMIT; n++) {
+                size_t index = (*hint + n) % region->mega_count;
+                struct pmm_megablock* mega = &region->megablocks[index];
+                bool UNBROKEN = mega->free_pages == MEGABLOCK_PAGES && pmm_mega_whole(region, index);
+                bool WRONG_KIND = MOVABLE ? mega->movable_pages == 0 : mega->movable_pages > 0;
+                if (mega->free_pages < FRAME_WORD_PAGES || UNBROKEN || WRONG_KIND || mega == compacting) {
+                        continue;
+                }
+
+                scanned++;
+                paddr_t mega_base = region->mega_origin + index * RISCV_SV39_MEGAPAGE_SIZE;
+                paddr_t mega_end = mega_base + RISCV_SV39_MEGAPAGE_SIZE;
+                for (paddr_t chunk = mega_base; chunk < mega_end; chunk += FRAME_WORD_SPAN) {
+                        bool INSIDE = chunk >= region->region_base &&
+                                      chunk + FRAME_WORD_SPAN <= region->region_base + region->region_size;
+                        if (INSIDE && error_is_ok(pmm_backend_claim(region, chunk, FRAME_WORD_SPAN))) {
+                                *hint = index;
+                                *out = chunk;
+                                return true;
+                        }
+                }
+        }
+        return false;
+}
+
+/// Allocates a single frame. Frames come from a bitmap of cached frames when possible, the bitmap is refilled from the
+/// backend one naturally aligned word (64 frames) at a time, and when even that fails a lone frame is taken from the
+/// backend.
+struct pmm_memory_region*
+pmm_frame_alloc(paddr_t* out)
+{
+        for (size_t i = 0; i < region_count; i++) {
+                if (regions[i]->frame_count > 0) {
+                        *out = pmm_frame_take(regions[i]);
+                        return regions[i];
+                }
+        }
+
+        // Refill a whole frame word, from a broken megablock of any region before breaking up a free one.
+        struct pmm_memory_region* refilled = NULL;
+        paddr_t chunk = 0;
+        for (size_t i = 0; i < region_count && refilled == NULL; i++) {
+                if (regions[i]->free_bytes >= FRAME_WORD_SPAN && pmm_frame_claim_broken(regions[i], false, &chunk)) {
+                        refilled = regions[i];
+                }
+        }
+        for (size_t i = 0; i < region_count && refilled == NULL; i++) {
+                if (regions[i]->free_bytes >= FRAME_WORD_SPAN &&
+                    error_is_ok(pmm_backend_alloc(regions[i], FRAME_WORD_SPAN, FRAME_WORD_SPAN, &chunk))) {
+                        refilled = regions[i];
+                }
+        }
+        if (refilled != NULL) {
+                size_t word = (chunk - refilled->frame_origin) / FRAME_WORD_SPAN;
+                pmm_frame_set_word(refilled, word, ~1UL);
+                refilled->frame_count += FRAME_WORD_PAGES - 1;
+                refilled->frame_hint = word / 64;
+                *out = chunk;
+                return refilled;
+        }
+
+        for (size_t i = 0; i < region_count; i++) {
+                if (error_is_ok(pmm_backend_alloc(regions[i], RISCV_SV39_PAGE_SIZE, RISCV_SV39_PAGE_SIZE, out))) {
+                        return regions[i];
+                }
+        }
+        return NULL;
+}
+
+/// Caches a freed frame in the bitmap. Once the region caches plenty of frames, freed frames go straight back to the
+/// backend instead, and words that become completely free are handed back as a whole.
+error_t
+pmm_frame_free(struct pmm_memory_region* region, paddr_t frame)
+{
+        size_t index = (frame - region->frame_origin) / RISCV_SV39_PAGE_SIZE;
+        size_t word = index / FRAME_WORD_PAGES;
+        u64 bit = 1UL << (index % FRAME_WORD_PAGES);
+        if (region->frame_bitmap[word] & bit) {
+                return EC_PMM_INVALID_FREE;
+        }
+        bool COMPLETES_WORD = (region->frame_bitmap[word] | bit) == ~0UL;
+        if (region->frame_count >= FRAME_RETAIN_COUNT && !COMPLETES_WORD) {
+                return pmm_backend_free(region, frame, RISCV_SV39_PAGE_SIZE);
+        }
+
+        pmm_frame_set_word(region, word, region->frame_bitmap[word] | bit);
+        region->frame_count++;
+        region->frame_hint = word / 64;
+        if (region->frame_bitmap[word] == ~0UL && region->frame_count > FRAME_RETAIN_COUNT) {
+                pmm_frame_set_word(region, word, 0);
+                region->frame_count -= FRAME_WORD_PAGES;
+                return pmm_backend_free(region, region->frame_origin + word * FRAME_WORD_SPAN, FRAME_WORD_SPAN);
+        }
+        return EC_SUCCESS;
+}
+
+/// Hands every cached frame back to the backend so that it can be coalesced into larger ranges again.
+void
+pmm_frame_drain(struct pmm_memory_region* region)
+{
+        size_t summary_words = ALIGN_UP(region->frame_words, 64) / 64;
+        for (size_t summary = 0; summary < summary_words && region->frame_count > 0; summary++) {
+                while (region->frame_summary[summary] != 0) {
+                        size_t word = summary * 64 + __builtin_ctzl(region->frame_summary[summary]);
+                        u64 bits = region->frame_bitmap[word];
+                        paddr_t word_base = region->frame_origin + word * FRAME_WORD_SPAN;
+                        pmm_frame_set_word(region, word, 0);
+                        region->frame_count -= __builtin_popcountl(bits);
+                        if (bits == ~0UL) {
+                                error_t err = pmm_backend_free(region, word_base, FRAME_WORD_SPAN);
+                                ASSERT(error_is_ok(err));
+                                continue;
+                        }
+                        for (; bits != 0; bits &= bits - 1) {
+                                paddr_t frame = word_base + __builtin_ctzl(bits) * RISCV_SV39_PAGE_SIZE;
+                                error_t err = pmm_backend_free(region, frame, RISCV_SV39_PAGE_SIZE);
+                                ASSERT(error_is_ok(err));
+                        }
+                }
+        }
+}
+
+// ===================================================================================================
+// Per-Hart Magazines
+// ===================================================================================================
+
+/// Returns the region managing the given address, or NULL if no region does.
+struct pmm_memory_region*
+pmm_find_region(paddr_t addr)
+{
+        size_t low = 0;
+        size_t high = region_count;
+        while (low < high) {
+                size_t mid = low + (high - low) / 2;
+                if (addr < regions[mid]->region_base) {
+                        high = mid;
+                } else if (addr >= regions[mid]->region_base + regions[mid]->region_size) {
+                        low = mid + 1;
+                } else {
+                        return regions[mid];
+                }
+        }
+        return NULL;
+}
+
+/// Doubles the capacity of the region table, taking the new table from the memory that is already managed.
+error_t
+pmm_grow_region_table(void)
+{
+        size_t old_size = ALIGN_UP(region_capacity * sizeof(struct pmm_memory_region*), RISCV_SV39_PAGE_SIZE);
+        size_t new_size = ALIGN_UP(2 * region_capacity * sizeof(struct pmm_memory_region*), RISCV_SV39_PAGE_SIZE);
+        paddr_t table = 0;
+        struct pmm_memory_region* host = pmm_backend_alloc_any(new_size, RISCV_SV39_PAGE_SIZE, &table);
+        if (host == NULL) {
+                return EC_PMM_REGION_LIST_FULL;
+        }
+        host->free_bytes -= new_size;
+        free_bytes -= new_size;
+
+        struct pmm_memory_region** old_regions = regions;
+        regions = kernel_hhdm_phys_to_virt(table);
+        memcopy(regions, old_regions, region_count * sizeof(struct pmm_memory_region*));
+        region_capacity = new_size / sizeof(struct pmm_memory_region*);
+
+        if (old_regions != initial_regions) {
+                paddr_t old_table = kernel_hhdm_virt_to_phys(old_regions);
+                struct pmm_memory_region* old_host = pmm_find_region(old_table);
+                ASSERT(old_host != NULL);
+                pmm_backend_free(old_host, old_table, old_size);
+                old_host->free_bytes += old_size;
+                free_bytes += old_size;
+        }
+        return EC_SUCCESS;
+}
+
+/// Takes a single frame from the global allocator for one of the per-hart caches, returns false if none is left.
+bool
+pmm_take_frame(paddr_t* out)
+{
+        struct pmm_memory_region* region = pmm_frame_alloc(out);
+        if (region == NULL) {
+                return false;
+        }
+        region->free_bytes -= RISCV_SV39_PAGE_SIZE;
+        free_bytes -= RISCV_SV39_PAGE_SIZE;
+        return true;
+}
+
+/// Pulls a batch of frames from the global allocator into the magazine, returns false if none could be had.
+bool
+pmm_magazine_refill(struct pmm_magazine* mag)
+{
+        paddr_t frame = 0;
+        while (mag->count < MAGAZINE_BATCH && pmm_take_frame(&frame)) {
+                mag->frames[mag->count++] = frame;
+        }
+        mag->stats.refills++;
+        return mag->count > 0;
+}
+
+/// Gives a frame held by a per-hart cache back to the global allocator.
+void
+pmm_release_frame(paddr_t frame)
+{
+        struct pmm_memory_region* region = pmm_find_region(frame);
+        ASSERT(region != NULL);
+        error_t err = pmm_frame_free(region, frame);
+        ASSERT(error_is_ok(err), SV("pmm: per-hart cache held an invalid frame {X}"), frame);
+        region->free_bytes += RISCV_SV39_PAGE_SIZE;
+        free_bytes += RISCV_SV39_PAGE_SIZE;
+}
+
+/// Pushes up to `count` frames from the top of the magazine back to the global allocator.
+void
+pmm_magazine_drain(struct pmm_magazine* mag, size_t count)
+{
+        for (; count > 0 && mag->count > 0; count--) {
+                pmm_release_frame(mag->frames[--mag->count]);
+        }
+        mag->stats.drains++;
+}
+
+/// Empties the magazine and zero pool of the calling hart.
+void
+pmm_hart_caches_drain(u64 hartid)
+{
+        struct pmm_magazine* mag = &magazines[hartid];
+        if (mag->count > 0) {
+                pmm_magazine_drain(mag, mag->count);
+        }
+        struct pmm_zero_pool* pool = &zero_pools[hartid];
+        while (pool->count > 0) {
+                pmm_release_frame(pool->frames[--pool->count]);
+        }
+}
+
+/// Drains the calling hart's caches if another hart asked for it, called before the hart touches its caches.
+void
+pmm_hart_caches_check(u64 hartid)
+{
+        if (__atomic_exchange_n(&magazines[hartid].drain_requested, false, __ATOMIC_ACQUIRE)) {
+                pmm_hart_caches_drain(hartid);
+        }
+}
+
+/// Drains the calling hart's magazine and zero pool right away, and asks every other hart to drain its own. Other
+/// harts' caches are never touched from here, they may be in the middle of their lock-free fast path.
+void
+pmm_magazine_drain_all(void)
+{
+        u64 hartid = kernel_hartid();
+        ASSERT(hartid < KERNEL_MAX_HARTS);
+        for (size_t hart = 0; hart < KERNEL_MAX_HARTS; hart++) {
+                if (hart != hartid) {
+                        __atomic_store_n(&magazines[hart].drain_requested, true, __ATOMIC_RELEASE);
+                }
+        }
+        __atomic_store_n(&magazines[hartid].drain_requested, false, __ATOMIC_RELAXED);
+        pmm_hart_caches_drain(hartid);
+}
+
+bool
+pmm_magazine_alloc(paddr_t* out)
+{
+        u64 hartid = kernel_hartid();
+        ASSERT(hartid < KERNEL_MAX_HARTS);
+        pmm_hart_caches_check(hartid);
+        struct pmm_magazine* mag = &magazines[hartid];
+        if (mag->count > 0) {
+                mag->stats.hits++;
+        } else {
+                mag->stats.misses++;
+                if (!pmm_magazine_refill(mag)) {
+                        return false;
+                }
+        }
+        *out = mag->frames[--mag->count];
+        return true;
+}
+
+void
+pmm_magazine_free(paddr_t frame)
+{
+        u64 hartid = kernel_hartid();
+        ASSERT(hartid < KERNEL_MAX_HARTS);
+        pmm_hart_caches_check(hartid);
+        struct pmm_magazine* mag = &magazines[hartid];
+        if (mag->count == MAGAZINE_SIZE) {
+                pmm_magazine_drain(mag, MAGAZINE_BATCH);
+        }
+        mag->frames[mag->count++] = frame;
+}
+
+// ===================================================================================================
+// Zeroed Frames
+// ===================================================================================================
+
+bool
+pmm_zero_pool_alloc(paddr_t* out)
+{
+        u64 hartid = kernel_hartid();
+        ASSERT(hartid < KERNEL_MAX_HARTS);
+        pmm_hart_caches_check(hartid);
+        struct pmm_zero_pool* pool = &zero_pools[hartid];
+        if (pool->count == 0) {
+                return false;
+        }
+        *out = pool->frames[--pool->count];
+        return true;
+}
+
+bool
+pmm_idle_zero(void)
+{
+        u64 hartid = kernel_hartid();
+        ASSERT(hartid < KERNEL_MAX_HARTS);
+        pmm_hart_caches_check(hartid);
+        struct pmm_zero_pool* pool = &zero_pools[hartid];
+        paddr_t frame = 0;
+        // Taken straight from the global allocator, so that the magazine's counters only reflect real allocations.
+        if (pool->count == ZERO_POOL_SIZE || !pmm_take_frame(&frame)) {
+                return false;
+        }
+        memzero(kernel_hhdm_phys_to_virt(frame), RISCV_SV39_PAGE_SIZE);
+        pool->frames[pool->count++] = frame;
+        return true;
+}
+
+// ===================================================================================================
+// Page Metadata
+// ===================================================================================================
+
+struct pmm_page*
+pmm_page_in(struct pmm_memory_region* region, paddr_t frame)
+{
+        return &region->pages[(frame - region->region_base) / RISCV_SV39_PAGE_SIZE];
+}
+
+/// Fills in the page metadata of a fresh allocation of `size` bytes, which starts out with a single reference.
+void
+pmm_page_track(paddr_t base, size_t size, u16 flags)
+{
+        struct pmm_memory_region* region = pmm_find_region(base);
+        ASSERT(region != NULL);
+        struct pmm_page* page = pmm_page_in(region, base);
+        size_t pages = size / RISCV_SV39_PAGE_SIZE;
+        page->refcount = 1;
+        page->flags = PMM_PAGE_ALLOCATED | flags;
+        page->order = pages > 1 ? 64 - __builtin_clzl(pages - 1) : 0;
+        page->pages = pages;
+        page->owner = NULL;
+        page->owner_next = NULL;
+}
+
+// ===================================================================================================
+// Movable Pages and Compaction
+// ===================================================================================================
+
+/// Claims the first frame word of the highest free megablock of the region. Movable frames fill megablocks from the
+/// top of a region down while everything else fills them from the bottom up.
+bool
+pmm_movable_claim_free(struct pmm_memory_region* region, paddr_t* out)
+{
+        for (size_t n = region->mega_count; n > 0; n--) {
+                struct pmm_megablock* mega = &region->megablocks[n - 1];
+                if (mega->free_pages != MEGABLOCK_PAGES || !pmm_mega_whole(region, n - 1) || mega == compacting) {
+                        continue;
+                }
+                paddr_t chunk = region->mega_origin + (n - 1) * RISCV_SV39_MEGAPAGE_SIZE;
+                if (error_is_ok(pmm_backend_claim(region, chunk, FRAME_WORD_SPAN))) {
+                        region->movable_hint = n - 1;
+                        *out = chunk;
+                        return true;
+                }
+        }
+        return false;
+}
+
+/// Takes a frame for a movable allocation out of the global allocator, returning the region it came from.
+struct pmm_memory_region*
+pmm_movable_frame_alloc(paddr_t* out)
+{
+        for (size_t i = 0; i < region_count; i++) {
+                if (regions[i]->movable_bits != 0) {
+                        size_t bit = __builtin_ctzl(regions[i]->movable_bits);
+                        regions[i]->movable_bits &= ~(1UL << bit);
+                        *out = regions[i]->movable_word + bit * RISCV_SV39_PAGE_SIZE;
+                        return regions[i];
+                }
+        }
+
+        struct pmm_memory_region* refilled = NULL;
+        paddr_t chunk = 0;
+        for (size_t i = 0; i < region_count && refilled == NULL; i++) {
+                if (regions[i]->free_bytes >= FRAME_WORD_SPAN && pmm_frame_claim_broken(regions[i], true, &chunk)) {
+                        refilled = regions[i];
+                }
+        }
+        for (size_t i = 0; i < region_count && refilled == NULL; i++) {
+                if (regions[i]->free_bytes >= FRAME_WORD_SPAN && pmm_movable_claim_free(regions[i], &chunk)) {
+                        refilled = regions[i];
+                }
+        }
+        for (size_t i = 0; i < region_count && refilled == NULL; i++) {
+                if (regions[i]->free_bytes >= FRAME_WORD_SPAN &&
+                    error_is_ok(pmm_backend_alloc(regions[i], FRAME_WORD_SPAN, FRAME_WORD_SPAN, &chunk))) {
+                        refilled = regions[i];
+                }
+        }
+        if (refilled != NULL) {
+                refilled->movable_word = chunk;
+                refilled->movable_bits = ~1UL;
+                *out = chunk;
+                return refilled;
+        }
+
+        for (size_t i = 0; i < region_count; i++) {
+                if (error_is_ok(pmm_backend_alloc(regions[i], RISCV_SV39_PAGE_SIZE, RISCV_SV39_PAGE_SIZE, out))) {
+                        return regions[i];
+                }
+        }
+        return NULL;
+}
+
+/// Returns the unused frames of the region's movable frame word to the policy backend.
+void
+pmm_movable_drain(struct pmm_memory_region* region)
+{
+        if (region->movable_bits == ~0UL) {
+                error_t err = pmm_backend_free(region, region->movable_word, FRAME_WORD_SPAN);
+                ASSERT(error_is_ok(err));
+                region->movable_bits = 0;
+                return;
+        }
+        // Each bit is cleared only once its frame is back in the backend, so a block arena refill in between still
+        // sees the frame as spare rather than pinned.
+        while (region->movable_bits != 0) {
+                size_t bit = __builtin_ctzl(region->movable_bits);
+                error_t err =
+                  pmm_backend_free(region, region->movable_word + bit * RISCV_SV39_PAGE_SIZE, RISCV_SV39_PAGE_SIZE);
+                ASSERT(error_is_ok(err));
+                region->movable_bits &= ~(1UL << bit);
+        }
+}
+
+/// Returns the link to the descriptor of `frame` in its megablock's movable list, or NULL if it isn't a movable frame.
+struct pmm_movable_page**
+pmm_movable_find(struct pmm_memory_region* region, paddr_t frame)
+{
+        struct pmm_megablock* mega = pmm_mega_of(region, frame);
+        for (struct pmm_movable_page** link = &mega->movable; mega->movable_pages > 0 && *link != NULL;
+             link = &(*link)->next) {
+                if ((*link)->frame == frame) {
+                        return link;
+                }
+        }
+        return NULL;
+}
+
+/// Stops tracking the movable frame whose descriptor `link` points at.
+void
+pmm_movable_forget(struct pmm_megablock* mega, struct pmm_movable_page** link)
+{
+        struct pmm_movable_page* page = *link;
+        *link = page->next;
+        mega->movable_pages--;
+        error_t err = slab_free(&movable_arena, page);
+        ASSERT(error_is_ok(err));
+}
+
+/// Moves every movable frame out of megablock `index` of the region, stopping at the first frame that can't be moved.
+error_t
+pmm_compact_megablock(struct pmm_memory_region* region, size_t index)
+{
+        struct pmm_megablock* mega = &region->megablocks[index];
+        paddr_t mega_base = region->mega_origin + index * RISCV_SV39_MEGAPAGE_SIZE;
+        // New frames that land inside the megablock itself are held aside until it's done, linked through their first
+        // word.
+        paddr_t held = 0;
+        size_t held_count = 0;
+        error_t err = EC_SUCCESS;
+        compacting = mega;
+        while (mega->movable != NULL) {
+                paddr_t target = 0;
+                struct pmm_memory_region* target_region = pmm_movable_frame_alloc(&target);
+                if (target_region == NULL) {
+                        err = EC_PMM_OUT_OF_MEMORY;
+                        break;
+                }
+                target_region->free_bytes -= RISCV_SV39_PAGE_SIZE;
+                free_bytes -= RISCV_SV39_PAGE_SIZE;
+                if (target >= mega_base && target < mega_base + RISCV_SV39_MEGAPAGE_SIZE) {
+                        *(paddr_t*)kernel_hhdm_phys_to_virt(target) = held;
+                        held = target;
+                        held_count++;
+                        continue;
+                }
+
+                struct pmm_movable_page* page = mega->movable;
+                struct pmm_page* from_page = pmm_page_in(region, page->frame);
+                struct pmm_page* to_page = pmm_page_in(target_region, target);
+                memcopy(kernel_hhdm_phys_to_virt(target), kernel_hhdm_phys_to_virt(page->frame), RISCV_SV39_PAGE_SIZE);
+                *to_page = *from_page;
+                err = page->migrate_fn(page->context, page->frame, target);
+                if (error_is_err(err)) {
+                        *to_page = (struct pmm_page){ 0 };
+                        error_t free_err = pmm_backend_free(target_region, target, RISCV_SV39_PAGE_SIZE);
+                        ASSERT(error_is_ok(free_err));
+                        target_region->free_bytes += RISCV_SV39_PAGE_SIZE;
+                        free_bytes += RISCV_SV39_PAGE_SIZE;
+                        break;
+                }
+
+                mega->movable = page->next;
+                mega->movable_pages--;
+                struct pmm_megablock* target_mega = pmm_mega_of(target_region, target);
+                page->next = target_mega->movable;
+                target_mega->movable = page;
+                target_mega->movable_pages++;
+
+                *from_page = (struct pmm_page){ 0 };
+                error_t free_err = pmm_backend_free(region, page->frame, RISCV_SV39_PAGE_SIZE);
+                ASSERT(error_is_ok(free_err));
+                region->free_bytes += RISCV_SV39_PAGE_SIZE;
+                free_bytes += RISCV_SV39_PAGE_SIZE;
+                page->frame = target;
+        }
+
+        for (; held_count > 0; held_count--) {
+                paddr_t next = *(paddr_t*)kernel_hhdm_phys_to_virt(held);
+                error_t free_err = pmm_backend_free(region, held, RISCV_SV39_PAGE_SIZE);
+                ASSERT(error_is_ok(free_err));
+                region->free_bytes += RISCV_SV39_PAGE_SIZE;
+                free_bytes += RISCV_SV39_PAGE_SIZE;
+                held = next;
+        }
+        compacting = NULL;
+        return err;
+}
+
+/// Returns every frame cached in the calling hart's caches, the frame bitmaps and the movable frame words to the
+/// policy backend. Other harts return their cached frames the next time they allocate or free one.
+void
+pmm_drain_caches(void)
+{
+        pmm_magazine_drain_all();
+        for (size_t i = 0; i < region_count; i++) {
+                pmm_frame_drain(regions[i]);
+                pmm_movable_drain(regions[i]);
+        }
+}
+
+// ===================================================================================================
+// Memory Pressure
+// ===================================================================================================
+
+/// Takes a range for a request that the per-hart caches couldn't serve. Frames cached in the per-hart caches and
+/// bitmaps can keep a contiguous request from fitting, so they are drained before giving up, and megapage sized
+/// requests can still be met by moving movable frames out of the way. `PMM_ALLOC_NORETRY` requests skip both.
+struct pmm_memory_region*
+pmm_alloc_attempt(size_t aligned_size, size_t alignment, u64 flags, paddr_t* out)
+{
+        if (free_bytes < aligned_size) {
+                return NULL;
+        }
+        if (aligned_size == RISCV_SV39_PAGE_SIZE && alignment == RISCV_SV39_PAGE_SIZE) {
+                return pmm_frame_alloc(out);
+        }
+
+        struct pmm_memory_region* chosen = pmm_backend_alloc_any(aligned_size, alignment, out);
+        if (chosen == NULL && (flags & PMM_ALLOC_NORETRY) != 0) {
+                return NULL;
+        }
+        if (chosen == NULL) {
+                pmm_drain_caches();
+                chosen = pmm_backend_alloc_any(aligned_size, alignment, out);
+        }
+        bool WANTS_MEGAPAGES = alignment >= RISCV_SV39_MEGAPAGE_SIZE || aligned_size >= RISCV_SV39_MEGAPAGE_SIZE;
+        if (chosen == NULL && WANTS_MEGAPAGES && compacting == NULL &&
+            pmm_compact(ALIGN_UP(aligned_size, RISCV_SV39_MEGAPAGE_SIZE) / RISCV_SV39_MEGAPAGE_SIZE) > 0) {
+                chosen = pmm_backend_alloc_any(aligned_size, alignment, out);
+        }
+        return chosen;
+}
+
+/// Runs the reclaim hooks, returns the number of bytes they gave back.
+size_t
+pmm_reclaim(void)
+{
+        if (reclaiming) {
+                return 0;
+        }
+        reclaiming = true;
+        size_t released = 0;
+        for (size_t i = 0; i < reclaim_hook_count; i++) {
+                released += reclaim_hooks[i].reclaim_fn(reclaim_hooks[i].context);
+        }
+        reclaiming = false;
+        return released;
+}
+
+// ===================================================================================================
+// Statistics
+// ===================================================================================================
+
+/// Returns the size class of a run or allocation of `pages` pages.
+size_t
+pmm_stats_class(size_t pages, bool ROUND_UP)
+{
+        if (pages <= 1) {
+                return 0;
+        }
+        size_t order = ROUND_UP ? 64 - __builtin_clzl(pages - 1) : 63 - __builtin_clzl(pages);
+        return order < PMM_STATS_SIZE_CLASSES ? order : PMM_STATS_SIZE_CLASSES - 1;
+}
+
+void
+pmm_stats_record(size_t size, bool FAILED, u64 cycles)
+{
+        u64 hartid = kernel_hartid();
+        ASSERT(hartid < KERNEL_MAX_HARTS);
+        struct pmm_alloc_stats* stats = &alloc_stats[hartid];
+        size_t class = pmm_stats_class(ALIGN_UP(size, RISCV_SV39_PAGE_SIZE) / RISCV_SV39_PAGE_SIZE, true);
+        if (FAILED) {
+                stats->failures[class]++;
+        } else {
+                stats->allocations[class]++;
+        }
+        size_t bucket = cycles == 0 ? 0 : 63 - __builtin_clzl(cycles);
+        stats->latency[bucket < PMM_STATS_LATENCY_BUCKETS ? bucket : PMM_STATS_LATENCY_BUCKETS - 1]++;
+}
+
+void
+pmm_stats_add_run(struct pmm_region_stats* stats, size_t size)
+{
+        stats->free_runs[pmm_stats_class(size / RISCV_SV39_PAGE_SIZE, false)]++;
+        if (size > stats->largest_free_run) {
+                stats->largest_free_run = size;
+        }
+}
+
+/// Walks the free runs of the region's policy backend. The buddy policy keeps adjacent free blocks apart whenever they
+/// aren't buddies, so its runs are pieced together from the block tags.
+void
+pmm_stats_collect(struct pmm_memory_region* region, struct pmm_region_stats* stats)
+{
+        *stats = (struct pmm_region_stats){ 0 };
+        stats->region_base = region->region_base;
+        stats->region_size = region->region_size;
+        stats->free_bytes = region->free_bytes;
+        stats->cached_frames = region->frame_count;
+        if (policy != PMM_POLICY_BUDDY) {
+                for (struct pmm_memory_block* block = region->free_blocks; block != NULL; block = block->next) {
+                        pmm_stats_add_run(stats, block->block_size);
+                }
+                return;
+        }
+
+        size_t run = 0;
+        paddr_t addr = region->region_base;
+        while (addr < region->region_base + region->region_size) {
+                u8 tag = region->buddy_tags[pmm_buddy_tag_index(region, addr)];
+                if ((tag & PMM_BUDDY_TAG_FREE) == 0) {
+                        if (run > 0) {
+                                pmm_stats_add_run(stats, run);
+                        }
+                        run = 0;
+                        addr += RISCV_SV39_PAGE_SIZE;
+                        continue;
+                }
+                size_t block_size = (size_t)RISCV_SV39_PAGE_SIZE << (tag & ~PMM_BUDDY_TAG_FREE);
+                run += block_size;
+                addr += block_size;
+        }
+        if (run > 0) {
+                pmm_stats_add_run(stats, run);
+        }
+}
+
+// ===================================================================================================
+// Public Interface
+// ===================================================================================================
+
+/// Adds a range that doesn't overlap any reservation as a new region.
+error_t
+pmm_add_range(u64 region_base, size_t region_size)
+{
+        size_t aligned_base = ALIGN_UP(region_base, RISCV_SV39_PAGE_SIZE);
+        size_t aligned_size = ALIGN_DOWN(region_size - (aligned_base - region_base), RISCV_SV39_PAGE_SIZE);
+        bool ALIGNED_REGION_FITS = aligned_base + aligned_size <= region_base + region_size;
+        bool NEW_SIZE_NON_ZERO = aligned_size >= RISCV_SV39_PAGE_SIZE;
+        if (!ALIGNED_REGION_FITS || !NEW_SIZE_NON_ZERO) {
+                return EC_PMM_REGION_TOO_SMALL;
+        }
+
+        // The new region goes before the first region above it, and must not overlap either of its neighbours.
+        size_t index = 0;
+        while (index < region_count && regions[index]->region_base <= aligned_base) {
+                index++;
+        }
+        bool OVERLAPS_PREVIOUS =
+          index > 0 && aligned_base < regions[index - 1]->region_base + regions[index - 1]->region_size;
+        bool OVERLAPS_NEXT = index < region_count && aligned_base + aligned_size > regions[index]->region_base;
+        if (OVERLAPS_PREVIOUS || OVERLAPS_NEXT) {
+                return EC_PMM_REGION_ALREADY_MANAGED;
+        }
 
-enum pmm_policy policy = PMM_POLICY_FIRST_FIT;
-size_t total_bytes = 0;
-size_t free_bytes = 0;
-size_t region_count = 0;
-struct pmm_memory_region regions[REGION_COUNT] = { 0 };
-struct slab_alloc block_arena = { 0 };
+        // Carve the region descriptor, the megablocks, the page metadata, the frame bitmap, its summary and (for the
+        // buddy policy) the buddy tags from the start of the range. The page metadata and buddy tags are sized for the
+        // whole range, a little more than the region that is left over.
+        paddr_t mega_origin = ALIGN_DOWN(aligned_base, RISCV_SV39_MEGAPAGE_SIZE);
+        size_t mega_count = (ALIGN_UP(aligned_base + aligned_size, RISCV_SV39_MEGAPAGE_SIZE) - mega_origin) /
+                            RISCV_SV39_MEGAPAGE_SIZE;
+        paddr_t frame_origin = ALIGN_DOWN(aligned_base, FRAME_WORD_SPAN);
+        size_t frame_words = (ALIGN_UP(aligned_base + aligned_size, FRAME_WORD_SPAN) - frame_origin) / FRAME_WORD_SPAN;
+        size_t summary_words = ALIGN_UP(frame_words, 64) / 64;
+        size_t page_bytes = aligned_size / RISCV_SV39_PAGE_SIZE * sizeof(struct pmm_page);
+        size_t tag_bytes = policy == PMM_POLICY_BUDDY ? aligned_size / RISCV_SV39_PAGE_SIZE : 0;
+        size_t metadata_size = ALIGN_UP(sizeof(struct pmm_memory_region) + mega_count * sizeof(struct pmm_megablock) +
+                                          page_bytes + (frame_words + summary_words) * sizeof(u64) + tag_bytes,
+                                        RISCV_SV39_PAGE_SIZE);
+        if (metadata_size + RISCV_SV39_PAGE_SIZE > aligned_size) {
+                return EC_PMM_REGION_TOO_SMALL;
+        }
+        if (region_count == region_capacity) {
+                error_t err = pmm_grow_region_table();
+                if (error_is_err(err)) {
+                        return err;
+                }
+        }
+        u8* metadata = kernel_hhdm_phys_to_virt(aligned_base);
+        memzero(metadata, metadata_size);
 
-/// Initial slab buffer
-#define INITIAL_BUF_SIZE SLAB_REGION_SIZE(sizeof(struct pmm_memory_block), 100)
-alignas(SLAB_REGION_ALIGN) u8 initial_buf[INITIAL_BUF_SIZE] = {};
+        for (size_t i = region_count; i > index; i--) {
+                regions[i] = regions[i - 1];
+        }
+        if (index <= next_fit_region && next_fit_region < region_count) {
+                next_fit_region++;
+        }
+        struct pmm_memory_region* region = (struct pmm_memory_region*)metadata;
+        regions[index] = region;
+        region->region_base = aligned_base + metadata_size;
+        region->region_size = aligned_size - metadata_size;
+        region->free_bytes = region->region_size;
+        region->megablocks = (struct pmm_megablock*)(region + 1);
+        region->mega_origin = mega_origin;
+        region->mega_count = mega_count;
+        region->mega_hint = 0;
+        region->pages = (struct pmm_page*)(region->megablocks + mega_count);
+        region->frame_bitmap = (u64*)((u8*)region->pages + page_bytes);
+        region->frame_summary = region->frame_bitmap + frame_words;
+        region->frame_origin = frame_origin;
+        region->frame_words = frame_words;
+        region->frame_count = 0;
+        region->frame_hint = 0;
+        region->buddy_tags = policy == PMM_POLICY_BUDDY ? (u8*)(region->frame_summary + summary_words) : NULL;
+        if (policy == PMM_POLICY_BUDDY) {
+                pmm_buddy_add_region(region);
+        } else {
+                pmm_list_add_region(region);
+        }
+        pmm_mega_account(region, region->region_base, region->region_size, false);
+        region_count++;
 
-void
-pmm_initialize(enum pmm_policy pol)
-{
-        policy = pol;
-        slab_init(&block_arena, sizeof(struct pmm_memory_block));
-        slab_grow(&block_arena, initial_buf, INITIAL_BUF_SIZE);
+        total_bytes += region->region_size;
+        free_bytes += region->region_size;
+        metadata_bytes += metadata_size;
+        page_metadata_bytes += page_bytes;
+        return EC_SUCCESS;
 }
 
 error_t
 pmm_add_region(u64 region_base, size_t region_size)
 {
-        if (region_count >= REGION_COUNT) {
-                return EC_PMM_REGION_LIST_FULL;
+        paddr_t cursor = region_base;
+        paddr_t region_end = region_base + region_size;
+        bool CARVED = false;
+        for (size_t i = 0; i < reserved_count && cursor < region_end; i++) {
+                paddr_t reserved_end = reserved_ranges[i].reserved_base + reserved_ranges[i].reserved_size;
+                if (reserved_end <= cursor) {
+                        continue;
+                }
+                if (reserved_ranges[i].reserved_base >= region_end) {
+                        break;
+                }
+
+                // The pieces left between reservations can be too small to be worth managing, those are dropped.
+                CARVED = true;
+                if (reserved_ranges[i].reserved_base > cursor) {
+                        error_t err = pmm_add_range(cursor, reserved_ranges[i].reserved_base - cursor);
+                        if (error_is_err(err) && err != EC_PMM_REGION_TOO_SMALL) {
+                                return err;
+                        }
+                }
+                cursor = reserved_end;
         }
 
-        size_t aligned_base = ALIGN_UP(region_base, RISCV_SV39_PAGE_SIZE);
-        size_t aligned_size = ALIGN_DOWN(region_size - (aligned_base - region_base), RISCV_SV39_PAGE_SIZE);
-        bool ALIGNED_REGION_FITS = aligned_base + aligned_size <= region_base + region_size;
-        bool NEW_SIZE_NON_ZERO = aligned_size >= RISCV_SV39_PAGE_SIZE;
-        if (!ALIGNED_REGION_FITS || !NEW_SIZE_NON_ZERO) {
-                return EC_PMM_REGION_TOO_SMALL;
+        if (!CARVED) {
+                return pmm_add_range(region_base, region_size);
+        }
+        if (cursor < region_end) {
+                error_t err = pmm_add_range(cursor, region_end - cursor);
+                if (error_is_err(err) && err != EC_PMM_REGION_TOO_SMALL) {
+                        return err;
+                }
+        }
+        return EC_SUCCESS;
+}
+
+error_t
+pmm_reserve_region(paddr_t reserved_base, size_t reserved_size)
+{
+        if (reserved_size == 0) {
+                return EC_SUCCESS;
         }
 
+        paddr_t base = ALIGN_DOWN(reserved_base, RISCV_SV39_PAGE_SIZE);
+        paddr_t end = ALIGN_UP(reserved_base + reserved_size, RISCV_SV39_PAGE_SIZE);
         for (size_t i = 0; i < region_count; i++) {
-                bool LOWER_BOUND = regions[i].region_base <= aligned_base;
-                bool UPPER_BOUND = aligned_base <= regions[i].region_base + regions[i].region_size;
-                if (LOWER_BOUND && UPPER_BOUND) {
+                if (base < regions[i]->region_base + regions[i]->region_size && regions[i]->region_base < end) {
                         return EC_PMM_REGION_ALREADY_MANAGED;
                 }
         }
 
-        struct pmm_memory_block* free_block = slab_allocate(&block_arena);
-        ASSERT(free_block != NULL);
-        regions[region_count].region_base = aligned_base;
-        regions[region_count].region_size = aligned_size;
-        regions[region_count].free_bytes = aligned_size;
-        regions[region_count].free_blocks = free_block;
-        free_block->block_base = aligned_base;
-        free_block->block_size = aligned_size;
-        free_block->next = NULL;
-        region_count++;
+        // Find the first range that ends at or after the new one starts, then swallow every range it touches.
+        size_t first = 0;
+        while (first < reserved_count &&
+               reserved_ranges[first].reserved_base + reserved_ranges[first].reserved_size < base) {
+                first++;
+        }
+        size_t last = first;
+        while (last < reserved_count && reserved_ranges[last].reserved_base <= end) {
+                paddr_t last_end = reserved_ranges[last].reserved_base + reserved_ranges[last].reserved_size;
+                base = reserved_ranges[last].reserved_base < base ? reserved_ranges[last].reserved_base : base;
+                end = last_end > end ? last_end : end;
+                last++;
+        }
 
-        total_bytes += aligned_size;
-        free_bytes += aligned_size;
+        if (first == last) {
+                if (reserved_count >= RESERVED_COUNT) {
+                        return EC_PMM_RESERVED_LIST_FULL;
+                }
+                for (size_t i = reserved_count; i > first; i--) {
+                        reserved_ranges[i] = reserved_ranges[i - 1];
+                }
+                reserved_count++;
+        } else if (last - first > 1) {
+                for (size_t i = last; i < reserved_count; i++) {
+                        reserved_ranges[first + 1 + i - last] = reserved_ranges[i];
+                }
+                reserved_count -= last - first - 1;
+        }
+        reserved_ranges[first].reserved_base = base;
+        reserved_ranges[first].reserved_size = end - base;
         return EC_SUCCESS;
 }
 
+/// Body of `pmm_alloc_flags()`, which times it.
 error_t
-pmm_alloc_aligned(size_t size, size_t alignment, paddr_t* region)
+pmm_alloc_untimed(size_t size, size_t alignment, u64 flags, paddr_t* region)
 {
         size_t aligned_size = ALIGN_UP(size, RISCV_SV39_PAGE_SIZE);
         if (region == NULL) {
@@ -95,70 +1871,114 @@ pmm_alloc_aligned(size_t size, size_t alignment, paddr_t* region)
                 *region = 0;
                 return EC_PMM_BAD_ALIGNMENT;
         }
-        if (free_bytes < aligned_size) {
+
+        // Single frames are served by the calling hart's zero pool (when zeroed memory was asked for) or magazine,
+        // which refills from the frame bitmaps. Everything else goes to the policy backend. Memory cached by other
+        // subsystems is the last resort.
+        bool IS_SINGLE_FRAME = aligned_size == RISCV_SV39_PAGE_SIZE && alignment == RISCV_SV39_PAGE_SIZE;
+        bool ZERO = (flags & PMM_ALLOC_NOZERO) == 0;
+        if (IS_SINGLE_FRAME && ZERO && pmm_zero_pool_alloc(region)) {
+                pmm_page_track(*region, aligned_size, 0);
+                return EC_SUCCESS;
+        }
+        if (IS_SINGLE_FRAME && pmm_magazine_alloc(region)) {
+                if (ZERO) {
+                        memzero(kernel_hhdm_phys_to_virt(*region), aligned_size);
+                }
+                pmm_page_track(*region, aligned_size, 0);
+                return EC_SUCCESS;
+        }
+        struct pmm_memory_region* chosen = pmm_alloc_attempt(aligned_size, alignment, flags, region);
+        if (chosen == NULL && (flags & PMM_ALLOC_NORETRY) == 0 && pmm_reclaim() > 0) {
+                chosen = pmm_alloc_attempt(aligned_size, alignment, flags, region);
+        }
+        if (chosen == NULL) {
                 *region = 0;
                 return EC_PMM_OUT_OF_MEMORY;
         }
-        if (block_arena.free_blocks < 16) {
-                TODO("struct pmm_memory_block arena allocator is out of memory. Need to implement "
-                     "refilling.");
-        }
-        if (policy != PMM_POLICY_FIRST_FIT) {
-                TODO("Chosen policy is not implemented.");
+        chosen->free_bytes -= aligned_size;
+        free_bytes -= aligned_size;
+        if (ZERO) {
+                memzero(kernel_hhdm_phys_to_virt(*region), aligned_size);
         }
+        pmm_page_track(*region, aligned_size, 0);
+        return EC_SUCCESS;
+}
 
-        for (size_t i = 0; i < region_count; i++) {
-                if (regions[i].free_bytes < aligned_size) {
-                        continue;
-                }
+error_t
+pmm_alloc_flags(size_t size, size_t alignment, u64 flags, paddr_t* region)
+{
+        u64 start = riscv_cycle();
+        error_t err = pmm_alloc_untimed(size, alignment, flags, region);
+        pmm_stats_record(size, error_is_err(err), riscv_cycle() - start);
+        return err;
+}
 
-                struct pmm_memory_block* curr = regions[i].free_blocks;
-                struct pmm_memory_block* prev = NULL;
-                while (curr != NULL) {
-                        size_t curr_base = curr->block_base;
-                        size_t curr_size = curr->block_size;
-                        size_t aligned_base = ALIGN_UP(curr_base, alignment);
-                        if (curr_base + curr_size < aligned_base + aligned_size) {
-                                prev = curr;
-                                curr = curr->next;
-                                continue;
-                        }
+error_t
+pmm_alloc_pages_bulk(size_t count, u64 flags, paddr_t* frames)
+{
+        if (frames == NULL) {
+                return EC_NULL_ARGUMENT;
+        }
+        u64 start = riscv_cycle();
+        u64 hartid = kernel_hartid();
+        ASSERT(hartid < KERNEL_MAX_HARTS);
+        bool ZERO = (flags & PMM_ALLOC_NOZERO) == 0;
+        pmm_hart_caches_check(hartid);
 
-                        size_t offset = aligned_base - curr_base;
-                        bool EXISTS_PRECEEDING = curr_base != aligned_base;
-                        bool EXISTS_POSTCEEDING = curr_base + curr_size > aligned_base + aligned_size;
-                        if (EXISTS_PRECEEDING && EXISTS_POSTCEEDING) {
-                                curr->block_size = offset;
-                                struct pmm_memory_block* extra = slab_allocate(&block_arena);
-                                ASSERT(extra != NULL);
-                                extra->block_base = aligned_base + aligned_size;
-                                extra->block_size = curr_base + curr_size - (aligned_base + aligned_size);
-                                extra->next = curr->next;
-                        } else if (EXISTS_PRECEEDING) {
-                                curr->block_size = offset;
-                        } else if (EXISTS_POSTCEEDING) {
-                                curr->block_base = aligned_base + aligned_size;
-                                curr->block_size = curr_base + curr->block_size - (aligned_base + aligned_size);
-                        } else if (prev == NULL) {
-                                regions[i].free_blocks = curr->next;
-                                error_t err = slab_free(&block_arena, curr);
-                                ASSERT(error_is_ok(err));
-                        } else {
-                                prev->next = curr->next;
-                                error_t err = slab_free(&block_arena, curr);
-                                ASSERT(error_is_ok(err));
+        // The calling hart's caches are emptied first, then frames are taken straight from the frame bitmaps rather
+        // than cycled through the magazine. Only what the bitmaps can't provide goes down the single frame path, which
+        // drains caches and runs reclaim.
+        size_t done = 0;
+        struct pmm_zero_pool* pool = &zero_pools[hartid];
+        for (; ZERO && done < count && pool->count > 0; done++) {
+                frames[done] = pool->frames[--pool->count];
+        }
+        size_t prezeroed = done;
+        struct pmm_magazine* mag = &magazines[hartid];
+        for (; done < count && mag->count > 0; done++) {
+                frames[done] = mag->frames[--mag->count];
+                mag->stats.hits++;
+        }
+        for (; done < count; done++) {
+                struct pmm_memory_region* region = pmm_frame_alloc(&frames[done]);
+                if (region == NULL) {
+                        break;
+                }
+                region->free_bytes -= RISCV_SV39_PAGE_SIZE;
+                free_bytes -= RISCV_SV39_PAGE_SIZE;
+        }
+        for (size_t i = 0; i < done; i++) {
+                if (ZERO && i >= prezeroed) {
+                        memzero(kernel_hhdm_phys_to_virt(frames[i]), RISCV_SV39_PAGE_SIZE);
+                }
+                pmm_page_track(frames[i], RISCV_SV39_PAGE_SIZE, 0);
+        }
+        for (; done < count; done++) {
+                error_t err = pmm_alloc_untimed(RISCV_SV39_PAGE_SIZE, RISCV_SV39_PAGE_SIZE, flags, &frames[done]);
+                if (error_is_err(err)) {
+                        for (size_t i = 0; i < done; i++) {
+                                error_t free_err = pmm_free(frames[i], RISCV_SV39_PAGE_SIZE);
+                                ASSERT(error_is_ok(free_err));
+                                frames[i] = 0;
                         }
-
-                        regions[i].free_bytes -= aligned_size;
-                        free_bytes -= aligned_size;
-                        *region = aligned_base;
-                        memzero(kernel_hhdm_phys_to_virt(*region), aligned_size);
-                        return EC_SUCCESS;
+                        pmm_stats_record(RISCV_SV39_PAGE_SIZE, true, riscv_cycle() - start);
+                        return err;
                 }
         }
 
-        *region = 0;
-        return EC_PMM_OUT_OF_MEMORY;
+        // Every frame counts as an allocation of its own, the batch's cycles are split evenly between them.
+        u64 cycles = count == 0 ? 0 : (riscv_cycle() - start) / count;
+        for (size_t i = 0; i < count; i++) {
+                pmm_stats_record(RISCV_SV39_PAGE_SIZE, false, cycles);
+        }
+        return EC_SUCCESS;
+}
+
+error_t
+pmm_alloc_aligned(size_t size, size_t alignment, paddr_t* region)
+{
+        return pmm_alloc_flags(size, alignment, PMM_ALLOC_DEFAULT, region);
 }
 
 paddr_t
@@ -185,19 +2005,410 @@ pmm_alloc_noerr(size_t size)
 }
 
 error_t
-pmm_free(paddr_t region)
+pmm_free(paddr_t region, size_t size)
+{
+        size_t aligned_size = ALIGN_UP(size, RISCV_SV39_PAGE_SIZE);
+        if (!IS_ALIGNED(region, RISCV_SV39_PAGE_SIZE) || aligned_size == 0) {
+                return EC_PMM_INVALID_FREE;
+        }
+
+        struct pmm_memory_region* owner = pmm_find_region(region);
+        if (owner == NULL || region + aligned_size > owner->region_base + owner->region_size) {
+                return EC_PMM_INVALID_FREE;
+        }
+        // Double frees and frees of the wrong size are caught here, before the frames reach a magazine or the backend
+        // and get handed out twice.
+        struct pmm_page* page = pmm_page_in(owner, region);
+        bool ALLOCATED = (page->flags & PMM_PAGE_ALLOCATED) != 0;
+        if (!ALLOCATED || (size_t)page->pages * RISCV_SV39_PAGE_SIZE != aligned_size) {
+                return EC_PMM_INVALID_FREE;
+        }
+        bool MOVABLE = aligned_size == RISCV_SV39_PAGE_SIZE && (page->flags & PMM_PAGE_MOVABLE) != 0;
+        *page = (struct pmm_page){ 0 };
+        struct pmm_movable_page** link = MOVABLE ? pmm_movable_find(owner, region) : NULL;
+        if (link != NULL) {
+                // The frame stays counted as movable until it is back in the backend, so a block arena refill in
+                // between doesn't mistake its megablock for a pinned one.
+                error_t err = pmm_backend_free(owner, region, RISCV_SV39_PAGE_SIZE);
+                if (error_is_err(err)) {
+                        return err;
+                }
+                pmm_movable_forget(pmm_mega_of(owner, region), link);
+                owner->free_bytes += RISCV_SV39_PAGE_SIZE;
+                free_bytes += RISCV_SV39_PAGE_SIZE;
+                return EC_SUCCESS;
+        }
+        if (aligned_size == RISCV_SV39_PAGE_SIZE) {
+                pmm_magazine_free(region);
+                return EC_SUCCESS;
+        }
+
+        error_t err = pmm_backend_free(owner, region, aligned_size);
+        if (error_is_err(err)) {
+                return err;
+        }
+        owner->free_bytes += aligned_size;
+        free_bytes += aligned_size;
+        return EC_SUCCESS;
+}
+
+/// Checks that `region` is the start of a plain allocation of `old_aligned` bytes that can span `size` bytes within its
+/// memory region, and returns its region and metadata.
+error_t
+pmm_resize_target(paddr_t region,
+                  size_t old_aligned,
+                  size_t size,
+                  struct pmm_memory_region** owner,
+                  struct pmm_page** page)
+{
+        if (!IS_ALIGNED(region, RISCV_SV39_PAGE_SIZE) || size == 0) {
+                return EC_PMM_INVALID_FREE;
+        }
+        *owner = pmm_find_region(region);
+        if (*owner == NULL || region + size > (*owner)->region_base + (*owner)->region_size) {
+                return EC_PMM_INVALID_FREE;
+        }
+        *page = pmm_page_in(*owner, region);
+        if (((*page)->flags & PMM_PAGE_ALLOCATED) == 0) {
+                return EC_PMM_PAGE_NOT_ALLOCATED;
+        }
+        if (((*page)->flags & PMM_PAGE_MOVABLE) != 0 || (*page)->pages * RISCV_SV39_PAGE_SIZE != old_aligned) {
+                return EC_PMM_INVALID_FREE;
+        }
+        return EC_SUCCESS;
+}
+
+error_t
+pmm_grow_in_place(paddr_t region, size_t old_size, size_t new_size)
+{
+        size_t old_aligned = ALIGN_UP(old_size, RISCV_SV39_PAGE_SIZE);
+        size_t new_aligned = ALIGN_UP(new_size, RISCV_SV39_PAGE_SIZE);
+        struct pmm_memory_region* owner = NULL;
+        struct pmm_page* page = NULL;
+        error_t err = pmm_resize_target(region, old_aligned, new_aligned, &owner, &page);
+        if (error_is_err(err)) {
+                return err;
+        }
+        if (new_aligned <= old_aligned) {
+                return EC_SUCCESS;
+        }
+
+        // Frames right after the allocation may sit in the frame bitmap rather than the backend, they're given back
+        // to it before trying again.
+        size_t grown = new_aligned - old_aligned;
+        err = pmm_backend_claim_span(owner, region + old_aligned, grown);
+        if (error_is_err(err)) {
+                pmm_frame_drain(owner);
+                err = pmm_backend_claim_span(owner, region + old_aligned, grown);
+        }
+        if (error_is_err(err)) {
+                return err;
+        }
+        owner->free_bytes -= grown;
+        free_bytes -= grown;
+        size_t pages = new_aligned / RISCV_SV39_PAGE_SIZE;
+        page->pages = pages;
+        page->order = 64 - __builtin_clzl(pages - 1);
+        return EC_SUCCESS;
+}
+
+error_t
+pmm_shrink_in_place(paddr_t region, size_t old_size, size_t new_size)
+{
+        size_t old_aligned = ALIGN_UP(old_size, RISCV_SV39_PAGE_SIZE);
+        size_t new_aligned = ALIGN_UP(new_size, RISCV_SV39_PAGE_SIZE);
+        struct pmm_memory_region* owner = NULL;
+        struct pmm_page* page = NULL;
+        error_t err = pmm_resize_target(region, old_aligned, old_aligned, &owner, &page);
+        if (error_is_err(err)) {
+                return err;
+        }
+        if (new_aligned == 0) {
+                return EC_PMM_INVALID_FREE;
+        }
+        if (new_aligned >= old_aligned) {
+                return EC_SUCCESS;
+        }
+
+        size_t released = old_aligned - new_aligned;
+        err = pmm_backend_free(owner, region + new_aligned, released);
+        if (error_is_err(err)) {
+                return err;
+        }
+        owner->free_bytes += released;
+        free_bytes += released;
+        size_t pages = new_aligned / RISCV_SV39_PAGE_SIZE;
+        page->pages = pages;
+        page->order = pages > 1 ? 64 - __builtin_clzl(pages - 1) : 0;
+        return EC_SUCCESS;
+}
+
+error_t
+pmm_alloc_movable(u64 flags, pmm_migrate_fn migrate_fn, void* context, paddr_t* frame)
+{
+        if (frame == NULL || migrate_fn == NULL) {
+                return EC_NULL_ARGUMENT;
+        }
+        struct pmm_movable_page* page = slab_allocate(&movable_arena);
+        if (page == NULL) {
+                return EC_PMM_OUT_OF_MEMORY;
+        }
+        struct pmm_memory_region* region = pmm_movable_frame_alloc(frame);
+        if (region == NULL) {
+                pmm_drain_caches();
+                region = pmm_movable_frame_alloc(frame);
+        }
+        if (region == NULL) {
+                error_t err = slab_free(&movable_arena, page);
+                ASSERT(error_is_ok(err));
+                *frame = 0;
+                return EC_PMM_OUT_OF_MEMORY;
+        }
+        region->free_bytes -= RISCV_SV39_PAGE_SIZE;
+        free_bytes -= RISCV_SV39_PAGE_SIZE;
+        if ((flags & PMM_ALLOC_NOZERO) == 0) {
+                memzero(kernel_hhdm_phys_to_virt(*frame), RISCV_SV39_PAGE_SIZE);
+        }
+
+        pmm_page_track(*frame, RISCV_SV39_PAGE_SIZE, PMM_PAGE_MOVABLE);
+        struct pmm_megablock* mega = pmm_mega_of(region, *frame);
+        page->frame = *frame;
+        page->migrate_fn = migrate_fn;
+        page->context = context;
+        page->next = mega->movable;
+        mega->movable = page;
+        mega->movable_pages++;
+        return EC_SUCCESS;
+}
+
+size_t
+pmm_compact(size_t megapages)
+{
+        size_t freed = 0;
+        while (freed < megapages) {
+                pmm_drain_caches();
+
+                // The cheapest megablock to empty is the one with the fewest movable frames, among those that hold
+                // nothing but free and movable frames.
+                struct pmm_memory_region* best_region = NULL;
+                size_t best_index = 0;
+                for (size_t i = 0; i < region_count; i++) {
+                        for (size_t index = 0; index < regions[i]->mega_count; index++) {
+                                struct pmm_megablock* mega = &regions[i]->megablocks[index];
+                                bool MOVABLE_ONLY = mega->movable_pages > 0 &&
+                                                    mega->free_pages + mega->movable_pages == MEGABLOCK_PAGES;
+                                if (!MOVABLE_ONLY || !pmm_mega_whole(regions[i], index)) {
+                                        continue;
+                                }
+                                if (best_region == NULL ||
+                                    mega->movable_pages < best_region->megablocks[best_index].movable_pages) {
+                                        best_region = regions[i];
+                                        best_index = index;
+                                }
+                        }
+                }
+                if (best_region == NULL || error_is_err(pmm_compact_megablock(best_region, best_index))) {
+                        break;
+                }
+                freed++;
+        }
+        pmm_drain_caches();
+        return freed;
+}
+
+size_t
+pmm_free_megapages(void)
+{
+        size_t count = 0;
+        for (size_t i = 0; i < region_count; i++) {
+                for (size_t index = 0; index < regions[i]->mega_count; index++) {
+                        if (regions[i]->megablocks[index].free_pages == MEGABLOCK_PAGES &&
+                            pmm_mega_whole(regions[i], index)) {
+                                count++;
+                        }
+                }
+        }
+        return count;
+}
+
+struct pmm_page*
+pmm_page_of(paddr_t frame)
+{
+        struct pmm_memory_region* region = pmm_find_region(frame);
+        if (region == NULL) {
+                return NULL;
+        }
+        return pmm_page_in(region, frame);
+}
+
+error_t
+pmm_page_get(paddr_t frame)
+{
+        struct pmm_page* page = pmm_page_of(frame);
+        if (page == NULL || (page->flags & PMM_PAGE_ALLOCATED) == 0) {
+                return EC_PMM_PAGE_NOT_ALLOCATED;
+        }
+        page->refcount++;
+        return EC_SUCCESS;
+}
+
+error_t
+pmm_page_put(paddr_t frame)
+{
+        struct pmm_page* page = pmm_page_of(frame);
+        if (page == NULL || (page->flags & PMM_PAGE_ALLOCATED) == 0) {
+                return EC_PMM_PAGE_NOT_ALLOCATED;
+        }
+        ASSERT(page->refcount > 0);
+        if (--page->refcount > 0) {
+                return EC_SUCCESS;
+        }
+        return pmm_free(frame, (size_t)page->pages * RISCV_SV39_PAGE_SIZE);
+}
+
+size_t
+pmm_metadata_memory(void)
+{
+        return metadata_bytes;
+}
+
+size_t
+pmm_page_metadata_memory(void)
+{
+        return page_metadata_bytes;
+}
+
+error_t
+pmm_magazine_stats(u64 hartid, struct pmm_magazine_stats* stats)
+{
+        if (stats == NULL) {
+                return EC_NULL_ARGUMENT;
+        }
+        if (hartid >= KERNEL_MAX_HARTS) {
+                return EC_PMM_INVALID_HART;
+        }
+        *stats = magazines[hartid].stats;
+        return EC_SUCCESS;
+}
+
+error_t
+pmm_register_reclaim(pmm_reclaim_fn reclaim_fn, void* context)
+{
+        if (reclaim_fn == NULL) {
+                return EC_NULL_ARGUMENT;
+        }
+        if (reclaim_hook_count == RECLAIM_HOOK_COUNT) {
+                return EC_PMM_RECLAIM_LIST_FULL;
+        }
+        reclaim_hooks[reclaim_hook_count++] = (struct pmm_reclaim_hook){ reclaim_fn, context };
+        return EC_SUCCESS;
+}
+
+size_t
+pmm_region_count(void)
+{
+        return region_count;
+}
+
+error_t
+pmm_region_stats(size_t index, struct pmm_region_stats* stats)
+{
+        if (stats == NULL) {
+                return EC_NULL_ARGUMENT;
+        }
+        if (index >= region_count) {
+                return EC_PMM_INVALID_REGION;
+        }
+        pmm_stats_collect(regions[index], stats);
+        return EC_SUCCESS;
+}
+
+error_t
+pmm_alloc_stats(struct pmm_alloc_stats* stats)
+{
+        if (stats == NULL) {
+                return EC_NULL_ARGUMENT;
+        }
+        *stats = (struct pmm_alloc_stats){ 0 };
+        for (size_t hart = 0; hart < KERNEL_MAX_HARTS; hart++) {
+                for (size_t class = 0; class < PMM_STATS_SIZE_CLASSES; class++) {
+                        stats->allocations[class] += alloc_stats[hart].allocations[class];
+                        stats->failures[class] += alloc_stats[hart].failures[class];
+                }
+                for (size_t bucket = 0; bucket < PMM_STATS_LATENCY_BUCKETS; bucket++) {
+                        stats->latency[bucket] += alloc_stats[hart].latency[bucket];
+                }
+        }
+        return EC_SUCCESS;
+}
+
+size_t
+pmm_largest_free_run(void)
+{
+        size_t largest = 0;
+        for (size_t i = 0; i < region_count; i++) {
+                struct pmm_region_stats stats;
+                pmm_stats_collect(regions[i], &stats);
+                if (stats.largest_free_run > largest) {
+                        largest = stats.largest_free_run;
+                }
+        }
+        return largest;
+}
+
+void
+pmm_print_stats(void)
 {
-        return EC_NOT_IMPLEMENTED;
+        kprintln(SV("pmm: {X} of {X} bytes free, largest free run {X} bytes."),
+                 pmm_free_memory(),
+                 total_bytes,
+                 pmm_largest_free_run());
+        for (size_t i = 0; i < region_count; i++) {
+                struct pmm_region_stats stats;
+                pmm_stats_collect(regions[i], &stats);
+                kprintln(SV("pmm: region {X} of {X} bytes, {X} free, {D} cached frames, largest free run {X}."),
+                         stats.region_base,
+                         stats.region_size,
+                         stats.free_bytes,
+                         stats.cached_frames,
+                         stats.largest_free_run);
+                for (size_t class = 0; class < PMM_STATS_SIZE_CLASSES; class++) {
+                        if (stats.free_runs[class] != 0) {
+                                kprintln(SV("pmm:   free runs of order {D}: {D}"), class, stats.free_runs[class]);
+                        }
+                }
+        }
+
+        struct pmm_alloc_stats allocs;
+        error_t err = pmm_alloc_stats(&allocs);
+        ASSERT(error_is_ok(err));
+        for (size_t class = 0; class < PMM_STATS_SIZE_CLASSES; class++) {
+                if (allocs.allocations[class] != 0 || allocs.failures[class] != 0) {
+                        kprintln(SV("pmm: order {D} allocations: {D} succeeded, {D} failed"),
+                                 class,
+                                 allocs.allocations[class],
+                                 allocs.failures[class]);
+                }
+        }
+        for (size_t bucket = 0; bucket < PMM_STATS_LATENCY_BUCKETS; bucket++) {
+                if (allocs.latency[bucket] != 0) {
+                        kprintln(SV("pmm: allocations taking 2^{D} cycles: {D}"), bucket, allocs.latency[bucket]);
+                }
+        }
 }
 
 size_t
 pmm_free_memory(void)
 {
-        return free_bytes;
+        size_t cached_bytes = 0;
+        for (size_t hart = 0; hart < KERNEL_MAX_HARTS; hart++) {
+                cached_bytes += (magazines[hart].count + zero_pools[hart].count) * RISCV_SV39_PAGE_SIZE;
+        }
+        return free_bytes + cached_bytes;
 }
 
 size_t
 pmm_total_memory(void)
 {
         return total_bytes;
-}
\ No newline at end of file
+}
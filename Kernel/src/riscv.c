@@ -1,3 +1,4 @@
+#include <assert.h>
 #include <fmt/print.h>
 #include <kvspace.h>
 #include <pmm.h>
@@ -139,6 +140,479 @@ riscv_sv39_unmap_small_page(struct riscv_sv39_pt* root, vaddr_t va, paddr_t* pa)
         return EC_SUCCESS;
 }
 
+error_t
+riscv_sv39_unmap_megapage(struct riscv_sv39_pt* root, vaddr_t va, paddr_t* pa)
+{
+        if (!IS_ALIGNED(va, RISCV_SV39_MEGAPAGE_SIZE)) {
+                return EC_RISCV_SV39_UNALIGNED_ADDR;
+        }
+
+        u64 vpn[] = {
+                (va >> 21) & 0x1FF, // Level 1 index
+                (va >> 30) & 0x1FF  // Level 2 index
+        };
+
+        u64* l2_entry = &root->entries[vpn[1]];
+        if (!riscv_sv39_pte_valid(*l2_entry)) {
+                return EC_RISCV_SV39_NO_MAPPING;
+        } else if (riscv_sv39_pte_leaf(*l2_entry)) {
+                return EC_RISCV_SV39_MAPPING_EXISTS;
+        }
+
+        struct riscv_sv39_pt* l1_pt = kernel_hhdm_phys_to_virt(riscv_sv39_pte_get_address(*l2_entry));
+        u64* l1_entry = &l1_pt->entries[vpn[0]];
+        if (!riscv_sv39_pte_valid(*l1_entry)) {
+                return EC_RISCV_SV39_NO_MAPPING;
+        } else if (!riscv_sv39_pte_leaf(*l1_entry)) {
+                return EC_RISCV_SV39_MAPPING_EXISTS;
+        }
+
+        if (pa != NULL) {
+                *pa = riscv_sv39_pte_get_address(*l1_entry);
+        }
+        *l1_entry = 0;
+        return EC_SUCCESS;
+}
+
+/// Index of `va` in a table at the given level (2 for the root).
+size_t
+riscv_sv39_index(vaddr_t va, size_t level)
+{
+        return (va >> (12 + 9 * level)) & 0x1FF;
+}
+
+/// Returns the table an entry points to, creating it if the entry is empty.
+error_t
+riscv_sv39_next_table(u64* entry, struct riscv_sv39_pt** table)
+{
+        if (!riscv_sv39_pte_valid(*entry)) {
+                paddr_t new_page;
+                error_t err = pmm_alloc(RISCV_SV39_PAGE_SIZE, &new_page);
+                if (error_is_err(err)) {
+                        return error_push(err, EC_RISCV_SV39_ALLOC_FAILED);
+                }
+                *entry = riscv_sv39_create_pte(new_page, RISCV_SV39_PTFLAG_VALID);
+        } else if (riscv_sv39_pte_leaf(*entry)) {
+                return EC_RISCV_SV39_MAPPING_EXISTS;
+        }
+        *table = kernel_hhdm_phys_to_virt(riscv_sv39_pte_get_address(*entry));
+        return EC_SUCCESS;
+}
+
+void
+riscv_tlb_batch_add(struct riscv_tlb_batch* batch, vaddr_t va)
+{
+        if (batch->count == RISCV_TLB_BATCH_SIZE) {
+                batch->full = true;
+        }
+        if (!batch->full) {
+                batch->addrs[batch->count++] = va;
+        }
+}
+
+void
+riscv_tlb_batch_flush(struct riscv_tlb_batch* batch)
+{
+        bool GLOBAL = batch->asid == RISCV_TLB_GLOBAL;
+        if (batch->full && GLOBAL) {
+                riscv_sfence_vma();
+        } else if (batch->full) {
+                riscv_sfence_vma_asid(batch->asid);
+        }
+        for (size_t i = 0; !batch->full && i < batch->count; i++) {
+                if (GLOBAL) {
+                        riscv_sfence_vma_addr(batch->addrs[i]);
+                } else {
+                        riscv_sfence_vma_addr_asid(batch->addrs[i], batch->asid);
+                }
+        }
+        batch->count = 0;
+        batch->full = false;
+}
+
+/// Frees the table an entry at the given level points to, along with the tables below it, if none of them maps
+/// anything anymore. Returns true if the entry was emptied. Freed tables may still be cached by the page table walker,
+/// which only a full flush drops, so `tlb` is marked full.
+bool
+riscv_sv39_reclaim_table(u64* entry, size_t level, struct riscv_tlb_batch* tlb)
+{
+        ASSERT(level > 0);
+        struct riscv_sv39_pt* table = kernel_hhdm_phys_to_virt(riscv_sv39_pte_get_address(*entry));
+        for (size_t i = 0; i < RISCV_SV39_PT_ENTRY_COUNT; i++) {
+                u64 pte = table->entries[i];
+                if (!riscv_sv39_pte_valid(pte)) {
+                        continue;
+                }
+                bool IS_LEAF = level == 1 || riscv_sv39_pte_leaf(pte);
+                if (IS_LEAF || !riscv_sv39_reclaim_table(&table->entries[i], level - 1, tlb)) {
+                        return false;
+                }
+        }
+        error_t err = pmm_free(riscv_sv39_pte_get_address(*entry), RISCV_SV39_PAGE_SIZE);
+        ASSERT(error_is_ok(err));
+        *entry = 0;
+        tlb->full = true;
+        return true;
+}
+
+/// Maps `[va, end)` below a table at the given level (2 for the root). `mapped` is moved past every leaf written, so
+/// that a failed range can be undone.
+error_t
+riscv_sv39_map_level(struct riscv_sv39_pt* pt,
+                     size_t level,
+                     vaddr_t va,
+                     vaddr_t end,
+                     paddr_t pa,
+                     u64 flags,
+                     vaddr_t* mapped,
+                     struct riscv_tlb_batch* tlb)
+{
+        u64 size = RISCV_SV39_LEVEL_SIZE(level);
+        while (va < end) {
+                vaddr_t next = ALIGN_DOWN(va, size) + size;
+                next = next < end && next != 0 ? next : end;
+                u64* entry = &pt->entries[riscv_sv39_index(va, level)];
+                bool FITS_LEAF = next - va == size && IS_ALIGNED(pa, size);
+                bool IS_TABLE = riscv_sv39_pte_valid(*entry) && !riscv_sv39_pte_leaf(*entry);
+                // A table left behind by an earlier unmap is replaced by the leaf if it's empty, and mapped into
+                // otherwise, so that only leaves in the way of the range count as an existing mapping.
+                if (level > 0 && FITS_LEAF && IS_TABLE && riscv_sv39_reclaim_table(entry, level, tlb)) {
+                        IS_TABLE = false;
+                }
+                if (level == 0 || (FITS_LEAF && !IS_TABLE)) {
+                        if (riscv_sv39_pte_valid(*entry)) {
+                                return EC_RISCV_SV39_MAPPING_EXISTS;
+                        }
+                        *entry = riscv_sv39_create_pte(pa, flags | RISCV_SV39_PTFLAG_VALID);
+                        riscv_tlb_batch_add(tlb, va);
+                        *mapped = next;
+                } else {
+                        struct riscv_sv39_pt* table = NULL;
+                        error_t err = riscv_sv39_next_table(entry, &table);
+                        if (error_is_ok(err)) {
+                                err = riscv_sv39_map_level(table, level - 1, va, next, pa, flags, mapped, tlb);
+                        }
+                        if (error_is_err(err)) {
+                                return err;
+                        }
+                }
+                pa += next - va;
+                va = next;
+        }
+        return EC_SUCCESS;
+}
+
+/// Replaces a mega or giga page leaf at the given level with a table of leaves one level down, which map the same
+/// memory with the same flags.
+error_t
+riscv_sv39_split_leaf(u64* entry, size_t level)
+{
+        paddr_t new_page;
+        error_t err = pmm_alloc_flags(RISCV_SV39_PAGE_SIZE, RISCV_SV39_PAGE_SIZE, PMM_ALLOC_NOZERO, &new_page);
+        if (error_is_err(err)) {
+                return error_push(err, EC_RISCV_SV39_ALLOC_FAILED);
+        }
+        struct riscv_sv39_pt* table = kernel_hhdm_phys_to_virt(new_page);
+        paddr_t pa = riscv_sv39_pte_get_address(*entry);
+        u64 flags = *entry & RISCV_SV39_PTE_FLAGS_MASK;
+        for (size_t i = 0; i < RISCV_SV39_PT_ENTRY_COUNT; i++) {
+                table->entries[i] = riscv_sv39_create_pte(pa + i * RISCV_SV39_LEVEL_SIZE(level - 1), flags);
+        }
+        *entry = riscv_sv39_create_pte(new_page, RISCV_SV39_PTFLAG_VALID);
+        return EC_SUCCESS;
+}
+
+/// What `riscv_sv39_unmap_level()` does with the leaves it removes.
+struct riscv_sv39_unmap_state
+{
+        riscv_sv39_unmap_fn unmapped;
+        void* context;
+        struct riscv_tlb_batch* tlb;
+};
+
+/// Unmaps `[va, end)` below a table at the given level (2 for the root).
+error_t
+riscv_sv39_unmap_level(struct riscv_sv39_pt* pt,
+                       size_t level,
+                       vaddr_t va,
+                       vaddr_t end,
+                       struct riscv_sv39_unmap_state* state)
+{
+        u64 size = RISCV_SV39_LEVEL_SIZE(level);
+        while (va < end) {
+                vaddr_t next = ALIGN_DOWN(va, size) + size;
+                next = next < end && next != 0 ? next : end;
+                u64* entry = &pt->entries[riscv_sv39_index(va, level)];
+                if (!riscv_sv39_pte_valid(*entry)) {
+                        va = next;
+                        continue;
+                }
+                bool COVERED = next - va == size;
+                if (riscv_sv39_pte_leaf(*entry) && !COVERED) {
+                        error_t err = riscv_sv39_split_leaf(entry, level);
+                        if (error_is_err(err)) {
+                                return err;
+                        }
+                }
+                if (riscv_sv39_pte_leaf(*entry)) {
+                        if (state->unmapped != NULL) {
+                                state->unmapped(state->context, va, riscv_sv39_pte_get_address(*entry), size);
+                        }
+                        *entry = 0;
+                        riscv_tlb_batch_add(state->tlb, va);
+                } else if (level > 0) {
+                        struct riscv_sv39_pt* table = kernel_hhdm_phys_to_virt(riscv_sv39_pte_get_address(*entry));
+                        error_t err = riscv_sv39_unmap_level(table, level - 1, va, next, state);
+                        if (error_is_err(err)) {
+                                return err;
+                        }
+                }
+                va = next;
+        }
+        return EC_SUCCESS;
+}
+
+error_t
+riscv_sv39_map_range(struct riscv_sv39_pt* root,
+                     vaddr_t va,
+                     paddr_t pa,
+                     size_t len,
+                     u64 flags,
+                     struct riscv_tlb_batch* tlb)
+{
+        bool ALIGNED = IS_ALIGNED(va, RISCV_SV39_PAGE_SIZE) && IS_ALIGNED(pa, RISCV_SV39_PAGE_SIZE) &&
+                       IS_ALIGNED(len, RISCV_SV39_PAGE_SIZE);
+        if (!ALIGNED) {
+                return EC_RISCV_SV39_UNALIGNED_ADDR;
+        }
+        struct riscv_tlb_batch local = { .asid = RISCV_TLB_GLOBAL };
+        struct riscv_tlb_batch* batch = tlb != NULL ? tlb : &local;
+
+        vaddr_t mapped = va;
+        error_t err = riscv_sv39_map_level(root, 2, va, va + len, pa, flags, &mapped, batch);
+        if (error_is_err(err) && mapped != va) {
+                struct riscv_sv39_unmap_state undo = { .unmapped = NULL, .context = NULL, .tlb = batch };
+                error_t undo_err = riscv_sv39_unmap_level(root, 2, va, mapped, &undo);
+                ASSERT(error_is_ok(undo_err));
+        }
+        if (tlb == NULL) {
+                riscv_tlb_batch_flush(&local);
+        }
+        return err;
+}
+
+error_t
+riscv_sv39_unmap_range(struct riscv_sv39_pt* root,
+                       vaddr_t va,
+                       size_t len,
+                       riscv_sv39_unmap_fn unmapped,
+                       void* context,
+                       struct riscv_tlb_batch* tlb)
+{
+        if (!IS_ALIGNED(va, RISCV_SV39_PAGE_SIZE) || !IS_ALIGNED(len, RISCV_SV39_PAGE_SIZE)) {
+                return EC_RISCV_SV39_UNALIGNED_ADDR;
+        }
+        struct riscv_tlb_batch local = { .asid = RISCV_TLB_GLOBAL };
+        struct riscv_sv39_unmap_state state = {
+                .unmapped = unmapped, .context = context, .tlb = tlb != NULL ? tlb : &local
+        };
+        error_t err = riscv_sv39_unmap_level(root, 2, va, va + len, &state);
+        if (tlb == NULL) {
+                riscv_tlb_batch_flush(&local);
+        }
+        return err;
+}
+
+/// What `riscv_sv39_share_level()` does with the leaves it shares.
+struct riscv_sv39_share_state
+{
+        riscv_sv39_share_fn shared;
+        void* context;
+        struct riscv_tlb_batch* tlb;
+};
+
+/// Shares the leaves of `[va, end)` below the table `src` at the given level (2 for the root) with `dst`, the table at
+/// the same place in the other page table.
+error_t
+riscv_sv39_share_level(struct riscv_sv39_pt* src,
+                       struct riscv_sv39_pt* dst,
+                       size_t level,
+                       vaddr_t va,
+                       vaddr_t end,
+                       struct riscv_sv39_share_state* state)
+{
+        u64 size = RISCV_SV39_LEVEL_SIZE(level);
+        while (va < end) {
+                vaddr_t next = ALIGN_DOWN(va, size) + size;
+                next = next < end && next != 0 ? next : end;
+                size_t index = riscv_sv39_index(va, level);
+                u64* entry = &src->entries[index];
+                if (!riscv_sv39_pte_valid(*entry)) {
+                        va = next;
+                        continue;
+                }
+                bool COVERED = next - va == size;
+                if (riscv_sv39_pte_leaf(*entry) && !COVERED) {
+                        error_t err = riscv_sv39_split_leaf(entry, level);
+                        if (error_is_err(err)) {
+                                return err;
+                        }
+                }
+                if (riscv_sv39_pte_leaf(*entry)) {
+                        if (riscv_sv39_pte_valid(dst->entries[index])) {
+                                return EC_RISCV_SV39_MAPPING_EXISTS;
+                        }
+                        if (riscv_sv39_pte_writable(*entry)) {
+                                *entry = (*entry & ~(u64)RISCV_SV39_PTFLAG_WRITE) | RISCV_SV39_PTFLAG_COW;
+                                riscv_tlb_batch_add(state->tlb, va);
+                        }
+                        dst->entries[index] = *entry;
+                        if (state->shared != NULL) {
+                                state->shared(state->context, va, riscv_sv39_pte_get_address(*entry), size);
+                        }
+                } else if (level > 0) {
+                        struct riscv_sv39_pt* table = kernel_hhdm_phys_to_virt(riscv_sv39_pte_get_address(*entry));
+                        struct riscv_sv39_pt* dst_table = NULL;
+                        error_t err = riscv_sv39_next_table(&dst->entries[index], &dst_table);
+                        if (error_is_ok(err)) {
+                                err = riscv_sv39_share_level(table, dst_table, level - 1, va, next, state);
+                        }
+                        if (error_is_err(err)) {
+                                return err;
+                        }
+                }
+                va = next;
+        }
+        return EC_SUCCESS;
+}
+
+error_t
+riscv_sv39_share_range(struct riscv_sv39_pt* src,
+                       struct riscv_sv39_pt* dst,
+                       vaddr_t va,
+                       size_t len,
+                       riscv_sv39_share_fn shared,
+                       void* context,
+                       struct riscv_tlb_batch* tlb)
+{
+        if (!IS_ALIGNED(va, RISCV_SV39_PAGE_SIZE) || !IS_ALIGNED(len, RISCV_SV39_PAGE_SIZE)) {
+                return EC_RISCV_SV39_UNALIGNED_ADDR;
+        }
+        struct riscv_sv39_share_state state = { .shared = shared, .context = context, .tlb = tlb };
+        return riscv_sv39_share_level(src, dst, 2, va, va + len, &state);
+}
+
+/// Sets the global bit on every leaf below a table at the given level (2 for the root).
+void
+riscv_sv39_mark_global_level(struct riscv_sv39_pt* pt, size_t level, size_t first, size_t last)
+{
+        for (size_t i = first; i < last; i++) {
+                u64 pte = pt->entries[i];
+                if (!riscv_sv39_pte_valid(pte)) {
+                        continue;
+                }
+                if (riscv_sv39_pte_leaf(pte)) {
+                        pt->entries[i] = pte | RISCV_SV39_PTFLAG_GLOBAL;
+                } else if (level > 0) {
+                        struct riscv_sv39_pt* next = kernel_hhdm_phys_to_virt(riscv_sv39_pte_get_address(pte));
+                        riscv_sv39_mark_global_level(next, level - 1, 0, RISCV_SV39_PT_ENTRY_COUNT);
+                }
+        }
+}
+
+void
+riscv_sv39_mark_global(struct riscv_sv39_pt* root)
+{
+        riscv_sv39_mark_global_level(root, 2, RISCV_SV39_PT_ENTRY_COUNT / 2, RISCV_SV39_PT_ENTRY_COUNT);
+}
+
+/// Page tables are allocated this many at a time while copying a page table.
+#define RISCV_SV39_TABLE_BATCH 16
+
+/// Frames for the tables of a page table copy, allocated in batches of `RISCV_SV39_TABLE_BATCH`.
+struct riscv_sv39_table_batch
+{
+        paddr_t frames[RISCV_SV39_TABLE_BATCH];
+        size_t count;
+        /// Tables still to be handed out, so that the last batch is no larger than needed.
+        size_t remaining;
+};
+
+/// Counts the tables below a table at the given level (2 for the root).
+size_t
+riscv_sv39_count_tables(struct riscv_sv39_pt* pt, size_t level)
+{
+        size_t count = 0;
+        for (size_t i = 0; level > 0 && i < RISCV_SV39_PT_ENTRY_COUNT; i++) {
+                u64 pte = pt->entries[i];
+                if (riscv_sv39_pte_valid(pte) && !riscv_sv39_pte_leaf(pte)) {
+                        struct riscv_sv39_pt* next = kernel_hhdm_phys_to_virt(riscv_sv39_pte_get_address(pte));
+                        count += 1 + riscv_sv39_count_tables(next, level - 1);
+                }
+        }
+        return count;
+}
+
+error_t
+riscv_sv39_table_batch_take(struct riscv_sv39_table_batch* batch, paddr_t* frame)
+{
+        ASSERT(batch->remaining > 0);
+        if (batch->count == 0) {
+                size_t want = batch->remaining < RISCV_SV39_TABLE_BATCH ? batch->remaining : RISCV_SV39_TABLE_BATCH;
+                error_t err = pmm_alloc_pages_bulk(want, PMM_ALLOC_NOZERO, batch->frames);
+                if (error_is_err(err)) {
+                        return error_push(err, EC_RISCV_SV39_ALLOC_FAILED);
+                }
+                batch->count = want;
+        }
+        batch->remaining--;
+        *frame = batch->frames[--batch->count];
+        return EC_SUCCESS;
+}
+
+/// Copies the entries of a table at the given level (2 for the root) into `dst`, along with every table below it.
+error_t
+riscv_sv39_copy_level(struct riscv_sv39_pt* src,
+                      struct riscv_sv39_pt* dst,
+                      size_t level,
+                      struct riscv_sv39_table_batch* batch)
+{
+        for (size_t i = 0; i < RISCV_SV39_PT_ENTRY_COUNT; i++) {
+                u64 pte = src->entries[i];
+                if (!riscv_sv39_pte_valid(pte) || riscv_sv39_pte_leaf(pte) || level == 0) {
+                        dst->entries[i] = pte;
+                        continue;
+                }
+
+                paddr_t new_page;
+                error_t err = riscv_sv39_table_batch_take(batch, &new_page);
+                if (error_is_err(err)) {
+                        return err;
+                }
+                struct riscv_sv39_pt* next_src = kernel_hhdm_phys_to_virt(riscv_sv39_pte_get_address(pte));
+                err = riscv_sv39_copy_level(next_src, kernel_hhdm_phys_to_virt(new_page), level - 1, batch);
+                if (error_is_err(err)) {
+                        return err;
+                }
+                dst->entries[i] = riscv_sv39_create_pte(new_page, pte & RISCV_SV39_PTE_FLAGS_MASK);
+        }
+        return EC_SUCCESS;
+}
+
+error_t
+riscv_sv39_copy(struct riscv_sv39_pt* root, struct riscv_sv39_pt** copy)
+{
+        // The tables are counted up front, so they can be allocated in batches rather than one at a time.
+        struct riscv_sv39_table_batch batch = { .count = 0, .remaining = 1 + riscv_sv39_count_tables(root, 2) };
+        paddr_t new_root;
+        error_t err = riscv_sv39_table_batch_take(&batch, &new_root);
+        if (error_is_err(err)) {
+                return err;
+        }
+        *copy = kernel_hhdm_phys_to_virt(new_root);
+        return riscv_sv39_copy_level(root, *copy, 2, &batch);
+}
+
 paddr_t
 riscv_sv39_virt_to_phys(struct riscv_sv39_pt* root, vaddr_t va)
 {
@@ -154,7 +628,7 @@ riscv_sv39_virt_to_phys(struct riscv_sv39_pt* root, vaddr_t va)
                 return 0;
         } else if (riscv_sv39_pte_leaf(l2_entry)) {
                 paddr_t pa = riscv_sv39_pte_get_address(l2_entry);
-                return pa + page_offset;
+                return pa + (va & (RISCV_SV39_GIGAPAGE_SIZE - 1));
         }
 
         struct riscv_sv39_pt* l1_pt = kernel_hhdm_phys_to_virt(riscv_sv39_pte_get_address(l2_entry));
@@ -163,7 +637,7 @@ riscv_sv39_virt_to_phys(struct riscv_sv39_pt* root, vaddr_t va)
                 return 0;
         } else if (riscv_sv39_pte_leaf(l1_entry)) {
                 paddr_t pa = riscv_sv39_pte_get_address(l1_entry);
-                return pa + page_offset;
+                return pa + (va & (RISCV_SV39_MEGAPAGE_SIZE - 1));
         }
 
         struct riscv_sv39_pt* l0_pt = kernel_hhdm_phys_to_virt(riscv_sv39_pte_get_address(l1_entry));
@@ -176,4 +650,24 @@ riscv_sv39_virt_to_phys(struct riscv_sv39_pt* root, vaddr_t va)
         }
 
         return 0;
-}
\ No newline at end of file
+}
+
+u64*
+riscv_sv39_find_leaf(struct riscv_sv39_pt* root, vaddr_t va, size_t* level)
+{
+        struct riscv_sv39_pt* pt = root;
+        for (size_t current = 2;; current--) {
+                u64* entry = &pt->entries[riscv_sv39_index(va, current)];
+                if (!riscv_sv39_pte_valid(*entry)) {
+                        return NULL;
+                }
+                if (riscv_sv39_pte_leaf(*entry)) {
+                        *level = current;
+                        return entry;
+                }
+                if (current == 0) {
+                        return NULL;
+                }
+                pt = kernel_hhdm_phys_to_virt(riscv_sv39_pte_get_address(*entry));
+        }
+}
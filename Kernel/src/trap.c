@@ -3,6 +3,7 @@
 #include <fmt/print.h>
 #include <riscv.h>
 #include <trap.h>
+#include <vmm.h>
 
 u64
 kernel_c_interrupt_handler(u64 sepc, u64 stval, u64 scause, u64 sstatus, struct trap_frame* frame)
@@ -52,12 +53,34 @@ kernel_c_interrupt_handler(u64 sepc, u64 stval, u64 scause, u64 sstatus, struct
 u64
 kernel_c_exception_handler(u64 sepc, u64 stval, u64 scause, u64 sstatus, struct trap_frame* frame)
 {
+        u64 cause_code = scause & 0xFFF;
+        u64 next_pc = sepc;
+
+        // Page faults are routine once memory is mapped on demand, so they go to the virtual memory manager before
+        // anything is logged. Only the faults it can't resolve end up below.
+        bool IS_PAGE_FAULT = true;
+        enum vm_fault_access access = VM_FAULT_READ;
+        switch (cause_code) {
+                case EXC_TYPE_INSTRUCTION_PAGE_FAULT:
+                        access = VM_FAULT_EXECUTE;
+                        break;
+                case EXC_TYPE_LOAD_PAGE_FAULT:
+                        access = VM_FAULT_READ;
+                        break;
+                case EXC_TYPE_STORE_AMO_PAGE_FAULT:
+                        access = VM_FAULT_WRITE;
+                        break;
+                default:
+                        IS_PAGE_FAULT = false;
+                        break;
+        }
+        error_t fault_err = IS_PAGE_FAULT ? vmm_handle_fault(stval, access, sstatus) : EC_SUCCESS;
+        if (IS_PAGE_FAULT && error_is_ok(fault_err)) {
+                return next_pc;
+        }
 
         kprintln(
           SV("In exception handler! sepc: {X}, stval: {X}, scause: {X}, sstatus: {X}"), sepc, stval, scause, sstatus);
-
-        u64 cause_code = scause & 0xFFF;
-        u64 next_pc = sepc;
         switch (cause_code) {
                 case EXC_TYPE_ILLEGAL_INSTRUCTION:
                         PANIC(SV("Illegal instruction on CPU:{X} -> pc: {X}, tval: {X}"), frame->hartid, sepc, stval);
@@ -71,14 +94,25 @@ kernel_c_exception_handler(u64 sepc, u64 stval, u64 scause, u64 sstatus, struct
                         next_pc += 4;
                         break;
                 case EXC_TYPE_INSTRUCTION_PAGE_FAULT:
-                        PANIC(
-                          SV("Instruction page fault on CPU:{X} -> pc: {X}, tval: {X}"), frame->hartid, sepc, stval);
+                        PANIC(SV("Instruction page fault on CPU:{X} -> pc: {X}, tval: {X}: {V}"),
+                              frame->hartid,
+                              sepc,
+                              stval,
+                              SVP(error_string(fault_err)));
                         break;
                 case EXC_TYPE_LOAD_PAGE_FAULT:
-                        PANIC(SV("Load page fault on CPU:{X} -> pc: {X}, tval: {X}"), frame->hartid, sepc, stval);
+                        PANIC(SV("Load page fault on CPU:{X} -> pc: {X}, tval: {X}: {V}"),
+                              frame->hartid,
+                              sepc,
+                              stval,
+                              SVP(error_string(fault_err)));
                         break;
                 case EXC_TYPE_STORE_AMO_PAGE_FAULT:
-                        PANIC(SV("Store/AMO page fault on CPU:{X} -> pc: {X}, tval: {X}"), frame->hartid, sepc, stval);
+                        PANIC(SV("Store/AMO page fault on CPU:{X} -> pc: {X}, tval: {X}: {V}"),
+                              frame->hartid,
+                              sepc,
+                              stval,
+                              SVP(error_string(fault_err)));
                         break;
                 default:
                         PANIC(SV("Exception type {X} on CPU:{X} -> pc: {X}, tval: {X}"),
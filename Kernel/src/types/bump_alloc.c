@@ -1,51 +1,169 @@
 #include <assert.h>
 #include <fmt/print.h>
+#include <kvspace.h>
+#include <pmm.h>
 #include <riscv.h>
+#include <stdalign.h>
 #include <types/bump_alloc.h>
 
+/// Room an activation takes at the front of the space left in a region, its alignment included.
+#define BUMP_ACTIVATION_SPACE (sizeof(struct bump_activation) + alignof(struct bump_activation) - 1)
+
 void
 bump_initialize(struct bump_alloc* bump)
 {
         ASSERT(bump != NULL);
         bump->current = NULL;
-        bump->used_list = NULL;
+        bump->activations = NULL;
+        for (size_t bin = 0; bin < BUMP_BIN_COUNT; bin++) {
+                bump->bins[bin] = NULL;
+        }
+        bump->bin_mask = 0;
+        bump->auto_refill = false;
 }
 
 void
-insert_into_sorted_list(struct bump_alloc_region** head, struct bump_alloc_region* new_region)
+bump_autorefill_initialize(struct bump_alloc* bump)
+{
+        bump_initialize(bump);
+        bump->auto_refill = true;
+}
+
+/// Returns the first byte of a region available for allocations.
+u8*
+bump_region_start(struct bump_alloc_region* region)
 {
-        if (new_region == NULL) {
+        return (u8*)(region + 1);
+}
+
+/// Returns the bin of a region with `space` bytes of space left, rounded down.
+size_t
+bump_bin_of(size_t space)
+{
+        size_t bin = 63 - __builtin_clzl(space);
+        return bin < BUMP_BIN_COUNT ? bin : BUMP_BIN_COUNT - 1;
+}
+
+/// Files a region into the bin of the space it has left. Regions without room for a single byte past an activation
+/// stay out of the bins, they're only found again by `bump_reset_to()`.
+void
+bump_bin_insert(struct bump_alloc* bump, struct bump_alloc_region* region)
+{
+        ASSERT(region->bin_link == NULL);
+        size_t space = region->end - region->offset;
+        if (space <= BUMP_ACTIVATION_SPACE) {
                 return;
         }
+        size_t bin = bump_bin_of(space);
+        region->bin_next = bump->bins[bin];
+        region->bin_link = &bump->bins[bin];
+        if (region->bin_next != NULL) {
+                region->bin_next->bin_link = &region->bin_next;
+        }
+        bump->bins[bin] = region;
+        bump->bin_mask |= 1UL << bin;
+}
 
-        if (*head == NULL || (*head)->end - (*head)->offset <= new_region->end - new_region->offset) {
-                new_region->next = *head;
-                *head = new_region;
+/// Takes a region out of its bin, if it's in one. The space left in the region must not have changed since it was
+/// binned.
+void
+bump_bin_remove(struct bump_alloc* bump, struct bump_alloc_region* region)
+{
+        if (region->bin_link == NULL) {
                 return;
         }
+        *region->bin_link = region->bin_next;
+        if (region->bin_next != NULL) {
+                region->bin_next->bin_link = region->bin_link;
+        }
+        region->bin_next = NULL;
+        region->bin_link = NULL;
+        size_t bin = bump_bin_of(region->end - region->offset);
+        if (bump->bins[bin] == NULL) {
+                bump->bin_mask &= ~(1UL << bin);
+        }
+}
+
+/// Returns true when `size` bytes aligned to `alignment` fit in the space left in the region.
+bool
+bump_region_fits(struct bump_alloc_region* region, size_t size, size_t alignment)
+{
+        return ALIGN_UP(region->offset, alignment) + size <= (size_t)region->end;
+}
+
+/// Same as `bump_region_fits()`, for a region that has an activation written into it first.
+bool
+bump_region_fits_activated(struct bump_alloc_region* region, size_t size, size_t alignment)
+{
+        size_t activation = ALIGN_UP(region->offset, alignof(struct bump_activation));
+        return ALIGN_UP(activation + sizeof(struct bump_activation), alignment) + size <= (size_t)region->end;
+}
 
-        struct bump_alloc_region* current = *head;
-        while (current->next != NULL &&
-               (current->next->end - current->next->offset) > (new_region->end - new_region->offset)) {
-                current = current->next;
+/// Unbins the first region of the bin that fits the allocation, returns NULL if none does.
+struct bump_alloc_region*
+bump_bin_search(struct bump_alloc* bump, size_t bin, size_t size, size_t alignment)
+{
+        struct bump_alloc_region* region = bump->bins[bin];
+        while (region != NULL && !bump_region_fits_activated(region, size, alignment)) {
+                region = region->bin_next;
+        }
+        if (region != NULL) {
+                bump_bin_remove(bump, region);
+        }
+        return region;
+}
+
+/// Takes a region that fits the allocation out of its bin, or returns NULL if there is none. Every region in a bin
+/// above the one of `size + alignment` (and the room for an activation) fits, so the lowest non-empty such bin is
+/// picked off the mask. Only when all of them are empty are the bins below searched, their regions fit or not
+/// depending on how their offset is aligned.
+struct bump_alloc_region*
+bump_bin_take(struct bump_alloc* bump, size_t size, size_t alignment)
+{
+        size_t needed_bin = bump_bin_of(size + BUMP_ACTIVATION_SPACE + alignment - 1);
+        u64 larger = needed_bin + 1 < BUMP_BIN_COUNT ? bump->bin_mask & (~0UL << (needed_bin + 1)) : 0;
+        if (larger != 0) {
+                return bump_bin_search(bump, __builtin_ctzl(larger), size, alignment);
         }
+        for (size_t bin = needed_bin + 1; bin-- > bump_bin_of(size + sizeof(struct bump_activation));) {
+                struct bump_alloc_region* region = bump_bin_search(bump, bin, size, alignment);
+                if (region != NULL) {
+                        return region;
+                }
+        }
+        return NULL;
+}
 
-        new_region->next = current->next;
-        current->next = new_region;
+/// Makes a region the current one, and records the activation at the front of its space left.
+void
+bump_activate(struct bump_alloc* bump, struct bump_alloc_region* region)
+{
+        struct bump_activation* activation =
+          (struct bump_activation*)ALIGN_UP(region->offset, alignof(struct bump_activation));
+        *activation = (struct bump_activation){
+                .region = region, .offset = region->offset, .previous = bump->activations
+        };
+        bump->activations = activation;
+        region->offset = (u8*)(activation + 1);
+        bump->current = region;
 }
 
 void
 debug_print_region_list(struct bump_alloc* bump)
 {
-        kprintln(SV("Current Region: Free Space = {D} bytes"), bump->current->end - bump->current->offset);
-        struct bump_alloc_region* current = bump->used_list;
         int index = 0;
-        while (current != NULL) {
-                size_t free_space = current->end - current->offset;
-                kprintln(SV("Used Region {D}: Free Space = {D} bytes"), index, free_space);
-                current = current->next;
+        for (struct bump_activation* current = bump->activations; current != NULL; current = current->previous) {
+                size_t free_space = current->region->end - current->region->offset;
+                kprintln(SV("Activation {D}: Free Space = {D} bytes"), index, free_space);
                 index++;
         }
+        for (size_t bin = 0; bin < BUMP_BIN_COUNT; bin++) {
+                struct bump_alloc_region* current = bump->bins[bin];
+                for (; current != NULL; current = current->bin_next) {
+                        size_t free_space = current->end - current->offset;
+                        kprintln(SV("Region in bin {D}: Free Space = {D} bytes"), bin, free_space);
+                }
+        }
 }
 
 void
@@ -56,46 +174,57 @@ bump_grow(struct bump_alloc* bump, void* buffer, size_t buffer_size)
         ASSERT(buffer_size >= RISCV_SV39_PAGE_SIZE);
 
         struct bump_alloc_region* new_region = buffer;
-        buffer = (u8*)buffer + sizeof(struct bump_alloc_region);
-        buffer_size -= sizeof(struct bump_alloc_region);
-
-        new_region->offset = buffer;
-        new_region->end = buffer + buffer_size;
-        new_region->next = NULL;
+        new_region->offset = bump_region_start(new_region);
+        new_region->end = (u8*)buffer + buffer_size;
+        new_region->bin_next = NULL;
+        new_region->bin_link = NULL;
+        bump_bin_insert(bump, new_region);
+}
 
-        // Heuristically, we assume that the new region is the most empty region, and we immediately set it as the
-        // current list and move the previous `current` region into the sorted used list.
-        insert_into_sorted_list(&bump->used_list, bump->current);
-        bump->current = new_region;
+/// Adds a region from the physical memory manager that is large enough for the allocation.
+bool
+bump_refill(struct bump_alloc* bump, size_t size, size_t alignment)
+{
+        size_t needed = sizeof(struct bump_alloc_region) + BUMP_ACTIVATION_SPACE + size + alignment - 1;
+        size_t region_size = ALIGN_UP(needed, RISCV_SV39_PAGE_SIZE);
+        if (region_size < BUMP_REFILL_SIZE) {
+                region_size = BUMP_REFILL_SIZE;
+        }
+        paddr_t region = 0;
+        if (error_is_err(pmm_alloc_flags(region_size, RISCV_SV39_PAGE_SIZE, PMM_ALLOC_NOZERO, &region))) {
+                return false;
+        }
+        bump_grow(bump, kernel_hhdm_phys_to_virt(region), region_size);
+        return true;
 }
 
 void*
 bump_allocate_aligned(struct bump_alloc* bump, size_t size, size_t alignment)
 {
         ASSERT(bump != NULL);
-        if (size == 0 || bump->current == NULL) {
+        if (size == 0) {
                 return NULL;
         }
 
-        if (ALIGN_UP(bump->current->offset, alignment) + size <= (size_t)bump->current->end) {
-                u8* retval = (u8*)ALIGN_UP(bump->current->offset, alignment);
-                bump->current->offset = retval + size;
-                return retval;
+        if (bump->current == NULL || !bump_region_fits(bump->current, size, alignment)) {
+                struct bump_alloc_region* region = bump_bin_take(bump, size, alignment);
+                if (region == NULL && bump->auto_refill && bump_refill(bump, size, alignment)) {
+                        region = bump_bin_take(bump, size, alignment);
+                }
+                if (region == NULL) {
+                        return NULL;
+                }
+                // What's left of the current region goes back into the bins, so that a later allocation that fits in
+                // it still finds it.
+                if (bump->current != NULL) {
+                        bump_bin_insert(bump, bump->current);
+                }
+                bump_activate(bump, region);
         }
 
-        // We start by replacing the largest used region into the current region, and inserting the previous current region into the used list.
-        struct bump_alloc_region* new_current = bump->used_list;
-        bump->used_list = bump->used_list->next;
-        insert_into_sorted_list(&bump->used_list, bump->current);
-        bump->current = new_current;
-
-        if (ALIGN_UP(bump->current->offset, alignment) + size <= (size_t)bump->current->end) {
-                u8* retval = (u8*)ALIGN_UP(bump->current->offset, alignment);
-                bump->current->offset = retval + size;
-                return retval;
-        }
-
-        return NULL;
+        u8* retval = (u8*)ALIGN_UP(bump->current->offset, alignment);
+        bump->current->offset = retval + size;
+        return retval;
 }
 
 void*
@@ -103,3 +232,66 @@ bump_allocate(struct bump_alloc* bump, size_t size)
 {
         return bump_allocate_aligned(bump, size, 1);
 }
+
+struct bump_mark
+bump_mark(struct bump_alloc* bump)
+{
+        ASSERT(bump != NULL);
+        if (bump->current == NULL) {
+                return (struct bump_mark){ NULL, NULL };
+        }
+        return (struct bump_mark){ bump->current, bump->current->offset };
+}
+
+void
+bump_reset_to(struct bump_alloc* bump, struct bump_mark mark)
+{
+        ASSERT(bump != NULL);
+        // Activations after the mark are undone latest first, which leaves every region at the offset it had before
+        // the earliest of them. The activation the mark was taken in lies below the mark's offset in its region, later
+        // activations of the same region lie above it. A mark taken before anything was allocated undoes them all.
+        while (bump->activations != NULL) {
+                struct bump_activation activation = *bump->activations;
+                if (activation.region == mark.region && (u8*)bump->activations < mark.offset) {
+                        break;
+                }
+                bump->activations = activation.previous;
+                bump_bin_remove(bump, activation.region);
+                activation.region->offset = activation.offset;
+                if (activation.region != mark.region) {
+                        bump_bin_insert(bump, activation.region);
+                }
+        }
+        if (mark.region != NULL) {
+                ASSERT(bump->activations != NULL && bump->activations->region == mark.region);
+                ASSERT(mark.offset <= mark.region->offset);
+                bump_bin_remove(bump, mark.region);
+                mark.region->offset = mark.offset;
+        }
+        bump->current = mark.region;
+}
+
+error_t
+bump_region_free(struct bump_alloc_region* region)
+{
+        return pmm_free(kernel_hhdm_virt_to_phys(region), region->end - (u8*)region);
+}
+
+error_t
+bump_destroy(struct bump_alloc* bump)
+{
+        ASSERT(bump != NULL);
+        bump_reset_to(bump, (struct bump_mark){ NULL, NULL });
+        for (size_t bin = 0; bin < BUMP_BIN_COUNT; bin++) {
+                while (bump->bins[bin] != NULL) {
+                        struct bump_alloc_region* region = bump->bins[bin];
+                        bump_bin_remove(bump, region);
+                        error_t err = bump_region_free(region);
+                        if (error_is_err(err)) {
+                                return err;
+                        }
+                }
+        }
+        bump->bin_mask = 0;
+        return EC_SUCCESS;
+}
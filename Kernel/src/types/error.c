@@ -13,6 +13,14 @@ static struct str_view error_strings[] = {
           SV("EC_PMM_REGION_ALREADY_MANAGED: Physical memory region is already managed."),
         [EC_PMM_BAD_ALIGNMENT] = SV("EC_PMM_BAD_ALIGNMENT: Bad alignment for physical memory allocation."),
         [EC_PMM_OUT_OF_MEMORY] = SV("EC_PMM_OUT_OF_MEMORY: Physical memory manager is out of memory."),
+        [EC_PMM_INVALID_FREE] = SV("EC_PMM_INVALID_FREE: Freed region is not an allocated physical memory region."),
+        [EC_PMM_INVALID_HART] = SV("EC_PMM_INVALID_HART: Hart id is out of range for the physical memory manager."),
+        [EC_PMM_RESERVED_LIST_FULL] =
+          SV("EC_PMM_RESERVED_LIST_FULL: Physical memory manager reserved range list is full."),
+        [EC_PMM_PAGE_NOT_ALLOCATED] =
+          SV("EC_PMM_PAGE_NOT_ALLOCATED: Page does not start an allocated physical memory region."),
+        [EC_PMM_INVALID_REGION] = SV("EC_PMM_INVALID_REGION: Physical memory manager region index is out of range."),
+        [EC_PMM_RECLAIM_LIST_FULL] = SV("EC_PMM_RECLAIM_LIST_FULL: Physical memory manager reclaim hook list is full."),
 
         // RISC-V Paging Errors
         [EC_RISCV_SV39_UNALIGNED_ADDR] = SV("EC_RISCV_SV39_UNALIGNED_ADDR: Unaligned address for SV39 paging."),
@@ -20,6 +28,13 @@ static struct str_view error_strings[] = {
         [EC_RISCV_SV39_MAPPING_EXISTS] = SV("EC_RISCV_SV39_MAPPING_EXISTS: SV39 mapping already exists."),
         [EC_RISCV_SV39_NO_MAPPING] = SV("EC_RISCV_SV39_NO_MAPPING: No SV39 mapping found."),
 
+        // Virtual Memory Manager Errors
+        [EC_VMM_BAD_RANGE] = SV("EC_VMM_BAD_RANGE: Range is unaligned or outside of user space."),
+        [EC_VMM_AREA_OVERLAP] = SV("EC_VMM_AREA_OVERLAP: Range overlaps an existing area."),
+        [EC_VMM_NO_SPACE] = SV("EC_VMM_NO_SPACE: No free range of the address space is large enough."),
+        [EC_VMM_NO_AREA] = SV("EC_VMM_NO_AREA: Faulting address isn't part of any area."),
+        [EC_VMM_PROTECTION_FAULT] = SV("EC_VMM_PROTECTION_FAULT: Access isn't allowed by the area's protection."),
+
         // VirtIO Errors
         [EC_VIRTIO_INVALID_MAGIC] = SV("EC_VIRTIO_INVALID_MAGIC: Invalid VirtIO magic number."),
         [EC_VIRTIO_UNSUPPORTED_VERSION] = SV("EC_VIRTIO_UNSUPPORTED_VERSION: Unsupported VirtIO version."),
@@ -32,6 +47,7 @@ static struct str_view error_strings[] = {
         [EC_DT_BLOB_REWRITE_FAILED] = SV("EC_DT_BLOB_REWRITE_FAILED: Device tree blob rewrite failed."),
         [EC_DT_ADDRESS_CELLS_TOO_LARGE] = SV("EC_DT_ADDRESS_CELLS_TOO_LARGE: Device tree address cells too large."),
         [EC_DT_SIZE_CELLS_TOO_LARGE] = SV("EC_DT_SIZE_CELLS_TOO_LARGE: Device tree size cells too large."),
+        [EC_DT_BLOB_INVALID_TOKEN] = SV("EC_DT_BLOB_INVALID_TOKEN: Unknown structure token in device tree blob."),
 
         // Driver Errors
         [EC_DEVICE_NO_DEVICES] = SV("EC_DEVICE_NO_DEVICES: No devices found."),
@@ -1,34 +1,205 @@
 #include <assert.h>
 #include <fmt/print.h>
+#include <kernel.h>
 #include <kvspace.h>
 #include <memory.h>
+#include <pmm.h>
 #include <riscv.h>
 #include <types/error.h>
 #include <types/number.h>
 #include <types/slab.h>
 
+/// Auto refilling arenas, linked through `next_arena`, which `slab_reclaim()` shrinks.
+struct slab_alloc* slab_arenas = NULL;
+bool slab_reclaim_registered = false;
+/// Arena the magazines themselves come from, it has no magazines of its own.
+struct slab_alloc slab_magazine_arena = { 0 };
+u64 slab_cache_line = SLAB_DEFAULT_CACHE_LINE;
+
+void
+slab_set_cache_line_size(size_t line_size)
+{
+        ASSERT(line_size >= sizeof(struct slab_block) && (line_size & (line_size - 1)) == 0);
+        ASSERT(line_size <= RISCV_SV39_PAGE_SIZE);
+        slab_cache_line = line_size;
+}
+
 void
 slab_init(struct slab_alloc* arena, size_t objsize)
 {
         ASSERT(arena != NULL);
+        arena->object_size = objsize;
         arena->block_size = SLAB_BLOCK_SIZE(objsize);
+        arena->block_align = SLAB_BLOCK_ALIGN(objsize);
+        arena->cache_aligned = false;
+        arena->next_color = 0;
         arena->free_blocks = 0;
         arena->total_blocks = 0;
-        arena->current_region = NULL;
-        arena->block_list = NULL;
+        arena->slab_size = RISCV_SV39_PAGE_SIZE;
+        arena->partial = NULL;
+        arena->full = NULL;
+        arena->empty = NULL;
         arena->auto_refill = false;
+        arena->zero = true;
+        arena->ctor = NULL;
+        arena->dtor = NULL;
+        arena->link_offset = 0;
+        arena->magazines = false;
+        for (size_t hart = 0; hart < KERNEL_MAX_HARTS; hart++) {
+                arena->harts[hart] = (struct slab_hart_magazines){ NULL, NULL };
+        }
+        arena->depot_full = NULL;
+        arena->depot_empty = NULL;
+        arena->depot_full_count = 0;
+        arena->next_arena = NULL;
 }
 
 void
 slab_autorefill_init(struct slab_alloc* arena, size_t objsize)
+{
+        slab_autorefill_init_sized(arena, objsize, RISCV_SV39_PAGE_SIZE);
+}
+
+void
+slab_autorefill_init_sized(struct slab_alloc* arena, size_t objsize, size_t slab_size)
 {
         ASSERT(arena != NULL);
-        arena->block_size = SLAB_BLOCK_SIZE(objsize);
-        arena->free_blocks = 0;
-        arena->total_blocks = 0;
-        arena->current_region = NULL;
-        arena->block_list = NULL;
+        ASSERT(slab_size >= RISCV_SV39_PAGE_SIZE && (slab_size & (slab_size - 1)) == 0);
+        ASSERT(slab_size >= SLAB_REGION_SIZE(objsize, 1));
+        slab_init(arena, objsize);
+        arena->slab_size = slab_size;
         arena->auto_refill = true;
+
+        arena->next_arena = slab_arenas;
+        slab_arenas = arena;
+        if (!slab_reclaim_registered) {
+                error_t err = pmm_register_reclaim(slab_reclaim, NULL);
+                ASSERT(error_is_ok(err));
+                slab_reclaim_registered = true;
+        }
+}
+
+void
+slab_enable_magazines(struct slab_alloc* arena)
+{
+        ASSERT(arena != NULL && arena != &slab_magazine_arena);
+        if (slab_magazine_arena.block_size == 0) {
+                slab_autorefill_init(&slab_magazine_arena, sizeof(struct slab_magazine));
+                slab_set_cache_aligned(&slab_magazine_arena);
+        }
+        arena->magazines = true;
+}
+
+void
+slab_set_nozero(struct slab_alloc* arena)
+{
+        ASSERT(arena != NULL);
+        arena->zero = false;
+}
+
+/// Works out the block size, alignment and free list link offset from the object size and the layout options.
+void
+slab_layout(struct slab_alloc* arena)
+{
+        ASSERT(arena->total_blocks == 0);
+        size_t size = SLAB_BLOCK_SIZE(arena->object_size);
+        arena->link_offset = 0;
+        if (arena->ctor != NULL) {
+                arena->link_offset = ALIGN_UP(size, sizeof(struct slab_block));
+                size = arena->link_offset + sizeof(struct slab_block);
+        }
+        arena->block_align = SLAB_BLOCK_ALIGN(size);
+        if (arena->cache_aligned) {
+                size = ALIGN_UP(size, slab_cache_line);
+                arena->block_align = slab_cache_line;
+        }
+        arena->block_size = size;
+        ASSERT(arena->slab_size >= ALIGN_UP(sizeof(struct slab_region), arena->block_align) + size);
+}
+
+void
+slab_set_cache_aligned(struct slab_alloc* arena)
+{
+        ASSERT(arena != NULL);
+        arena->cache_aligned = true;
+        slab_layout(arena);
+}
+
+void
+slab_set_constructor(struct slab_alloc* arena, slab_ctor_fn ctor, slab_dtor_fn dtor)
+{
+        ASSERT(arena != NULL && ctor != NULL);
+        arena->zero = false;
+        arena->ctor = ctor;
+        arena->dtor = dtor;
+        slab_layout(arena);
+}
+
+/// Returns the free list link of a free block.
+struct slab_block*
+slab_link(struct slab_alloc* arena, void* obj)
+{
+        return (struct slab_block*)((u8*)obj + arena->link_offset);
+}
+
+void
+slab_list_push(struct slab_region** list, struct slab_region* region)
+{
+        region->previous_region = NULL;
+        region->next_region = *list;
+        if (*list != NULL) {
+                (*list)->previous_region = region;
+        }
+        *list = region;
+}
+
+void
+slab_list_remove(struct slab_region** list, struct slab_region* region)
+{
+        if (region->previous_region != NULL) {
+                region->previous_region->next_region = region->next_region;
+        } else {
+                *list = region->next_region;
+        }
+        if (region->next_region != NULL) {
+                region->next_region->previous_region = region->previous_region;
+        }
+}
+
+/// Returns the list a slab with the given number of allocated blocks belongs on.
+struct slab_region**
+slab_list_for(struct slab_alloc* arena, struct slab_region* region, u32 in_use)
+{
+        if (in_use == 0) {
+                return &arena->empty;
+        }
+        return in_use == region->capacity ? &arena->full : &arena->partial;
+}
+
+/// Sets up a single slab at the start of `buffer` and adds it to the empty list.
+void
+slab_add_region(struct slab_alloc* arena, void* buffer, bool OWNED)
+{
+        struct slab_region* region = buffer;
+        region->block_list = NULL;
+        u8* first = (u8*)ALIGN_UP(((size_t)buffer) + sizeof(struct slab_region), arena->block_align);
+        region->capacity = ((u8*)buffer + arena->slab_size - first) / arena->block_size;
+
+        // The space left over at the end of the slab is spent moving its blocks further in, by a different number of
+        // cache lines for every slab. Colors step by the block alignment when it is larger than a line.
+        size_t leftover = (u8*)buffer + arena->slab_size - first - region->capacity * arena->block_size;
+        size_t color_step = arena->block_align > slab_cache_line ? arena->block_align : slab_cache_line;
+        if (arena->next_color * color_step > leftover) {
+                arena->next_color = 0;
+        }
+        region->current_offset = first + arena->next_color * color_step;
+        arena->next_color++;
+        region->region_end = region->current_offset + region->capacity * arena->block_size;
+        region->in_use = 0;
+        region->owned = OWNED;
+        slab_list_push(&arena->empty, region);
+        arena->free_blocks += region->capacity;
+        arena->total_blocks += region->capacity;
 }
 
 void
@@ -36,36 +207,230 @@ slab_grow(struct slab_alloc* arena, void* buffer, size_t buffer_size)
 {
         ASSERT(arena != NULL);
         ASSERT(buffer != NULL);
+        ASSERT(IS_ALIGNED(buffer, arena->slab_size) && IS_ALIGNED(buffer_size, arena->slab_size));
         ASSERT(buffer_size >= SLAB_REGION_SIZE(arena->block_size, 1));
 
-        struct slab_region* new_region = buffer;
-        new_region->current_offset = (u8*)ALIGN_UP(((size_t)buffer) + sizeof(struct slab_region), arena->block_size);
-        new_region->region_end = (u8*)ALIGN_DOWN(((size_t)buffer + buffer_size), arena->block_size);
-        size_t new_blocks = (new_region->region_end - new_region->current_offset) / arena->block_size;
-        arena->free_blocks += new_blocks;
-        arena->total_blocks += new_blocks;
+        for (size_t offset = 0; offset < buffer_size; offset += arena->slab_size) {
+                slab_add_region(arena, (u8*)buffer + offset, false);
+        }
+}
 
-        if (arena->current_region == NULL) {
-                arena->current_region = new_region;
-                new_region->previous_region = NULL;
-                new_region->next_region = NULL;
-                return;
+/// Allocates a fresh slab from the physical memory manager. Every page of it names the arena as its owner, so the
+/// arena of any block can be told from its page metadata.
+bool
+slab_refill(struct slab_alloc* arena)
+{
+        paddr_t slab = 0;
+        if (error_is_err(pmm_alloc_flags(arena->slab_size, arena->slab_size, PMM_ALLOC_NOZERO, &slab))) {
+                return false;
+        }
+        for (size_t offset = 0; offset < arena->slab_size; offset += RISCV_SV39_PAGE_SIZE) {
+                pmm_page_of(slab + offset)->owner = arena;
         }
+        slab_add_region(arena, kernel_hhdm_phys_to_virt(slab), true);
+        return true;
+}
 
-        if (arena->current_region->next_region == NULL) {
-                arena->current_region->next_region = new_region;
-                new_region->next_region = NULL;
-                new_region->previous_region = arena->current_region;
-        } else {
-                new_region->next_region = arena->current_region->next_region;
-                new_region->next_region->previous_region = new_region;
-                new_region->previous_region = arena->current_region;
-                arena->current_region->next_region = new_region;
+/// Takes up to `count` blocks out of a single slab, moving it between the slab lists only once.
+size_t
+slab_region_take(struct slab_alloc* arena, struct slab_region* region, size_t count, void** objs)
+{
+        u32 in_use = region->in_use;
+        size_t taken = 0;
+        for (; taken < count && region->in_use < region->capacity; taken++, region->in_use++) {
+                if (region->block_list != NULL) {
+                        objs[taken] = (u8*)region->block_list - arena->link_offset;
+                        region->block_list = region->block_list->next_block;
+                } else {
+                        objs[taken] = region->current_offset;
+                        region->current_offset += arena->block_size;
+                        if (arena->ctor != NULL) {
+                                arena->ctor(objs[taken]);
+                        }
+                }
         }
+        slab_list_remove(slab_list_for(arena, region, in_use), region);
+        slab_list_push(slab_list_for(arena, region, region->in_use), region);
+        arena->free_blocks -= taken;
+        return taken;
+}
 
-        if (arena->current_region->current_offset == arena->current_region->region_end) {
-                arena->current_region = new_region;
+/// Takes up to `count` blocks straight out of the slabs, growing the arena as needed. Returns the number of blocks
+/// taken, which is only short of `count` when the arena can't grow.
+size_t
+slab_take_blocks(struct slab_alloc* arena, size_t count, void** objs)
+{
+        size_t taken = 0;
+        while (taken < count) {
+                struct slab_region* region = arena->partial != NULL ? arena->partial : arena->empty;
+                if (region == NULL) {
+                        if (!arena->auto_refill || !slab_refill(arena)) {
+                                break;
+                        }
+                        region = arena->empty;
+                }
+                taken += slab_region_take(arena, region, count - taken, objs + taken);
         }
+        return taken;
+}
+
+/// Takes a block straight out of the slabs.
+void*
+slab_allocate_block(struct slab_alloc* arena)
+{
+        void* retval = NULL;
+        slab_take_blocks(arena, 1, &retval);
+        return retval;
+}
+
+/// Returns blocks that all belong to the same slab to it, moving the slab between the slab lists only once.
+void
+slab_region_give(struct slab_alloc* arena, struct slab_region* region, size_t count, void** objs)
+{
+        ASSERT(region->in_use >= count);
+        u32 in_use = region->in_use;
+        for (size_t i = 0; i < count; i++) {
+                ASSERT((u8*)objs[i] >= (u8*)(region + 1) && (u8*)objs[i] < region->region_end);
+                struct slab_block* new_block = slab_link(arena, objs[i]);
+                new_block->next_block = region->block_list;
+                region->block_list = new_block;
+        }
+        region->in_use -= count;
+        slab_list_remove(slab_list_for(arena, region, in_use), region);
+        slab_list_push(slab_list_for(arena, region, region->in_use), region);
+        arena->free_blocks += count;
+}
+
+/// Returns blocks straight to their slabs, runs of blocks from the same slab are returned together.
+void
+slab_give_blocks(struct slab_alloc* arena, size_t count, void** objs)
+{
+        size_t first = 0;
+        while (first < count) {
+                struct slab_region* region = (struct slab_region*)ALIGN_DOWN(objs[first], arena->slab_size);
+                size_t last = first + 1;
+                while (last < count && (struct slab_region*)ALIGN_DOWN(objs[last], arena->slab_size) == region) {
+                        last++;
+                }
+                slab_region_give(arena, region, last - first, objs + first);
+                first = last;
+        }
+}
+
+/// Returns a block straight to its slab.
+error_t
+slab_free_block(struct slab_alloc* arena, void* obj)
+{
+        slab_give_blocks(arena, 1, &obj);
+        return EC_SUCCESS;
+}
+
+struct slab_magazine*
+slab_depot_pop(struct slab_magazine** list)
+{
+        struct slab_magazine* mag = *list;
+        if (mag != NULL) {
+                *list = mag->next;
+        }
+        return mag;
+}
+
+void
+slab_depot_push(struct slab_magazine** list, struct slab_magazine* mag)
+{
+        mag->next = *list;
+        *list = mag;
+}
+
+/// Returns every object of the magazine to the slabs.
+void
+slab_magazine_flush(struct slab_alloc* arena, struct slab_magazine* mag)
+{
+        slab_give_blocks(arena, mag->count, mag->objects);
+        mag->count = 0;
+}
+
+void*
+slab_magazine_alloc(struct slab_alloc* arena)
+{
+        u64 hartid = kernel_hartid();
+        ASSERT(hartid < KERNEL_MAX_HARTS);
+        struct slab_hart_magazines* hart = &arena->harts[hartid];
+        if (hart->loaded == NULL || hart->loaded->count == 0) {
+                if (hart->previous != NULL && hart->previous->count > 0) {
+                        struct slab_magazine* previous = hart->previous;
+                        hart->previous = hart->loaded;
+                        hart->loaded = previous;
+                } else if (arena->depot_full != NULL) {
+                        // Both magazines are empty, the previous one goes to the depot in exchange for a full one.
+                        if (hart->previous != NULL) {
+                                slab_depot_push(&arena->depot_empty, hart->previous);
+                        }
+                        hart->previous = hart->loaded;
+                        hart->loaded = slab_depot_pop(&arena->depot_full);
+                        arena->depot_full_count--;
+                } else {
+                        // The depot has nothing to give, so the loaded magazine is filled from the slabs in one go.
+                        // It's detached meanwhile, growing the slabs may reclaim memory, which drains this hart's
+                        // magazines.
+                        struct slab_magazine* mag = hart->loaded;
+                        hart->loaded = NULL;
+                        if (mag == NULL) {
+                                mag = slab_allocate(&slab_magazine_arena);
+                                if (mag == NULL) {
+                                        return slab_allocate_block(arena);
+                                }
+                        }
+                        mag->count +=
+                          slab_take_blocks(arena, SLAB_MAGAZINE_SIZE - mag->count, mag->objects + mag->count);
+                        hart->loaded = mag;
+                        if (mag->count == 0) {
+                                return NULL;
+                        }
+                }
+        }
+        return hart->loaded->objects[--hart->loaded->count];
+}
+
+void
+slab_magazine_free(struct slab_alloc* arena, void* obj)
+{
+        u64 hartid = kernel_hartid();
+        ASSERT(hartid < KERNEL_MAX_HARTS);
+        struct slab_hart_magazines* hart = &arena->harts[hartid];
+        if (hart->loaded == NULL || hart->loaded->count == SLAB_MAGAZINE_SIZE) {
+                if (hart->previous != NULL && hart->previous->count < SLAB_MAGAZINE_SIZE) {
+                        struct slab_magazine* previous = hart->previous;
+                        hart->previous = hart->loaded;
+                        hart->loaded = previous;
+                } else {
+                        // Both magazines are full, the previous one goes to the depot in exchange for an empty one.
+                        struct slab_magazine* empty = slab_depot_pop(&arena->depot_empty);
+                        if (empty == NULL) {
+                                empty = slab_allocate(&slab_magazine_arena);
+                        }
+                        if (empty == NULL) {
+                                error_t err = slab_free_block(arena, obj);
+                                ASSERT(error_is_ok(err));
+                                return;
+                        }
+                        if (hart->previous != NULL) {
+                                slab_depot_push(&arena->depot_full, hart->previous);
+                                arena->depot_full_count++;
+                        }
+                        hart->previous = hart->loaded;
+                        hart->loaded = empty;
+
+                        // A depot holding too many full magazines returns one of them to the slabs.
+                        if (arena->depot_full_count > SLAB_DEPOT_LIMIT) {
+                                struct slab_magazine* spill = slab_depot_pop(&arena->depot_full);
+                                arena->depot_full_count--;
+                                slab_magazine_flush(arena, spill);
+                                slab_depot_push(&arena->depot_empty, spill);
+                        }
+                }
+        }
+        hart->loaded->objects[hart->loaded->count++] = obj;
 }
 
 void*
@@ -73,35 +438,10 @@ slab_allocate(struct slab_alloc* arena)
 {
         ASSERT(arena != NULL);
 
-        if (arena->block_list != NULL) {
-                void* retval = arena->block_list;
-                arena->block_list = arena->block_list->next_block;
-                arena->free_blocks--;
+        void* retval = arena->magazines ? slab_magazine_alloc(arena) : slab_allocate_block(arena);
+        if (retval != NULL && arena->zero) {
                 memzero(retval, arena->block_size);
-                return retval;
-        } else if (arena->free_blocks == 0 && arena->auto_refill == false) {
-                return NULL;
-        } else if (arena->free_blocks == 0) {
-                struct allocation slab_mem = kalloc(RISCV_SV39_PAGE_SIZE, RISCV_SV39_PAGE_SIZE);
-                slab_grow(arena, slab_mem.buffer, slab_mem.size);
-        }
-
-        /// Simple allocation
-        if (arena->current_region->current_offset != arena->current_region->region_end) {
-                void* retval = arena->current_region->current_offset;
-                arena->current_region->current_offset += arena->block_size;
-                arena->free_blocks--;
-                memzero(retval, arena->block_size);
-                return retval;
         }
-
-        /// Move to the next region if the current one is full, we know there's at least one more
-        /// region because free_blocks > 0.
-        arena->current_region = arena->current_region->next_region;
-        void* retval = arena->current_region->current_offset;
-        arena->current_region->current_offset += arena->block_size;
-        arena->free_blocks--;
-        memzero(retval, arena->block_size);
         return retval;
 }
 
@@ -111,9 +451,228 @@ slab_free(struct slab_alloc* arena, void* obj)
         ASSERT(arena != NULL);
         ASSERT(obj != NULL);
 
-        struct slab_block* new_block = obj;
-        new_block->next_block = arena->block_list;
-        arena->block_list = new_block;
-        arena->free_blocks++;
+        if (arena->magazines) {
+                slab_magazine_free(arena, obj);
+                return EC_SUCCESS;
+        }
+        return slab_free_block(arena, obj);
+}
+
+size_t
+slab_allocate_bulk(struct slab_alloc* arena, size_t count, void** objs)
+{
+        ASSERT(arena != NULL);
+        ASSERT(objs != NULL || count == 0);
+
+        // Objects the calling hart has at hand go first, the rest come straight from the slabs instead of filling
+        // magazines only to empty them again.
+        size_t taken = 0;
+        if (arena->magazines) {
+                u64 hartid = kernel_hartid();
+                ASSERT(hartid < KERNEL_MAX_HARTS);
+                struct slab_hart_magazines* hart = &arena->harts[hartid];
+                struct slab_magazine* own[] = { hart->loaded, hart->previous };
+                for (size_t i = 0; i < 2; i++) {
+                        while (own[i] != NULL && own[i]->count > 0 && taken < count) {
+                                objs[taken++] = own[i]->objects[--own[i]->count];
+                        }
+                }
+        }
+        taken += slab_take_blocks(arena, count - taken, objs + taken);
+        if (arena->zero) {
+                for (size_t i = 0; i < taken; i++) {
+                        memzero(objs[i], arena->block_size);
+                }
+        }
+        return taken;
+}
+
+error_t
+slab_free_bulk(struct slab_alloc* arena, size_t count, void** objs)
+{
+        ASSERT(arena != NULL);
+        ASSERT(objs != NULL || count == 0);
+
+        size_t given = 0;
+        if (arena->magazines) {
+                u64 hartid = kernel_hartid();
+                ASSERT(hartid < KERNEL_MAX_HARTS);
+                struct slab_hart_magazines* hart = &arena->harts[hartid];
+                struct slab_magazine* own[] = { hart->loaded, hart->previous };
+                for (size_t i = 0; i < 2; i++) {
+                        while (own[i] != NULL && own[i]->count < SLAB_MAGAZINE_SIZE && given < count) {
+                                own[i]->objects[own[i]->count++] = objs[given++];
+                        }
+                }
+        }
+        slab_give_blocks(arena, count - given, objs + given);
         return EC_SUCCESS;
-}
\ No newline at end of file
+}
+
+/// Returns the objects in the depot and the calling hart's magazines to the slabs, and the magazines to their arena.
+void
+slab_magazine_drain(struct slab_alloc* arena)
+{
+        struct slab_hart_magazines* hart = &arena->harts[kernel_hartid()];
+        struct slab_magazine* own[] = { hart->loaded, hart->previous };
+        *hart = (struct slab_hart_magazines){ NULL, NULL };
+        for (size_t i = 0; i < 2; i++) {
+                if (own[i] != NULL) {
+                        slab_depot_push(&arena->depot_empty, own[i]);
+                        slab_magazine_flush(arena, own[i]);
+                }
+        }
+        for (struct slab_magazine* mag = arena->depot_full; mag != NULL; mag = mag->next) {
+                slab_magazine_flush(arena, mag);
+        }
+        struct slab_magazine* lists[] = { arena->depot_full, arena->depot_empty };
+        arena->depot_full = NULL;
+        arena->depot_empty = NULL;
+        arena->depot_full_count = 0;
+        for (size_t i = 0; i < 2; i++) {
+                while (lists[i] != NULL) {
+                        struct slab_magazine* mag = slab_depot_pop(&lists[i]);
+                        error_t err = slab_free(&slab_magazine_arena, mag);
+                        ASSERT(error_is_ok(err));
+                }
+        }
+}
+
+size_t
+slab_shrink(struct slab_alloc* arena)
+{
+        ASSERT(arena != NULL);
+
+        if (arena->magazines) {
+                slab_magazine_drain(arena);
+        }
+        size_t released = 0;
+        struct slab_region* region = arena->empty;
+        while (region != NULL) {
+                struct slab_region* next = region->next_region;
+                if (region->owned) {
+                        slab_list_remove(&arena->empty, region);
+                        arena->free_blocks -= region->capacity;
+                        arena->total_blocks -= region->capacity;
+                        if (arena->dtor != NULL) {
+                                // Every block below `current_offset` was constructed when it was carved.
+                                u8* first = region->region_end - region->capacity * arena->block_size;
+                                for (u8* obj = first; obj < region->current_offset; obj += arena->block_size) {
+                                        arena->dtor(obj);
+                                }
+                        }
+
+                        paddr_t slab = kernel_hhdm_virt_to_phys(region);
+                        for (size_t offset = 0; offset < arena->slab_size; offset += RISCV_SV39_PAGE_SIZE) {
+                                pmm_page_of(slab + offset)->owner = NULL;
+                        }
+                        error_t err = pmm_free(slab, arena->slab_size);
+                        ASSERT(error_is_ok(err));
+                        released += arena->slab_size;
+                }
+                region = next;
+        }
+        return released;
+}
+
+size_t
+slab_reclaim(void* context)
+{
+        (void)context;
+        size_t released = 0;
+        for (struct slab_alloc* arena = slab_arenas; arena != NULL; arena = arena->next_arena) {
+                released += slab_shrink(arena);
+        }
+        return released;
+}
+
+/// Slabs the coloring benchmark spreads its objects over, well past the associativity of any cache, and the number of
+/// passes it makes over them.
+#define SLAB_BENCHMARK_SLABS 64
+#define SLAB_BENCHMARK_ROUNDS 64
+/// Objects the cache alignment benchmark allocates, writes and frees.
+#define SLAB_BENCHMARK_OBJECTS 1024
+
+struct slab_alloc slab_benchmark_arena = { 0 };
+void* slab_benchmark_objs[SLAB_BENCHMARK_OBJECTS] = { 0 };
+
+/// Returns the cycles spent writing the first object of every one of `SLAB_BENCHMARK_SLABS` slabs, over and over.
+/// Without `COLORED` the first block of every slab sits at the same page offset, so they all compete for the same
+/// cache sets.
+u64
+slab_benchmark_colors(bool COLORED)
+{
+        struct slab_alloc* arena = &slab_benchmark_arena;
+        slab_init(arena, 512);
+        size_t slabs = 0;
+        for (; slabs < SLAB_BENCHMARK_SLABS; slabs++) {
+                if (!COLORED) {
+                        arena->next_color = 0;
+                }
+                if (!slab_refill(arena)) {
+                        break;
+                }
+                slab_region_take(arena, arena->empty, 1, &slab_benchmark_objs[slabs]);
+        }
+
+        u64 start = riscv_cycle();
+        for (size_t round = 0; round < SLAB_BENCHMARK_ROUNDS; round++) {
+                for (size_t i = 0; i < slabs; i++) {
+                        *(volatile u64*)slab_benchmark_objs[i] += round;
+                }
+        }
+        u64 cycles = riscv_cycle() - start;
+
+        slab_give_blocks(arena, slabs, slab_benchmark_objs);
+        slab_shrink(arena);
+        return cycles;
+}
+
+/// Returns the cycles spent allocating, writing and freeing `SLAB_BENCHMARK_OBJECTS` small objects, packed or padded
+/// out to a cache line each.
+u64
+slab_benchmark_alignment(bool CACHE_ALIGNED)
+{
+        struct slab_alloc* arena = &slab_benchmark_arena;
+        slab_init(arena, 3 * sizeof(u64));
+        if (CACHE_ALIGNED) {
+                slab_set_cache_aligned(arena);
+        }
+        // Slabs are added up front, so that only the allocator and the memory traffic are timed.
+        while (arena->free_blocks < SLAB_BENCHMARK_OBJECTS && slab_refill(arena)) {
+        }
+        size_t count = arena->free_blocks < SLAB_BENCHMARK_OBJECTS ? arena->free_blocks : SLAB_BENCHMARK_OBJECTS;
+
+        u64 start = riscv_cycle();
+        for (size_t i = 0; i < count; i++) {
+                slab_benchmark_objs[i] = slab_allocate(arena);
+                *(volatile u64*)slab_benchmark_objs[i] = i;
+        }
+        for (size_t i = 0; i < count; i++) {
+                error_t err = slab_free(arena, slab_benchmark_objs[i]);
+                ASSERT(error_is_ok(err));
+        }
+        u64 cycles = riscv_cycle() - start;
+
+        slab_shrink(arena);
+        return cycles;
+}
+
+void
+slab_benchmark(void)
+{
+        u64 colored = slab_benchmark_colors(true);
+        u64 uncolored = slab_benchmark_colors(false);
+        kprintln(SV("slab: {D} passes over {D} slabs took {D} cycles colored, {D} cycles uncolored."),
+                 SLAB_BENCHMARK_ROUNDS,
+                 SLAB_BENCHMARK_SLABS,
+                 colored,
+                 uncolored);
+
+        u64 aligned = slab_benchmark_alignment(true);
+        u64 packed = slab_benchmark_alignment(false);
+        kprintln(SV("slab: {D} objects took {D} cycles cache aligned, {D} cycles packed."),
+                 SLAB_BENCHMARK_OBJECTS,
+                 aligned,
+                 packed);
+}
@@ -1,2 +1,714 @@
+#include <assert.h>
+#include <kernel.h>
+#include <kvspace.h>
+#include <memory.h>
+#include <pmm.h>
+#include <riscv.h>
+#include <types/error.h>
+#include <types/slab.h>
 #include <vmm.h>
 
+/// Frames of anonymous areas are allocated this many at a time when an area is populated.
+#define VMM_FRAME_BATCH 16
+
+struct slab_alloc vmm_area_arena = { 0 };
+
+/// ASIDs the hart implements, ASID 0 belongs to the kernel. With no ASIDs besides it, every address space runs with
+/// ASID 0 and their translations are flushed on every switch.
+u64 vmm_asid_count = 1;
+/// Generation of the ASIDs handed out since the last rollover, and the next ASID of that generation. Generation 0
+/// marks address spaces that never had an ASID.
+u64 vmm_asid_generation = 1;
+u64 vmm_next_asid = 1;
+
+/// Address space each hart runs in, set by `address_space_activate()`.
+struct address_space* vmm_active[KERNEL_MAX_HARTS] = { 0 };
+
+void
+vmm_initialize(void)
+{
+        slab_autorefill_init(&vmm_area_arena, sizeof(struct vm_area));
+
+        // The ASID bits a hart doesn't implement are read-only zero, so writing all ones into the field and reading it
+        // back gives the largest ASID.
+        u64 satp = riscv_satp_read();
+        riscv_satp_write(satp | RISCV_SATP_ASID_MASK);
+        vmm_asid_count = ((riscv_satp_read() & RISCV_SATP_ASID_MASK) >> RISCV_SATP_ASID_SHIFT) + 1;
+        riscv_satp_write(satp);
+        riscv_sfence_vma();
+}
+
+// ===================================================================================================
+// Area Tree
+// ===================================================================================================
+
+u64
+vmm_area_height(struct vm_area* area)
+{
+        return area == NULL ? 0 : area->height;
+}
+
+/// Recomputes the height of `area` from its children.
+void
+vmm_area_update(struct vm_area* area)
+{
+        u64 left = vmm_area_height(area->left);
+        u64 right = vmm_area_height(area->right);
+        area->height = 1 + (left > right ? left : right);
+}
+
+struct vm_area*
+vmm_area_rotate_left(struct vm_area* area)
+{
+        struct vm_area* pivot = area->right;
+        area->right = pivot->left;
+        pivot->left = area;
+        vmm_area_update(area);
+        vmm_area_update(pivot);
+        return pivot;
+}
+
+struct vm_area*
+vmm_area_rotate_right(struct vm_area* area)
+{
+        struct vm_area* pivot = area->left;
+        area->left = pivot->right;
+        pivot->right = area;
+        vmm_area_update(area);
+        vmm_area_update(pivot);
+        return pivot;
+}
+
+/// Restores the AVL property at `area` once one of its subtrees grew or shrank by one level, returns the new root of
+/// the subtree.
+struct vm_area*
+vmm_area_balance(struct vm_area* area)
+{
+        vmm_area_update(area);
+        ssize_t balance = (ssize_t)vmm_area_height(area->left) - (ssize_t)vmm_area_height(area->right);
+        if (balance > 1) {
+                if (vmm_area_height(area->left->left) < vmm_area_height(area->left->right)) {
+                        area->left = vmm_area_rotate_left(area->left);
+                }
+                return vmm_area_rotate_right(area);
+        }
+        if (balance < -1) {
+                if (vmm_area_height(area->right->right) < vmm_area_height(area->right->left)) {
+                        area->right = vmm_area_rotate_right(area->right);
+                }
+                return vmm_area_rotate_left(area);
+        }
+        return area;
+}
+
+/// Inserts `area` into the subtree below `node`, returns the new root of the subtree. The closest areas passed on the
+/// way down are the neighbours of `area` in address order.
+struct vm_area*
+vmm_area_insert(struct vm_area* node, struct vm_area* area)
+{
+        if (node == NULL) {
+                return area;
+        }
+        if (area->start < node->start) {
+                if (area->next == NULL || node->start < area->next->start) {
+                        area->next = node;
+                }
+                node->left = vmm_area_insert(node->left, area);
+        } else {
+                if (area->prev == NULL || node->start > area->prev->start) {
+                        area->prev = node;
+                }
+                node->right = vmm_area_insert(node->right, area);
+        }
+        return vmm_area_balance(node);
+}
+
+/// Unlinks the lowest area of the subtree below `node` from the tree, returns the new root of the subtree.
+struct vm_area*
+vmm_area_remove_min(struct vm_area* node, struct vm_area** min)
+{
+        if (node->left == NULL) {
+                *min = node;
+                return node->right;
+        }
+        node->left = vmm_area_remove_min(node->left, min);
+        return vmm_area_balance(node);
+}
+
+/// Removes `area` from the subtree below `node`, returns the new root of the subtree.
+struct vm_area*
+vmm_area_remove(struct vm_area* node, struct vm_area* area)
+{
+        ASSERT(node != NULL);
+        if (area->start < node->start) {
+                node->left = vmm_area_remove(node->left, area);
+                return vmm_area_balance(node);
+        }
+        if (area->start > node->start) {
+                node->right = vmm_area_remove(node->right, area);
+                return vmm_area_balance(node);
+        }
+        if (node->right == NULL) {
+                return node->left;
+        }
+        struct vm_area* successor = NULL;
+        struct vm_area* right = vmm_area_remove_min(node->right, &successor);
+        successor->left = node->left;
+        successor->right = right;
+        return vmm_area_balance(successor);
+}
+
+/// Adds an area to the tree and to the list of areas.
+void
+vmm_area_link(struct address_space* as, struct vm_area* area)
+{
+        area->left = NULL;
+        area->right = NULL;
+        area->height = 1;
+        area->prev = NULL;
+        area->next = NULL;
+        as->tree = vmm_area_insert(as->tree, area);
+        if (area->prev != NULL) {
+                area->prev->next = area;
+        } else {
+                as->first = area;
+        }
+        if (area->next != NULL) {
+                area->next->prev = area;
+        }
+        as->area_count++;
+}
+
+/// Removes an area from the tree and from the list of areas.
+void
+vmm_area_unlink(struct address_space* as, struct vm_area* area)
+{
+        as->tree = vmm_area_remove(as->tree, area);
+        if (area->prev != NULL) {
+                area->prev->next = area->next;
+        } else {
+                as->first = area->next;
+        }
+        if (area->next != NULL) {
+                area->next->prev = area->prev;
+        }
+        as->area_count--;
+}
+
+struct vm_area*
+address_space_find(struct address_space* as, vaddr_t vaddr)
+{
+        struct vm_area* node = as->tree;
+        while (node != NULL) {
+                if (vaddr < node->start) {
+                        node = node->left;
+                } else if (vaddr >= node->end) {
+                        node = node->right;
+                } else {
+                        return node;
+                }
+        }
+        return NULL;
+}
+
+struct vm_area*
+address_space_find_range(struct address_space* as, vaddr_t start, vaddr_t end)
+{
+        // Areas don't overlap, so the lowest area ending past `start` is the only candidate.
+        struct vm_area* found = NULL;
+        struct vm_area* node = as->tree;
+        while (node != NULL) {
+                if (node->end > start) {
+                        found = node;
+                        node = node->left;
+                } else {
+                        node = node->right;
+                }
+        }
+        return found != NULL && found->start < end ? found : NULL;
+}
+
+// ===================================================================================================
+// Mappings
+// ===================================================================================================
+
+/// Page table flags of the leaves of an area.
+u64
+vmm_pte_flags(struct vm_area* area)
+{
+        u64 flags = RISCV_SV39_PTFLAG_ACCESSED | RISCV_SV39_PTFLAG_DIRTY;
+        flags |= (area->prot & VM_PROT_READ) != 0 ? RISCV_SV39_PTFLAG_READ : 0;
+        flags |= (area->prot & VM_PROT_WRITE) != 0 ? RISCV_SV39_PTFLAG_WRITE : 0;
+        flags |= (area->prot & VM_PROT_EXECUTE) != 0 ? RISCV_SV39_PTFLAG_EXECUTE : 0;
+        flags |= (area->prot & VM_PROT_USER) != 0 ? RISCV_SV39_PTFLAG_USER : 0;
+        return flags;
+}
+
+/// Drops the reference an unmapped leaf of an anonymous area held on its frame, which is freed unless another address
+/// space still shares it.
+void
+vmm_release_frames(void* context, vaddr_t va, paddr_t pa, size_t size)
+{
+        (void)context;
+        (void)size;
+        error_t err = pmm_page_put(pa);
+        if (error_is_err(err)) {
+                PANIC(SV("vmm: Failed to free the frames behind {X}: {V}"), va, SVP(error_string(err)));
+        }
+}
+
+/// Unmaps the pages of `area` in `[start, end)`, and frees their frames if the area owns them. Pages that aren't
+/// mapped are skipped.
+void
+vmm_unmap_pages(struct address_space* as,
+                struct vm_area* area,
+                vaddr_t start,
+                vaddr_t end,
+                struct riscv_tlb_batch* tlb)
+{
+        riscv_sv39_unmap_fn release = area->backing == VM_BACKING_ANONYMOUS ? &vmm_release_frames : NULL;
+        error_t err = riscv_sv39_unmap_range(as->root, start, end - start, release, NULL, tlb);
+        if (error_is_err(err)) {
+                PANIC(SV("vmm: Failed to unmap {X}: {V}"), start, SVP(error_string(err)));
+        }
+}
+
+/// Maps every page of `area`. On failure, whatever was mapped so far is left for the caller to undo.
+error_t
+vmm_map_area(struct address_space* as, struct vm_area* area, struct riscv_tlb_batch* tlb)
+{
+        u64 flags = vmm_pte_flags(area);
+        if (area->backing == VM_BACKING_PHYSICAL) {
+                return riscv_sv39_map_range(as->root, area->start, area->phys, area->end - area->start, flags, tlb);
+        }
+
+        vaddr_t va = area->start;
+        while (va < area->end) {
+                size_t count = (area->end - va) / RISCV_SV39_PAGE_SIZE;
+                count = count < VMM_FRAME_BATCH ? count : VMM_FRAME_BATCH;
+                paddr_t frames[VMM_FRAME_BATCH];
+                error_t err = pmm_alloc_pages_bulk(count, PMM_ALLOC_DEFAULT, frames);
+                if (error_is_err(err)) {
+                        return err;
+                }
+                for (size_t i = 0; i < count; i++, va += RISCV_SV39_PAGE_SIZE) {
+                        err = riscv_sv39_map_small_page(as->root, va, frames[i], flags);
+                        if (error_is_err(err)) {
+                                for (; i < count; i++) {
+                                        error_t free_err = pmm_free(frames[i], RISCV_SV39_PAGE_SIZE);
+                                        ASSERT(error_is_ok(free_err));
+                                }
+                                return err;
+                        }
+                        riscv_tlb_batch_add(tlb, va);
+                }
+        }
+        return EC_SUCCESS;
+}
+
+/// Creates an area over `[vaddr, vaddr + size)` and maps it.
+error_t
+vmm_add_area(struct address_space* as, vaddr_t vaddr, size_t size, struct vm_area layout)
+{
+        bool IN_USER_SPACE = vaddr >= VMM_USER_START && vaddr < VMM_USER_END && size <= VMM_USER_END - vaddr;
+        if (size == 0 || !IN_USER_SPACE || !IS_ALIGNED(vaddr, RISCV_SV39_PAGE_SIZE) ||
+            !IS_ALIGNED(size, RISCV_SV39_PAGE_SIZE)) {
+                return EC_VMM_BAD_RANGE;
+        }
+        if (address_space_find_range(as, vaddr, vaddr + size) != NULL) {
+                return EC_VMM_AREA_OVERLAP;
+        }
+        struct vm_area* area = slab_allocate(&vmm_area_arena);
+        if (area == NULL) {
+                return EC_PMM_OUT_OF_MEMORY;
+        }
+        *area = layout;
+        area->start = vaddr;
+        area->end = vaddr + size;
+
+        // Anonymous areas are left unmapped unless asked otherwise, their pages are filled in as they fault.
+        if ((area->flags & VM_AREA_POPULATE) == 0) {
+                vmm_area_link(as, area);
+                return EC_SUCCESS;
+        }
+        struct riscv_tlb_batch tlb = { .asid = as->asid };
+        error_t err = vmm_map_area(as, area, &tlb);
+        if (error_is_err(err)) {
+                vmm_unmap_pages(as, area, area->start, area->end, &tlb);
+                riscv_tlb_batch_flush(&tlb);
+                error_t free_err = slab_free(&vmm_area_arena, area);
+                ASSERT(error_is_ok(free_err));
+                return err;
+        }
+        riscv_tlb_batch_flush(&tlb);
+        vmm_area_link(as, area);
+        return EC_SUCCESS;
+}
+
+error_t
+address_space_allocate_fixed(struct address_space* as, vaddr_t vaddr, size_t size, u64 prot, u64 flags)
+{
+        struct vm_area layout = { .prot = prot, .flags = flags, .backing = VM_BACKING_ANONYMOUS };
+        return vmm_add_area(as, vaddr, size, layout);
+}
+
+error_t
+address_space_allocate(struct address_space* as, vaddr_t* vaddr, size_t size, size_t alignment, u64 prot, u64 flags)
+{
+        if (vaddr == NULL) {
+                return EC_NULL_ARGUMENT;
+        }
+        bool BAD_ALIGNMENT = alignment < RISCV_SV39_PAGE_SIZE || (alignment & (alignment - 1)) != 0;
+        if (size == 0 || size > VMM_USER_END || BAD_ALIGNMENT) {
+                return EC_VMM_BAD_RANGE;
+        }
+        size = ALIGN_UP(size, RISCV_SV39_PAGE_SIZE);
+
+        // The gaps between areas are visited in address order until one is large enough.
+        vaddr_t candidate = ALIGN_UP(VMM_USER_START, alignment);
+        for (struct vm_area* area = as->first; area != NULL && candidate + size > area->start; area = area->next) {
+                candidate = candidate > area->end ? candidate : ALIGN_UP(area->end, alignment);
+        }
+        if (candidate >= VMM_USER_END || size > VMM_USER_END - candidate) {
+                return EC_VMM_NO_SPACE;
+        }
+        error_t err = address_space_allocate_fixed(as, candidate, size, prot, flags);
+        if (error_is_ok(err)) {
+                *vaddr = candidate;
+        }
+        return err;
+}
+
+error_t
+address_space_map_physical(struct address_space* as, vaddr_t vaddr, paddr_t paddr, size_t size, u64 prot)
+{
+        if (!IS_ALIGNED(paddr, RISCV_SV39_PAGE_SIZE)) {
+                return EC_VMM_BAD_RANGE;
+        }
+        struct vm_area layout = {
+                .prot = prot, .flags = VM_AREA_POPULATE, .backing = VM_BACKING_PHYSICAL, .phys = paddr
+        };
+        return vmm_add_area(as, vaddr, size, layout);
+}
+
+error_t
+address_space_unmap(struct address_space* as, vaddr_t vaddr, size_t size)
+{
+        if (!IS_ALIGNED(vaddr, RISCV_SV39_PAGE_SIZE) || vaddr >= VMM_USER_END || size > VMM_USER_END - vaddr) {
+                return EC_VMM_BAD_RANGE;
+        }
+        vaddr_t end = ALIGN_UP(vaddr + size, RISCV_SV39_PAGE_SIZE);
+        struct riscv_tlb_batch tlb = { .asid = as->asid };
+        struct vm_area* area = address_space_find_range(as, vaddr, end);
+        while (area != NULL && area->start < end) {
+                struct vm_area* next = area->next;
+                vaddr_t from = area->start > vaddr ? area->start : vaddr;
+                vaddr_t to = area->end < end ? area->end : end;
+                bool KEEPS_HEAD = area->start < from;
+                bool KEEPS_TAIL = area->end > to;
+
+                // A range in the middle of an area splits it in two, the part after the range becomes a new area.
+                if (KEEPS_HEAD && KEEPS_TAIL) {
+                        struct vm_area* tail = slab_allocate(&vmm_area_arena);
+                        if (tail == NULL) {
+                                riscv_tlb_batch_flush(&tlb);
+                                return EC_PMM_OUT_OF_MEMORY;
+                        }
+                        *tail = *area;
+                        tail->start = to;
+                        tail->phys = area->phys + (to - area->start);
+                        area->end = from;
+                        vmm_area_link(as, tail);
+                } else if (KEEPS_HEAD) {
+                        area->end = from;
+                } else if (KEEPS_TAIL) {
+                        // The start of the area moves up, but stays between its neighbours, so the tree stays ordered.
+                        area->phys += to - area->start;
+                        area->start = to;
+                } else {
+                        vmm_area_unlink(as, area);
+                }
+
+                vmm_unmap_pages(as, area, from, to, &tlb);
+                if (!KEEPS_HEAD && !KEEPS_TAIL) {
+                        error_t err = slab_free(&vmm_area_arena, area);
+                        ASSERT(error_is_ok(err));
+                }
+                area = next;
+        }
+        riscv_tlb_batch_flush(&tlb);
+        return EC_SUCCESS;
+}
+
+// ===================================================================================================
+// ASIDs
+// ===================================================================================================
+
+/// Gives the address space an ASID of the current generation unless it already has one. Once the generation runs out
+/// of ASIDs a new one starts, and the TLB is flushed so that no translation of the previous generation's ASIDs is
+/// left. Only the calling hart's TLB is flushed, the kernel only runs on the boot hart for now.
+void
+vmm_asid_assign(struct address_space* as)
+{
+        if (vmm_asid_count <= 1) {
+                as->asid = 0;
+                return;
+        }
+        if (as->asid_generation == vmm_asid_generation) {
+                return;
+        }
+        if (vmm_next_asid == vmm_asid_count) {
+                vmm_asid_generation++;
+                vmm_next_asid = 1;
+                riscv_sfence_vma();
+        }
+        as->asid = vmm_next_asid++;
+        as->asid_generation = vmm_asid_generation;
+}
+
+void
+address_space_activate(struct address_space* as)
+{
+        vmm_asid_assign(as);
+        u64 satp = riscv_satp_read() & ~(RISCV_SATP_ASID_MASK | RISCV_SATP_PPN_MASK);
+        satp |= as->asid << RISCV_SATP_ASID_SHIFT;
+        satp |= kernel_hhdm_virt_to_phys(as->root) >> 12;
+        riscv_satp_write(satp);
+        if (vmm_asid_count <= 1) {
+                riscv_sfence_vma_asid(0);
+        }
+        u64 hartid = kernel_hartid();
+        ASSERT(hartid < KERNEL_MAX_HARTS);
+        vmm_active[hartid] = as;
+}
+
+// ===================================================================================================
+// Address Spaces
+// ===================================================================================================
+
+error_t
+address_space_initialize(struct address_space* as, struct riscv_sv39_pt* kernel_root)
+{
+        paddr_t root = 0;
+        error_t err = pmm_alloc(RISCV_SV39_PAGE_SIZE, &root);
+        if (error_is_err(err)) {
+                return err;
+        }
+        *as = (struct address_space){ .root = kernel_hhdm_phys_to_virt(root), .tree = NULL, .first = NULL };
+        for (size_t i = RISCV_SV39_PT_ENTRY_COUNT / 2; i < RISCV_SV39_PT_ENTRY_COUNT; i++) {
+                as->root->entries[i] = kernel_root->entries[i];
+        }
+        return EC_SUCCESS;
+}
+
+/// Frees the tables below a table at the given level (2 for the root), which must no longer map anything.
+void
+vmm_free_tables(struct riscv_sv39_pt* pt, size_t level, size_t first, size_t last)
+{
+        for (size_t i = first; level > 0 && i < last; i++) {
+                u64 pte = pt->entries[i];
+                if (!riscv_sv39_pte_valid(pte) || riscv_sv39_pte_leaf(pte)) {
+                        continue;
+                }
+                paddr_t table = riscv_sv39_pte_get_address(pte);
+                vmm_free_tables(kernel_hhdm_phys_to_virt(table), level - 1, 0, RISCV_SV39_PT_ENTRY_COUNT);
+                error_t err = pmm_free(table, RISCV_SV39_PAGE_SIZE);
+                ASSERT(error_is_ok(err));
+                pt->entries[i] = 0;
+        }
+}
+
+void
+address_space_destroy(struct address_space* as)
+{
+        // The address space must not be active anywhere. Its ASID isn't handed out again before the next generation,
+        // which starts with a flush, so its translations needn't be flushed now.
+        struct riscv_tlb_batch tlb = { .asid = as->asid };
+        struct vm_area* area = as->first;
+        while (area != NULL) {
+                struct vm_area* next = area->next;
+                vmm_unmap_pages(as, area, area->start, area->end, &tlb);
+                error_t err = slab_free(&vmm_area_arena, area);
+                ASSERT(error_is_ok(err));
+                area = next;
+        }
+
+        // Only the user half tables belong to the address space, the kernel half is shared.
+        vmm_free_tables(as->root, 2, 0, RISCV_SV39_PT_ENTRY_COUNT / 2);
+        error_t err = pmm_free(kernel_hhdm_virt_to_phys(as->root), RISCV_SV39_PAGE_SIZE);
+        ASSERT(error_is_ok(err));
+        *as = (struct address_space){ .root = NULL, .tree = NULL, .first = NULL };
+}
+
+/// Takes a reference to the frame of a leaf shared with a cloned address space.
+void
+vmm_share_frame(void* context, vaddr_t va, paddr_t pa, size_t size)
+{
+        (void)context;
+        (void)size;
+        error_t err = pmm_page_get(pa);
+        if (error_is_err(err)) {
+                PANIC(SV("vmm: Failed to share the frame behind {X}: {V}"), va, SVP(error_string(err)));
+        }
+}
+
+error_t
+address_space_clone(struct address_space* parent, struct address_space* child)
+{
+        // The kernel half of the parent's root is the kernel's.
+        error_t err = address_space_initialize(child, parent->root);
+        if (error_is_err(err)) {
+                return err;
+        }
+
+        // The child never ran, so nothing of it is cached in the TLB and its new leaves needn't be flushed. The
+        // parent's leaves that lost their write permission must be.
+        struct riscv_tlb_batch fresh = { .asid = child->asid };
+        struct riscv_tlb_batch tlb = { .asid = parent->asid };
+        for (struct vm_area* area = parent->first; area != NULL && error_is_ok(err); area = area->next) {
+                struct vm_area* copy = slab_allocate(&vmm_area_arena);
+                if (copy == NULL) {
+                        err = EC_PMM_OUT_OF_MEMORY;
+                        break;
+                }
+                // The area is linked before it's mapped, so that destroying a half cloned child releases whatever
+                // was shared with it so far.
+                *copy = *area;
+                vmm_area_link(child, copy);
+                if (area->backing == VM_BACKING_PHYSICAL) {
+                        err = vmm_map_area(child, copy, &fresh);
+                } else {
+                        err = riscv_sv39_share_range(parent->root,
+                                                     child->root,
+                                                     area->start,
+                                                     area->end - area->start,
+                                                     &vmm_share_frame,
+                                                     NULL,
+                                                     &tlb);
+                }
+        }
+        riscv_tlb_batch_flush(&tlb);
+        if (error_is_err(err)) {
+                address_space_destroy(child);
+        }
+        return err;
+}
+
+// ===================================================================================================
+// Page Faults
+// ===================================================================================================
+
+/// Gives the faulting address space a private, writable copy of a copy-on-write page. The last address space sharing a
+/// frame takes it over without copying.
+error_t
+vmm_break_cow(struct address_space* as, struct vm_area* area, vaddr_t page, u64* entry)
+{
+        paddr_t shared = riscv_sv39_pte_get_address(*entry);
+        struct pmm_page* meta = pmm_page_of(shared);
+        ASSERT(meta != NULL && meta->refcount > 0);
+        u64 flags = vmm_pte_flags(area) | RISCV_SV39_PTFLAG_VALID;
+        if (meta->refcount == 1) {
+                *entry = riscv_sv39_create_pte(shared, flags);
+        } else {
+                paddr_t copy = 0;
+                error_t err = pmm_alloc_flags(RISCV_SV39_PAGE_SIZE, RISCV_SV39_PAGE_SIZE, PMM_ALLOC_NOZERO, &copy);
+                if (error_is_err(err)) {
+                        return err;
+                }
+                memcopy(kernel_hhdm_phys_to_virt(copy), kernel_hhdm_phys_to_virt(shared), RISCV_SV39_PAGE_SIZE);
+                *entry = riscv_sv39_create_pte(copy, flags);
+                err = pmm_page_put(shared);
+                ASSERT(error_is_ok(err));
+        }
+        struct riscv_tlb_batch tlb = { .asid = as->asid };
+        riscv_tlb_batch_add(&tlb, page);
+        riscv_tlb_batch_flush(&tlb);
+        return EC_SUCCESS;
+}
+
+/// Returns true if a leaf with the given flags allows the access, making the same checks as the hart. `sstatus` is the
+/// value at the time of the fault, its SPP bit tells the privilege mode the access was made from.
+bool
+vmm_leaf_allows(u64 pte, enum vm_fault_access access, u64 sstatus)
+{
+        bool FROM_USER = (sstatus & RISCV_SSTATUS_SPP) == 0;
+        bool USER_PAGE = (pte & RISCV_SV39_PTFLAG_USER) != 0;
+        if (FROM_USER && !USER_PAGE) {
+                return false;
+        }
+        // Supervisor mode only loads from and stores to user pages with SUM set, and never executes them.
+        if (!FROM_USER && USER_PAGE && (access == VM_FAULT_EXECUTE || (sstatus & RISCV_SSTATUS_SUM) == 0)) {
+                return false;
+        }
+        switch (access) {
+                case VM_FAULT_READ:
+                        return riscv_sv39_pte_readable(pte) ||
+                               ((sstatus & RISCV_SSTATUS_MXR) != 0 && riscv_sv39_pte_executable(pte));
+                case VM_FAULT_WRITE:
+                        return riscv_sv39_pte_writable(pte);
+                case VM_FAULT_EXECUTE:
+                        return riscv_sv39_pte_executable(pte);
+        }
+        return false;
+}
+
+error_t
+address_space_handle_fault(struct address_space* as, vaddr_t vaddr, enum vm_fault_access access, u64 sstatus)
+{
+        struct vm_area* area = address_space_find(as, vaddr);
+        if (area == NULL) {
+                return EC_VMM_NO_AREA;
+        }
+        if (!vmm_leaf_allows(vmm_pte_flags(area), access, sstatus)) {
+                return EC_VMM_PROTECTION_FAULT;
+        }
+        // Physical areas are mapped in full when they're created, so a fault in one can't be resolved.
+        if (area->backing != VM_BACKING_ANONYMOUS) {
+                return EC_VMM_PROTECTION_FAULT;
+        }
+
+        vaddr_t page = ALIGN_DOWN(vaddr, RISCV_SV39_PAGE_SIZE);
+        size_t level = 0;
+        u64* entry = riscv_sv39_find_leaf(as->root, page, &level);
+        if (entry != NULL && access == VM_FAULT_WRITE && (*entry & RISCV_SV39_PTFLAG_COW) != 0) {
+                // Anonymous areas are only ever mapped with small pages.
+                ASSERT(level == 0);
+                return vmm_break_cow(as, area, page, entry);
+        }
+
+        // A mapped page the access is allowed on was faulted on through a stale translation, flushing it is all that's
+        // left.
+        if (entry != NULL && !vmm_leaf_allows(*entry, access, sstatus)) {
+                return EC_VMM_PROTECTION_FAULT;
+        }
+        // Otherwise the page was never touched. A plain allocation takes a frame from the pre-zeroed pool first, and
+        // only zeroes one itself when the pool is empty.
+        if (entry == NULL) {
+                paddr_t frame = 0;
+                error_t err = pmm_alloc(RISCV_SV39_PAGE_SIZE, &frame);
+                if (error_is_err(err)) {
+                        return err;
+                }
+                err = riscv_sv39_map_small_page(as->root, page, frame, vmm_pte_flags(area));
+                if (error_is_err(err)) {
+                        error_t free_err = pmm_free(frame, RISCV_SV39_PAGE_SIZE);
+                        ASSERT(error_is_ok(free_err));
+                        return err;
+                }
+        }
+        struct riscv_tlb_batch tlb = { .asid = as->asid };
+        riscv_tlb_batch_add(&tlb, page);
+        riscv_tlb_batch_flush(&tlb);
+        return EC_SUCCESS;
+}
+
+error_t
+vmm_handle_fault(vaddr_t vaddr, enum vm_fault_access access, u64 sstatus)
+{
+        u64 hartid = kernel_hartid();
+        ASSERT(hartid < KERNEL_MAX_HARTS);
+        if (vmm_active[hartid] == NULL) {
+                return EC_VMM_NO_AREA;
+        }
+        return address_space_handle_fault(vmm_active[hartid], vaddr, access, sstatus);
+}